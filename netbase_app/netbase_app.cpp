@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "core/test_server.h"
 #include "core/test_client.h"
+#include "core/test_transfer.h"
 #include "core/logger.h"
 
 
@@ -102,14 +103,26 @@ int main(int argc, char **argv)
         const size_t maxTicks = argc > 2 ? atoi(argv[2]) : 10;
         const std::string mode = argc > 1 ? argv[1] : "server";
 
+        SocketOptions options;
+        options.batchedIO = argc > 3 && std::string(argv[3]) == "batched";
+        if (argc > 3 && std::string(argv[3]) == "uring")
+            options.backend = SocketOptions::IoUringBackend;
+
         if (mode == "server")
         {
-            TestServer server(ioThread, 13999, maxTicks);
+            TestServer server(ioThread, 13999, maxTicks, options);
+        }
+        else if (mode == "transfer")
+        {
+            // netbase_app transfer <MB per object> <loss percent>
+            const size_t megabytes = argc > 2 ? atoi(argv[2]) : 16;
+            const double loss = argc > 3 ? atof(argv[3]) / 100 : 0;
+            TestTransfer transfer(ioThread, 13997, megabytes * 1024 * 1024, 1, loss);
         }
         else
         {
-            TestClient client(ioThread, 0, maxTicks);
-            TestClient client2(ioThread, 0, maxTicks);
+            TestClient client(ioThread, 0, maxTicks, options);
+            TestClient client2(ioThread, 0, maxTicks, options);
             //TestClient client3(ioThread, 0, maxTicks);
             //TestClient client4(ioThread, 0, maxTicks);
         }
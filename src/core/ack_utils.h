@@ -1,6 +1,13 @@
 #pragma once
+#include <algorithm>
 #include <cstdint>
 #include <cassert>
+#include <limits>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
 namespace core {
@@ -16,10 +23,129 @@ namespace core {
     }
 
 
+    // number of set bits
+    inline int popCount(uint64_t bits)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        return int(__popcnt64(bits));
+#elif defined(__GNUC__)
+        return __builtin_popcountll(bits);
+#else
+        int count = 0;
+        for (; bits; bits &= bits - 1)
+            ++count;
+        return count;
+#endif
+    }
+
+
+    // index of the lowest set bit, bits must not be zero
+    inline int countTrailingZeros(uint64_t bits)
+    {
+        assert(bits);
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return int(index);
+#elif defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#else
+        int index = 0;
+        for (; !(bits & 1); bits >>= 1)
+            ++index;
+        return index;
+#endif
+    }
+
+
+    // ack bits wider than any integer: 64-bit words, the lowest first. Loops over them
+    // have fixed length, compiler unrolls them and keeps words in vector registers
+    template <size_t Words>
+    struct WideBits
+    {
+        uint64_t words[Words];
+    };
+
+
+    // bit operations ack needs, for integers and wide bits alike; set bits are visited
+    // with ctz and counted with popcount, clear ones cost nothing
+
+    template <class T>
+    inline typename std::enable_if<std::is_integral<T>::value>::type shiftBits(T& bits, unsigned n)
+    {
+        bits = n >= sizeof(T) * 8 ? T(0) : T(bits << n);
+    }
+
+    template <class T>
+    inline typename std::enable_if<std::is_integral<T>::value>::type setBit(T& bits, unsigned index)
+    {
+        bits |= T(T(1) << index);
+    }
+
+    template <class T>
+    inline typename std::enable_if<std::is_integral<T>::value, int>::type countBitsBelow(const T& bits, unsigned n)
+    {
+        return popCount(n >= 64 ? uint64_t(bits) : uint64_t(bits) & ((uint64_t(1) << n) - 1));
+    }
+
+    template <class T, class Fn>
+    inline typename std::enable_if<std::is_integral<T>::value>::type forEachSetBit(const T& bits, Fn&& func)
+    {
+        for (uint64_t word = bits; word; word &= word - 1)
+            func(unsigned(countTrailingZeros(word)));
+    }
+
+    template <size_t Words>
+    inline void shiftBits(WideBits<Words>& bits, unsigned n)
+    {
+        const size_t wordShift = n / 64;
+        const unsigned bitShift = n % 64;
+        for (size_t i = Words; i-- > 0; )
+        {
+            uint64_t word = i >= wordShift ? bits.words[i - wordShift] << bitShift : 0;
+            if (bitShift && i > wordShift)
+                word |= bits.words[i - wordShift - 1] >> (64 - bitShift);
+            bits.words[i] = word;
+        }
+    }
+
+    template <size_t Words>
+    inline void setBit(WideBits<Words>& bits, unsigned index)
+    {
+        bits.words[index / 64] |= uint64_t(1) << (index % 64);
+    }
+
+    template <size_t Words>
+    inline int countBitsBelow(const WideBits<Words>& bits, unsigned n)
+    {
+        int count = 0;
+        for (size_t i = 0; i < Words && n > 0; ++i, n = n > 64 ? n - 64 : 0)
+            count += popCount(n >= 64 ? bits.words[i] : bits.words[i] & ((uint64_t(1) << n) - 1));
+        return count;
+    }
+
+    template <size_t Words, class Fn>
+    inline void forEachSetBit(const WideBits<Words>& bits, Fn&& func)
+    {
+        for (size_t i = 0; i < Words; ++i)
+        {
+            for (uint64_t word = bits.words[i]; word; word &= word - 1)
+                func(unsigned(i * 64 + countTrailingZeros(word)));
+        }
+    }
+
+
+    template <class T>
+    struct is_ack_bits : std::is_integral<T> {};
+
+    template <size_t Words>
+    struct is_ack_bits<WideBits<Words>> : std::true_type {};
+
+
     template <class T, class Enable>
     class basic_ack_impl;
 
-    template <class T, class = typename std::enable_if<std::is_integral<T>::value>::type>
+    template <class T, class = typename std::enable_if<is_ack_bits<T>::value>::type>
     class basic_ack_impl {};
 
 #pragma pack(push, 1)
@@ -29,12 +155,15 @@ namespace core {
     {
     public:
 
+        // seqNums one ack covers: the latest and one per bit before it
+        static const int cWindow = sizeof(BitsType) * 8 + 1;
+
         // default ctr, zero means packet 0 was acked
-        basic_ack() : m_ack(0), m_bits(0) {}
+        basic_ack() : m_ack(0), m_bits() {}
 
         // get most recent seqNum from ack
         uint16_t latestSeqNum() const { return m_ack; }
-        BitsType ackBits() const { return m_bits; }
+        const BitsType& ackBits() const { return m_bits; }
         
         // acknowledge seqNum, update ack and ackBits
         void updateForSeqNum(uint16_t seqNum);
@@ -43,16 +172,13 @@ namespace core {
         template <class Fn>
         void forEachAckedSeqNum(Fn& func) const;
 
+        // how many acknowledged seqNums are more recent than seqNum
+        int countAckedAfter(uint16_t seqNum) const;
+
     private:
 
         static const int cMaxDelta = sizeof(BitsType) * 8;
 
-        BitsType bitFromDelta(uint16_t delta) const
-        {
-            assert(delta < cMaxDelta);
-            return BitsType(1) << delta;
-        }
-
         uint16_t m_ack;
         BitsType m_bits;
     };
@@ -71,16 +197,10 @@ namespace core {
             // delta is how many packets we are missing between currAck (latest acknowledged) and seqNum
             uint16_t delta = seqNum - m_ack;
 
+            // shift ackBits (all out of window if delta is bigger), don't forget old ack's bit
+            shiftBits(m_bits, delta);
             if (delta <= cMaxDelta)
-            {
-                // shift ackBits, update ack, and don't forget old ack's bit
-                m_bits = bitFromDelta(delta - 1) | (m_bits << delta);
-            }
-            else
-            {
-                // ack = seqNum, ackBits all zero
-                m_bits = 0;
-            }
+                setBit(m_bits, delta - 1);
             m_ack = seqNum;
         }
         else
@@ -88,21 +208,31 @@ namespace core {
             // delta is how many packets were after seqNum
             uint16_t delta = m_ack - seqNum;
             if (delta <= cMaxDelta)
-                m_bits |= bitFromDelta(delta - 1);
+                setBit(m_bits, delta - 1);
         }
     }
 
 
+    // only set bits are visited, most recent seqNum first
     template <class BitsType> template <class Fn>
     inline void basic_ack<BitsType>::forEachAckedSeqNum(Fn& func) const
     {
         func(m_ack);
-        for (uint16_t delta = 0; delta < cMaxDelta; ++delta)
-        {
-            uint64_t bit = bitFromDelta(delta);
-            if ((m_bits & bit) == bit)
-                func(m_ack - delta - 1);
-        }
+        forEachSetBit(m_bits, [&](unsigned delta){
+            func(uint16_t(m_ack - delta - 1));
+        });
+    }
+
+
+    // latest seqNum is acked, bits below seqNum's own bit are acks of more recent ones
+    template <class BitsType>
+    inline int basic_ack<BitsType>::countAckedAfter(uint16_t seqNum) const
+    {
+        if (!moreRecentSeqNum(m_ack, seqNum))
+            return 0;
+
+        const uint16_t delta = m_ack - seqNum;
+        return 1 + countBitsBelow(m_bits, std::min<unsigned>(delta - 1, cMaxDelta));
     }
 
 
@@ -110,6 +240,8 @@ namespace core {
     typedef basic_ack<uint16_t> ack17_t;
     typedef basic_ack<uint32_t> ack33_t;
     typedef basic_ack<uint64_t> ack65_t;
+    typedef basic_ack<WideBits<2>> ack129_t;
+    typedef basic_ack<WideBits<4>> ack257_t;
 
     // special case
     struct ack49_t
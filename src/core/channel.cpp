@@ -0,0 +1,115 @@
+#include "stdafx.h"
+#include "core/channel.h"
+
+
+namespace core {
+
+    InboundChannel::InboundChannel(Channel kind)
+      : m_kind(kind),
+        m_started(false),
+        m_newest(0),
+        m_expected(0),
+        m_held(kind == ReliableOrderedChannel ? cWindow : 0)
+    {
+    }
+
+
+    InboundChannel::Verdict InboundChannel::receive(const PacketPtr& packet)
+    {
+        const uint16_t messageId = packet->header().messageId;
+
+        switch (m_kind)
+        {
+            case SequencedChannel:
+            {
+                if (m_started && !moreRecentSeqNum(messageId, m_newest))
+                    return Discarded;
+                m_started = true;
+                m_newest = messageId;
+                m_ready = packet;
+                return Accepted;
+            }
+
+            // sender numbers ordered messages from 0, so there's no need to guess the start
+            case ReliableOrderedChannel:
+            {
+                if (messageId != m_expected && !moreRecentSeqNum(messageId, m_expected))
+                    return Discarded;
+                if (uint16_t(messageId - m_expected) >= cWindow)
+                    return Refused;
+
+                PacketPtr& slot = m_held[messageId % cWindow];
+                if (slot)
+                    return Discarded;
+                slot = packet;
+                return Accepted;
+            }
+
+            default:
+            {
+                if (!firstSeen(messageId))
+                    return Discarded;
+                m_ready = packet;
+                return Accepted;
+            }
+        }
+    }
+
+
+    PacketPtr InboundChannel::next()
+    {
+        if (m_kind != ReliableOrderedChannel)
+            return std::move(m_ready);
+
+        PacketPtr packet = std::move(m_held[m_expected % cWindow]);
+        if (packet)
+            ++m_expected;
+        return packet;
+    }
+
+
+    // bit i of m_seen stands for messageId m_newest - i
+    bool InboundChannel::firstSeen(uint16_t messageId)
+    {
+        if (!m_started || moreRecentSeqNum(messageId, m_newest))
+        {
+            const uint16_t shift = m_started ? uint16_t(messageId - m_newest) : uint16_t(cWindow);
+            m_seen = shift < cWindow ? (m_seen << shift) : std::bitset<cWindow>();
+            m_seen.set(0);
+            m_started = true;
+            m_newest = messageId;
+            return true;
+        }
+
+        // too old to tell, resend of something delivered long ago
+        const uint16_t age = uint16_t(m_newest - messageId);
+        if (age >= cWindow || m_seen.test(age))
+            return false;
+
+        m_seen.set(age);
+        return true;
+    }
+
+
+    OutboundChannel::OutboundChannel()
+      : m_oldest(0)
+    {
+    }
+
+
+    // cWindow divides 65536, so bit of an id stays the same across wrap of messageId
+    void OutboundChannel::onAcked(uint16_t messageId)
+    {
+        // ack of a resend whose first copy was acked already
+        if (!fits(messageId))
+            return;
+
+        m_acked.set(messageId % InboundChannel::cWindow);
+        while (m_acked.test(m_oldest % InboundChannel::cWindow))
+        {
+            m_acked.reset(m_oldest % InboundChannel::cWindow);
+            ++m_oldest;
+        }
+    }
+
+}
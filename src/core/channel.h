@@ -0,0 +1,98 @@
+#pragma once
+#include "core/packet.h"
+#include <bitset>
+#include <vector>
+
+
+namespace core {
+
+    // Delivery semantics of a message. Every channel numbers its messages on its own,
+    // resends keep their messageId, so receiver recognizes them whatever seqNum they get.
+    enum Channel : uint8_t
+    {
+        UnreliableChannel,          // sent once (or resendLimit times), delivered once, as it comes
+        SequencedChannel,           // sent once, older than last delivered is dropped: latest-only state
+        ReliableUnorderedChannel,   // resent until acked, delivered once, as it comes
+        ReliableOrderedChannel      // resent until acked, delivered once, in send order
+    };
+
+    static const size_t cChannelCount = 4;
+
+    // resend limit of reliable channels, connection dies before it runs out
+    static const size_t cUnlimitedResends = static_cast<size_t>(-1);
+
+    inline bool isReliableChannel(uint8_t channel)
+    {
+        return channel == ReliableUnorderedChannel || channel == ReliableOrderedChannel;
+    }
+
+
+    // Receiving end of one channel of a connection: drops duplicates and stale messages,
+    // holds early ones of ordered channel until the gap before them is filled.
+    class InboundChannel
+    {
+    public:
+
+        // messageIds remembered for dedup, and how far ahead of the gap ordered channel buffers
+        static const size_t cWindow = 1024;
+
+        enum Verdict
+        {
+            Accepted,       // message is taken, next() will give it (maybe after earlier ones)
+            Discarded,      // duplicate or stale, already delivered or never will be
+            Refused         // no room to hold it, packet must not be acked so that it comes again
+        };
+
+        explicit InboundChannel(Channel kind = UnreliableChannel);
+
+        // [io-thread]
+        Verdict receive(const PacketPtr& packet);
+
+        // [io-thread] next message ready for delivery, nullptr if there's none
+        PacketPtr next();
+
+    private:
+
+        // first sight of messageId within dedup window
+        bool firstSeen(uint16_t messageId);
+
+        Channel m_kind;
+
+        // no message received yet, first one sets the starting point
+        bool m_started;
+
+        // most recent messageId received, and which of the cWindow ids before it arrived
+        uint16_t m_newest;
+        std::bitset<cWindow> m_seen;
+
+        // ordered: messageId to be delivered next, and messages that came before their turn
+        uint16_t m_expected;
+        std::vector<PacketPtr> m_held;
+
+        // unordered: accepted message waiting for next()
+        PacketPtr m_ready;
+    };
+
+
+    // Sending end of a reliable channel: keeps unacked messageIds within receiver's window,
+    // so that a message that far behind the newest one is always a resend of a delivered one.
+    class OutboundChannel
+    {
+    public:
+
+        OutboundChannel();
+
+        // message numbered so may be sent: every id InboundChannel::cWindow before it is acked
+        bool fits(uint16_t messageId) const { return uint16_t(messageId - m_oldest) < InboundChannel::cWindow; }
+
+        // [io-thread] peer acked message, window slides past the oldest acked ones
+        void onAcked(uint16_t messageId);
+
+    private:
+
+        // oldest messageId not acked yet, and which ids after it are, bit id % cWindow
+        uint16_t m_oldest;
+        std::bitset<InboundChannel::cWindow> m_acked;
+    };
+
+}
@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "core/coalescer.h"
+#include "core/logger.h"
+#include <cstring>
+
+
+namespace core {
+
+    Coalescer::Coalescer(std::chrono::milliseconds delay)
+      : m_delay(delay),
+        m_datagramSize(cBaseDatagramSize)
+    {
+    }
+
+
+    void Coalescer::add(const OutboundPacket& item, const SCTimePoint& now, std::vector<OutboundPacket>& out)
+    {
+        const PacketHeader& header = item.packet->header();
+        const uint8_t channel = header.channel < cChannelCount ? header.channel : uint8_t(UnreliableChannel);
+        Open& open = m_open[channel];
+
+        const size_t payload = payloadSize(*item.packet);
+        const bool small = payload <= cMaxBundledPayload && !isReservedProtocol(header.protocol);
+        const bool joins = small && open.messages
+            && open.first.resendLimit == item.resendLimit && open.first.trafficClass == item.trafficClass
+            && fits(open, payload);
+
+        if (!joins && open.messages)
+            close(open, out);
+
+        if (!small)
+        {
+            out.push_back(item);
+            return;
+        }
+
+        if (!open.messages)
+        {
+            open.first = item;
+            open.deadline = now + m_delay;
+        }
+        else
+        {
+            if (!open.bundle)
+            {
+                open.bundle = makePacket(cProtoBundle);
+                open.bundle->header().channel = channel;
+                append(*open.bundle, *open.first.packet);
+            }
+            append(*open.bundle, *item.packet);
+        }
+        ++open.messages;
+    }
+
+
+    void Coalescer::flush(std::vector<OutboundPacket>& out)
+    {
+        for (Open& open : m_open)
+        {
+            if (open.messages)
+                close(open, out);
+        }
+    }
+
+
+    void Coalescer::flushExpired(const SCTimePoint& now, std::vector<OutboundPacket>& out)
+    {
+        for (Open& open : m_open)
+        {
+            if (open.messages && open.deadline <= now)
+                close(open, out);
+        }
+    }
+
+
+    SCTimePoint Coalescer::deadline() const
+    {
+        SCTimePoint deadline = SCTimePoint::max();
+        for (const Open& open : m_open)
+        {
+            if (open.messages)
+                deadline = std::min(deadline, open.deadline);
+        }
+        return deadline;
+    }
+
+
+    bool Coalescer::split(const Packet& bundle, std::vector<PacketPtr>& out)
+    {
+        ++m_stats.receivedBundles;
+
+        const size_t size = bundle.payloadSize();
+        size_t offset = 0;
+        while (offset < size)
+        {
+            BundledMessageHeader message;
+            if (bundle.copyPayload(offset, &message, sizeof(message)) < sizeof(message))
+                return false;
+            offset += sizeof(message);
+            if (size - offset < message.length)
+                return false;
+
+            if (isReservedProtocol(message.protocol))
+            {
+                offset += message.length;
+                ++m_stats.reservedMessages;
+                continue;
+            }
+
+            // message keeps bundle's header, so channel and sequence are the same as if it came alone
+            PacketPtr packet = makePacket(cProtoBundle);
+            PacketBytes& bytes = packet->buffer();
+            bytes.resize(sizeof(PacketHeader) + message.length);
+            std::memcpy(bytes.data(), &bundle.header(), sizeof(PacketHeader));
+            bundle.copyPayload(offset, bytes.data() + sizeof(PacketHeader), message.length);
+            packet->header().protocol = message.protocol;
+            offset += message.length;
+
+            out.push_back(packet);
+            ++m_stats.unbundledMessages;
+        }
+        return true;
+    }
+
+
+    bool Coalescer::fits(const Open& open, size_t payload) const
+    {
+        const size_t size = open.bundle
+            ? open.bundle->size()
+            : sizeof(PacketHeader) + sizeof(BundledMessageHeader) + payloadSize(*open.first.packet);
+        return size + sizeof(BundledMessageHeader) + payload <= m_datagramSize;
+    }
+
+
+    // bundle owns all its bytes, payload that message shares with others is copied too
+    void Coalescer::append(Packet& bundle, const Packet& message)
+    {
+        const size_t payload = payloadSize(message);
+        const BundledMessageHeader header = { message.header().protocol, uint16_t(payload) };
+
+        PacketBytes& bytes = bundle.buffer();
+        const size_t offset = bytes.size();
+        bytes.resize(offset + sizeof(header) + payload);
+        std::memcpy(bytes.data() + offset, &header, sizeof(header));
+
+        Packet::ConstBuffers source = message.constBuffers();
+        source[0] = source[0] + sizeof(PacketHeader);
+        boost::asio::buffer_copy(boost::asio::buffer(bytes.data() + offset + sizeof(header), payload), source);
+    }
+
+
+    void Coalescer::close(Open& open, std::vector<OutboundPacket>& out)
+    {
+        if (open.bundle)
+        {
+            out.push_back(OutboundPacket(open.bundle, open.first.resendLimit, open.first.trafficClass));
+            ++m_stats.sentBundles;
+            m_stats.bundledMessages += open.messages;
+        }
+        else
+        {
+            out.push_back(open.first);
+        }
+
+        open.first = OutboundPacket();
+        open.bundle.reset();
+        open.messages = 0;
+    }
+
+}
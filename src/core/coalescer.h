@@ -0,0 +1,106 @@
+#pragma once
+#include "core/fair_queue.h"
+#include "core/channel.h"
+#include "core/handshake.h"
+#include <chrono>
+#include <vector>
+
+
+namespace core {
+
+    // small messages of application travel several to a datagram under this protocol,
+    // receiver splits them before dispatch, so listeners never see it
+    static const uint16_t cProtoBundle = cSystemProtocolBase - 4;
+
+#pragma pack (push, 1)
+    // precedes each message in bundle
+    struct BundledMessageHeader
+    {
+        uint16_t protocol;
+        uint16_t length;
+    };
+#pragma pack (pop)
+
+
+    struct CoalescingStats
+    {
+        CoalescingStats() : sentBundles(0), bundledMessages(0), receivedBundles(0), unbundledMessages(0), reservedMessages(0) {}
+
+        // bundles sent and messages that went in them
+        uint64_t sentBundles;
+        uint64_t bundledMessages;
+
+        // bundles received and messages split from them
+        uint64_t receivedBundles;
+        uint64_t unbundledMessages;
+
+        // messages in received bundles that claimed reserved protocols, dropped
+        uint64_t reservedMessages;
+    };
+
+
+    // Packs small messages going the same way (channel, resend limit, traffic class) into
+    // bundles of up to datagram size, each bundle is one packet with one header, sequence
+    // number and ack. Bundle is open until the next message doesn't fit, until its delay
+    // expires, or until application ends its tick; a bundle of one goes as the message
+    // itself. Each channel has at most one open bundle, and a message that doesn't join
+    // it closes it first, so messages of a channel leave in the order they were sent.
+    class Coalescer
+    {
+    public:
+
+        // payload bigger than this isn't worth bundling
+        static const size_t cMaxBundledPayload = (cBaseDatagramSize - sizeof(PacketHeader)) / 2 - sizeof(BundledMessageHeader);
+
+        explicit Coalescer(std::chrono::milliseconds delay);
+
+        // [io-thread] bundles opened from now on are filled up to this size
+        void setDatagramSize(size_t size) { m_datagramSize = size; }
+
+        // [io-thread] take message: it joins bundle of its channel, or goes to out with
+        // bundles it closes
+        void add(const OutboundPacket& item, const SCTimePoint& now, std::vector<OutboundPacket>& out);
+
+        // [io-thread] close every open bundle
+        void flush(std::vector<OutboundPacket>& out);
+
+        // [io-thread] close bundles whose delay has expired
+        void flushExpired(const SCTimePoint& now, std::vector<OutboundPacket>& out);
+
+        // when the oldest open bundle has to go, max() if there is none
+        SCTimePoint deadline() const;
+
+        // [io-thread] messages of received bundle with bundle's header and their own protocols,
+        // false if bundle is malformed (messages before the bad one are kept); messages under
+        // reserved protocols are dropped, only application's ones travel in bundles
+        bool split(const Packet& bundle, std::vector<PacketPtr>& out);
+
+        const CoalescingStats& stats() const { return m_stats; }
+
+    private:
+
+        struct Open
+        {
+            Open() : messages(0) {}
+
+            OutboundPacket first;       // sent as is if nothing joins it
+            PacketPtr bundle;           // made when the second message comes
+            size_t messages;
+            SCTimePoint deadline;
+        };
+
+        static size_t payloadSize(const Packet& packet) { return packet.size() - sizeof(PacketHeader); }
+
+        bool fits(const Open& open, size_t payload) const;
+
+        static void append(Packet& bundle, const Packet& message);
+
+        void close(Open& open, std::vector<OutboundPacket>& out);
+
+        std::chrono::milliseconds m_delay;
+        size_t m_datagramSize;
+        Open m_open[cChannelCount];
+        CoalescingStats m_stats;
+    };
+
+}
@@ -0,0 +1,355 @@
+#pragma once
+#include "core/fast_spinlock.h"
+#include "core/concurrent_queue.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace core {
+
+
+    // Open-addressing hash table with lock-free readers. Slots hold pointers to immutable
+    // entries and are probed linearly; removed entries leave a tombstone behind, the table
+    // is rebuilt when live entries and tombstones fill half of it. Writers are serialized
+    // by a spinlock. Memory unlinked by writers is retired and freed epoch by epoch:
+    // readers count themselves in the current epoch on their own thread's stripe, and
+    // what was unlinked during an epoch is freed once the epoch is over and its readers
+    // are gone, however many readers the next one has.
+    template <class Key, class Value, class Hash>
+    class ConcurrentHashMap
+    {
+    public:
+
+        ConcurrentHashMap()
+          : m_table(new Table(cMinCapacity)),
+            m_epoch(0),
+            m_size(0),
+            m_tombstones(0)
+        {
+            for (ReaderStripe& stripe : m_stripes)
+            {
+                stripe.readers[0].store(0, std::memory_order_relaxed);
+                stripe.readers[1].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ~ConcurrentHashMap()
+        {
+            Table* table = m_table.load();
+            for (size_t i = 0; i < table->capacity; ++i)
+            {
+                Entry* entry = table->slots[i].load();
+                if (entry && entry != tombstone())
+                    delete entry;
+            }
+            delete table;
+            freeRetired(m_retired[0]);
+            freeRetired(m_retired[1]);
+        }
+
+        // [lock-free] copy value for key, return false if there's none
+        bool find(const Key& key, Value& outValue) const
+        {
+            ReadGuard guard(*this);
+            if (const Entry* entry = lookup(*m_table.load(), key, Hash()(key)))
+            {
+                outValue = entry->value;
+                return true;
+            }
+            return false;
+        }
+
+        // return existing value for key, or insert one made by func
+        template <class Fn>
+        Value find_or_insert(const Key& key, const Fn& func)
+        {
+            Value value;
+            if (find(key, value))
+                return value;
+
+            FastSpinLock::Guard guard(m_locker);
+
+            // somebody could insert it while we were waiting for lock
+            const size_t hash = Hash()(key);
+            if (const Entry* entry = lookup(*m_table.load(), key, hash))
+                return entry->value;
+
+            value = func();
+            insertUnique(new Entry(key, value, hash));
+            reclaim();
+            return value;
+        }
+
+        bool remove(const Key& key)
+        {
+            FastSpinLock::Guard guard(m_locker);
+
+            Table* table = m_table.load();
+            const size_t hash = Hash()(key);
+            const size_t mask = table->capacity - 1;
+            for (size_t i = hash & mask; ; i = (i + 1) & mask)
+            {
+                Entry* entry = table->slots[i].load();
+                if (!entry)
+                    return false;
+                if (entry != tombstone() && entry->hash == hash && entry->key == key)
+                {
+                    table->slots[i].store(tombstone());
+                    retiring().entries.push_back(entry);
+                    --m_size;
+                    ++m_tombstones;
+                    reclaim();
+                    return true;
+                }
+            }
+        }
+
+        template <class Fn>
+        void remove_if(const Fn& func)
+        {
+            FastSpinLock::Guard guard(m_locker);
+
+            Table* table = m_table.load();
+            for (size_t i = 0; i < table->capacity; ++i)
+            {
+                Entry* entry = table->slots[i].load();
+                if (entry && entry != tombstone() && func(entry->value))
+                {
+                    table->slots[i].store(tombstone());
+                    retiring().entries.push_back(entry);
+                    --m_size;
+                    ++m_tombstones;
+                }
+            }
+            reclaim();
+        }
+
+        // [lock-free] call func for every value; values inserted or removed meanwhile may be missed
+        template <class Fn>
+        void for_each_value(const Fn& func) const
+        {
+            ReadGuard guard(*this);
+
+            const Table* table = m_table.load();
+            for (size_t i = 0; i < table->capacity; ++i)
+            {
+                const Entry* entry = table->slots[i].load();
+                if (entry && entry != tombstone())
+                    func(entry->value);
+            }
+        }
+
+        // free memory that writers retired, as far as no reader may still see it
+        void collect_garbage()
+        {
+            FastSpinLock::Guard guard(m_locker);
+            reclaim();
+        }
+
+        size_t size() const { return m_size; }
+
+    private:
+
+        static const size_t cMinCapacity = 16;
+
+        // reader threads are spread over this many counters, each on its own cache line
+        static const size_t cReaderStripes = 16;
+
+        struct Entry
+        {
+            Entry(const Key& k, const Value& v, size_t h) : key(k), value(v), hash(h) {}
+
+            const Key key;
+            const Value value;
+            const size_t hash;
+        };
+
+        struct Table
+        {
+            explicit Table(size_t cap) : capacity(cap), slots(new std::atomic<Entry*>[cap])
+            {
+                for (size_t i = 0; i < capacity; ++i)
+                    slots[i].store(nullptr, std::memory_order_relaxed);
+            }
+
+            const size_t capacity;  // power of two
+            std::unique_ptr<std::atomic<Entry*>[]> slots;
+        };
+
+        // marks the slot of removed entry, probing goes on past it
+        static Entry* tombstone()
+        {
+            static char marker;
+            return reinterpret_cast<Entry*>(&marker);
+        }
+
+        // readers inside the table that entered in even and in odd epochs
+        struct ReaderStripe
+        {
+            std::atomic<size_t> readers[2];
+            char pad[cCacheLineSize - 2 * sizeof(std::atomic<size_t>)];
+        };
+
+        // memory unlinked during one epoch
+        struct Retired
+        {
+            std::vector<Entry*> entries;
+            std::vector<Table*> tables;
+
+            bool empty() const { return entries.empty() && tables.empty(); }
+        };
+
+        // stripe of calling thread, threads take them in turn as they first read
+        static size_t readerStripe()
+        {
+            static std::atomic<size_t> nextStripe(0);
+            static thread_local size_t stripe = nextStripe.fetch_add(1) % cReaderStripes;
+            return stripe;
+        }
+
+        // reader counts itself in epoch that is still current after it did: either writer
+        // sees it when it checks that epoch's readers, or reader sees what writer unlinked
+        // before the epoch ended
+        struct ReadGuard
+        {
+            explicit ReadGuard(const ConcurrentHashMap& map) : m_stripe(map.m_stripes[readerStripe()])
+            {
+                for (;;)
+                {
+                    const size_t epoch = map.m_epoch.load();
+                    m_parity = epoch & 1;
+                    m_stripe.readers[m_parity].fetch_add(1);
+                    if (map.m_epoch.load() == epoch)
+                        break;
+                    m_stripe.readers[m_parity].fetch_sub(1);
+                }
+            }
+            ~ReadGuard() { m_stripe.readers[m_parity].fetch_sub(1); }
+        private:
+            ReaderStripe& m_stripe;
+            size_t m_parity;
+        };
+
+        static const Entry* lookup(const Table& table, const Key& key, size_t hash)
+        {
+            const size_t mask = table.capacity - 1;
+            for (size_t i = hash & mask; ; i = (i + 1) & mask)
+            {
+                const Entry* entry = table.slots[i].load();
+                if (!entry)
+                    return nullptr;
+                if (entry != tombstone() && entry->hash == hash && entry->key == key)
+                    return entry;
+            }
+        }
+
+        // [writer] place entry whose key is known to be absent
+        void insertUnique(Entry* entry)
+        {
+            Table* table = m_table.load();
+            if ((m_size + m_tombstones + 1) * 2 > table->capacity)
+                table = rebuild();
+
+            const size_t mask = table->capacity - 1;
+            for (size_t i = entry->hash & mask; ; i = (i + 1) & mask)
+            {
+                Entry* slot = table->slots[i].load();
+                if (!slot || slot == tombstone())
+                {
+                    if (slot)
+                        --m_tombstones;
+                    table->slots[i].store(entry);
+                    ++m_size;
+                    return;
+                }
+            }
+        }
+
+        // [writer] move live entries to a fresh table, sized for a quarter load
+        Table* rebuild()
+        {
+            size_t capacity = cMinCapacity;
+            while (capacity < (m_size + 1) * 4)
+                capacity *= 2;
+
+            Table* oldTable = m_table.load();
+            Table* newTable = new Table(capacity);
+            for (size_t i = 0; i < oldTable->capacity; ++i)
+            {
+                Entry* entry = oldTable->slots[i].load();
+                if (!entry || entry == tombstone())
+                    continue;
+
+                for (size_t j = entry->hash & (capacity - 1); ; j = (j + 1) & (capacity - 1))
+                {
+                    if (!newTable->slots[j].load(std::memory_order_relaxed))
+                    {
+                        newTable->slots[j].store(entry, std::memory_order_relaxed);
+                        break;
+                    }
+                }
+            }
+
+            m_table.store(newTable);
+            retiring().tables.push_back(oldTable);
+            m_tombstones = 0;
+            return newTable;
+        }
+
+        // [writer] memory unlinked now is freed after the current epoch
+        Retired& retiring() { return m_retired[m_epoch.load() & 1]; }
+
+        // [writer] readers counted in epochs of given parity
+        size_t readers(size_t parity) const
+        {
+            size_t count = 0;
+            for (const ReaderStripe& stripe : m_stripes)
+                count += stripe.readers[parity].load();
+            return count;
+        }
+
+        // [writer] memory of the previous epoch is freed once its readers are gone; only
+        // then current epoch may end, so that a reader is never two epochs behind. Readers
+        // that entered after memory was unlinked can't reach it, so readers of the epoch
+        // that follows its own don't hold it back
+        void reclaim()
+        {
+            const size_t epoch = m_epoch.load();
+            if (readers((epoch + 1) & 1) != 0)
+                return;
+
+            freeRetired(m_retired[(epoch + 1) & 1]);
+            if (m_retired[epoch & 1].empty())
+                return;
+
+            m_epoch.store(epoch + 1);
+            if (readers(epoch & 1) == 0)
+                freeRetired(m_retired[epoch & 1]);
+        }
+
+        static void freeRetired(Retired& retired)
+        {
+            for (Entry* entry : retired.entries)
+                delete entry;
+            for (Table* table : retired.tables)
+                delete table;
+            retired.entries.clear();
+            retired.tables.clear();
+        }
+
+        std::atomic<Table*> m_table;
+
+        // readers of each thread count themselves on its own stripe, writers end epochs
+        mutable ReaderStripe m_stripes[cReaderStripes];
+        std::atomic<size_t> m_epoch;
+
+        // writers only: memory unlinked during even and during odd epochs
+        FastSpinLock m_locker;
+        size_t m_size;
+        size_t m_tombstones;
+        Retired m_retired[2];
+    };
+
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <atomic>
+#include <memory>
 
 
 namespace core {
@@ -52,7 +53,8 @@ namespace core {
     };
 
 
-    template <typename T>
+    // nodes come from Alloc, so a pooling allocator keeps push() off the heap
+    template <typename T, typename Alloc = std::allocator<T>>
     struct mpsc_queue : public queue_base<T>
     {
     public:
@@ -65,6 +67,11 @@ namespace core {
 
     private:
 
+        typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node> node_allocator;
+
+        node* create_node(const T& value);
+        void destroy_node(node* n);
+
         char pad0[cCacheLineSize];
 
         // for one consumer at a time
@@ -130,33 +137,50 @@ namespace core {
 
 
 
-    template <typename T>
-    inline mpsc_queue<T>::mpsc_queue()
+    template <typename T, typename Alloc>
+    inline mpsc_queue<T, Alloc>::mpsc_queue()
     {
-        m_last = m_first = new node(T());
+        m_last = m_first = create_node(T());
     }
 
-    template <typename T>
-    inline mpsc_queue<T>::~mpsc_queue()
+    template <typename T, typename Alloc>
+    inline mpsc_queue<T, Alloc>::~mpsc_queue()
     {
         while (m_first != nullptr)
         {
             node* tmp = m_first;
             m_first = tmp->next;
-            delete tmp;
+            destroy_node(tmp);
         }
     }
 
-    template <typename T>
-    inline void mpsc_queue<T>::push(const T& value)
+    template <typename T, typename Alloc>
+    inline typename mpsc_queue<T, Alloc>::node* mpsc_queue<T, Alloc>::create_node(const T& value)
     {
-        node* tmp = new node(value);
+        node_allocator alloc;
+        node* n = alloc.allocate(1);
+        ::new(static_cast<void*>(n)) node(value);
+        return n;
+    }
+
+    template <typename T, typename Alloc>
+    inline void mpsc_queue<T, Alloc>::destroy_node(node* n)
+    {
+        node_allocator alloc;
+        n->~node();
+        alloc.deallocate(n, 1);
+    }
+
+    template <typename T, typename Alloc>
+    inline void mpsc_queue<T, Alloc>::push(const T& value)
+    {
+        node* tmp = create_node(value);
         node* old = m_last.exchange(tmp, std::memory_order_acq_rel);
         old->next = tmp;
     }
 
-    template <typename T>
-    inline bool mpsc_queue<T>::pop(T& result)
+    template <typename T, typename Alloc>
+    inline bool mpsc_queue<T, Alloc>::pop(T& result)
     {
         node* theFirst = m_first;
         node* theNext = m_first->next;
@@ -167,7 +191,7 @@ namespace core {
             result = std::move(theNext->value);
             m_first = theNext;
 
-            delete theFirst;
+            destroy_node(theFirst);
             return true;
         }
         return false;
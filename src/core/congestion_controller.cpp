@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "core/congestion_controller.h"
+#include "core/packet.h"
+#include <algorithm>
+
+
+namespace core {
+
+    using namespace std::chrono;
+
+    static const size_t cMaxDatagram = cBaseDatagramSize;
+    static const size_t cInitialWindow = 10 * cMaxDatagram;
+    static const size_t cMinWindow = 2 * cMaxDatagram;
+    static const size_t cMaxWindow = 1024 * cMaxDatagram;
+
+    // bytes in bottleneck queue that delay-based control aims for: leaves slow start
+    // above gamma, grows below alpha, shrinks above beta
+    static const size_t cQueueGamma = 1 * cMaxDatagram;
+    static const size_t cQueueAlpha = 2 * cMaxDatagram;
+    static const size_t cQueueBeta = 4 * cMaxDatagram;
+
+
+    AimdCongestionControl::AimdCongestionControl()
+      : m_window(cInitialWindow),
+        m_ssthresh(cMaxWindow)
+    {
+    }
+
+    void AimdCongestionControl::onPacketAcked(size_t bytes, microseconds, const SCTimePoint& sentTime, const SCTimePoint&)
+    {
+        if (!inRecovery(sentTime))
+            increase(bytes);
+    }
+
+    void AimdCongestionControl::onPacketLost(size_t, const SCTimePoint& sentTime, const SCTimePoint& now)
+    {
+        if (inRecovery(sentTime))
+            return;
+
+        m_recoveryStart = now;
+        m_window = std::max(cMinWindow, m_window / 2);
+        m_ssthresh = m_window;
+    }
+
+    void AimdCongestionControl::onTimeout(const SCTimePoint& now)
+    {
+        m_recoveryStart = now;
+        m_ssthresh = std::max(cMinWindow, m_window / 2);
+        m_window = cMinWindow;
+    }
+
+    void AimdCongestionControl::increase(size_t bytes)
+    {
+        if (m_window < m_ssthresh)
+            m_window += bytes;
+        else
+            m_window += std::max<size_t>(1, cMaxDatagram * bytes / m_window);
+        m_window = std::min(m_window, cMaxWindow);
+    }
+
+    DelayCongestionControl::DelayCongestionControl()
+      : m_baseRtt(microseconds::max()),
+        m_roundMinRtt(microseconds::max())
+    {
+    }
+
+    void DelayCongestionControl::onPacketAcked(size_t bytes, microseconds rtt, const SCTimePoint& sentTime, const SCTimePoint& now)
+    {
+        m_baseRtt = std::min(m_baseRtt, rtt);
+        m_roundMinRtt = std::min(m_roundMinRtt, rtt);
+        if (inRecovery(sentTime))
+            return;
+
+        if (m_window < m_ssthresh)
+            increase(bytes);
+
+        if (now < m_roundEnd)
+            return;
+
+        const microseconds roundRtt = m_roundMinRtt;
+        m_roundEnd = now + roundRtt;
+        m_roundMinRtt = microseconds::max();
+        if (roundRtt <= microseconds::zero())
+            return;
+
+        // window sent at base rate would take baseRtt, the excess of round's rtt is queueing
+        const size_t queued = static_cast<size_t>(double(m_window) * (roundRtt - m_baseRtt).count() / roundRtt.count());
+
+        if (m_window < m_ssthresh)
+        {
+            // slow start overshoots by about what has queued, give it back
+            if (queued > cQueueGamma)
+            {
+                m_window = std::max(cMinWindow, m_window - queued);
+                m_ssthresh = m_window;
+            }
+        }
+        else if (queued < cQueueAlpha)
+        {
+            m_window = std::min(cMaxWindow, m_window + cMaxDatagram);
+        }
+        else if (queued > cQueueBeta)
+        {
+            m_window = std::max(cMinWindow, m_window - cMaxDatagram);
+            m_ssthresh = m_window;
+        }
+    }
+
+}
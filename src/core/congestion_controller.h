@@ -0,0 +1,97 @@
+#pragma once
+#include "core/logger.h"
+#include <chrono>
+#include <memory>
+
+
+namespace core {
+
+    // Decides how many bytes a connection may have in flight. Connection reports every
+    // acknowledged and every lost packet, and sends only while window allows; the rest
+    // waits in its queue until acks clock it out. Called from io thread only.
+    struct ICongestionController
+    {
+        virtual ~ICongestionController() {}
+
+        // packet sent at sentTime was acknowledged, rtt is its round trip
+        virtual void onPacketAcked(size_t bytes, std::chrono::microseconds rtt, const SCTimePoint& sentTime, const SCTimePoint& now) = 0;
+
+        // packet sent at sentTime was declared lost
+        virtual void onPacketLost(size_t bytes, const SCTimePoint& sentTime, const SCTimePoint& now) = 0;
+
+        // retransmission timer expired, nothing came back for a whole RTO
+        virtual void onTimeout(const SCTimePoint& now) = 0;
+
+        // bytes allowed in flight
+        virtual size_t window() const = 0;
+    };
+
+    typedef std::unique_ptr<ICongestionController> CongestionControllerPtr;
+
+
+    // no limit, connection sends as fast as application does
+    class NoCongestionControl : public ICongestionController
+    {
+    public:
+
+        void onPacketAcked(size_t, std::chrono::microseconds, const SCTimePoint&, const SCTimePoint&) override {}
+        void onPacketLost(size_t, const SCTimePoint&, const SCTimePoint&) override {}
+        void onTimeout(const SCTimePoint&) override {}
+        size_t window() const override { return static_cast<size_t>(-1); }
+    };
+
+
+    // Loss-based additive increase, multiplicative decrease (NewReno-like): window doubles
+    // every round trip in slow start, then grows by one datagram per window of acks; a loss
+    // halves it once per round trip, a timeout drops it to minimum.
+    class AimdCongestionControl : public ICongestionController
+    {
+    public:
+
+        AimdCongestionControl();
+
+        void onPacketAcked(size_t bytes, std::chrono::microseconds rtt, const SCTimePoint& sentTime, const SCTimePoint& now) override;
+        void onPacketLost(size_t bytes, const SCTimePoint& sentTime, const SCTimePoint& now) override;
+        void onTimeout(const SCTimePoint& now) override;
+        size_t window() const override { return m_window; }
+
+        size_t slowStartThreshold() const { return m_ssthresh; }
+
+    protected:
+
+        // packets sent before last decrease don't count, one loss event per round trip
+        bool inRecovery(const SCTimePoint& sentTime) const { return sentTime <= m_recoveryStart; }
+
+        void increase(size_t bytes);
+
+        size_t m_window;
+        size_t m_ssthresh;
+        SCTimePoint m_recoveryStart;
+    };
+
+
+    // Delay-based (Vegas-like): once per round trip compares best RTT of the round with
+    // smallest one ever seen to estimate how many bytes wait in bottleneck queue, grows
+    // window by a datagram while queue is nearly empty and shrinks it when queue builds
+    // up, before routers start dropping; losses and timeouts are handled as in AIMD.
+    class DelayCongestionControl : public AimdCongestionControl
+    {
+    public:
+
+        DelayCongestionControl();
+
+        void onPacketAcked(size_t bytes, std::chrono::microseconds rtt, const SCTimePoint& sentTime, const SCTimePoint& now) override;
+
+        std::chrono::microseconds baseRtt() const { return m_baseRtt; }
+
+    private:
+
+        std::chrono::microseconds m_baseRtt;
+
+        // best sample of current round, acks held by peer's delayed ack timer don't
+        // count as queueing then
+        std::chrono::microseconds m_roundMinRtt;
+        SCTimePoint m_roundEnd;
+    };
+
+}
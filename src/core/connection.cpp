@@ -1,65 +1,730 @@
 #include "stdafx.h"
 #include "core/connection.h"
 #include "core/smart_socket.h"
+#include "core/handshake.h"
 #include "core/logger.h"
 #include <boost/asio/placeholders.hpp>
 #include <boost/bind.hpp>
 #include <chrono>
+#include <limits>
 
 
 namespace core {
 
     using namespace std::chrono;
 
+    // ack for received data waits this long for outgoing data to ride on
+    static const milliseconds cAckDelay(20);
+
+    // but every second packet of reliable-unordered channel (bulk: file fragments and such)
+    // is acked at once, so a stream is clocked by acks, not by delay
+    static const size_t cAckEveryPackets = 2;
+
+    // keepalive period is cHeartbeatRttFactor round trips, within these bounds
+    static const size_t cHeartbeatRttFactor = 8;
+    static const milliseconds cMinHeartbeatInterval(100);
+    static const milliseconds cMaxHeartbeatInterval(1000);
+
+    // peer is dead after this many heartbeat periods of silence, but not sooner than
+    // cMinDeadTimeout; either way well before socket's housekeeping timeout
+    static const int cMissedHeartbeats = 4;
+    static const milliseconds cMinDeadTimeout(1000);
+
+    // packet is lost once this many later packets are acked, a little reordering is tolerated
+    static const int cFastRetransmitThreshold = 3;
+
+    // in-flight packets stay well within send buffer, so it never wraps over unacked ones
+    static const size_t cMaxPacketsInFlight = 512;
+
+    // idle connection may send this much at once before pacing kicks in
+    static const size_t cPacingBurstBytes = 2 * cBaseDatagramSize;
+
+    // pacing rate is this much above window per round trip, so window can grow
+    static const double cPacingGain = 1.25;
+
+    // packets sent closer than this are one burst
+    static const microseconds cBurstGap(20);
+
+
+    static uint8_t channelOf(const PacketHeader& header)
+    {
+        return header.channel < cChannelCount ? header.channel : uint8_t(UnreliableChannel);
+    }
+
+
+    // application's packet under reserved protocol is dropped, peer would handle it as socket's own
+    static bool isSendable(uint16_t protocol)
+    {
+        if (!isReservedProtocol(protocol))
+            return true;
+        LogWarning() << "packet with reserved protocol" << protocol << "dropped";
+        return false;
+    }
+
+
+    static CongestionControllerPtr makeCongestionController(SocketOptions::CongestionControl kind)
+    {
+        switch (kind)
+        {
+            case SocketOptions::AimdCongestion:
+                return CongestionControllerPtr(new AimdCongestionControl());
+            case SocketOptions::DelayCongestion:
+                return CongestionControllerPtr(new DelayCongestionControl());
+            default:
+                return CongestionControllerPtr(new NoCongestionControl());
+        }
+    }
+
     
-    Connection::Connection(SmartSocket& socket, const udp::endpoint& peer)
+    Connection::Connection(SmartSocket& socket, const udp::endpoint& peer, bool established)
       : m_socket(socket),
         m_peer(peer),
+        m_localId(0),
+        m_peerId(0),
         m_isDead(false),
-        m_averageRTT(50),
-        m_recvCount(0),
-        m_sentCount(0),
-        m_ackdCount(0)
+        m_established(established),
+        m_token(0),
+        m_rtt(cAckDelay),
+        m_congestion(makeCongestionController(socket.options().congestionControl)),
+        m_bytesInFlight(0),
+        m_packetsInFlight(0),
+        m_recvTime(system_clock::now()),
+        m_sendTime(m_recvTime),
+        m_ackPending(false),
+        m_unackedPackets(0),
+        m_timer(*socket.getIOService()),
+        m_timerArmed(false),
+        m_pacer(cPacingBurstBytes),
+        m_backlogRate(0),
+        m_objects(socket.options().reassemblyBudget, socket.options().fileDirectory, socket.options().maxIncomingFileSize),
+        m_coalescer(socket.options().coalescingDelay),
+        m_pathMtu(socket.options().pathMtuDiscovery ? socket.options().maxDatagramSize : cBaseDatagramSize),
+        m_nextSliceId(1),
+        m_paceActive(false),
+        m_burstPackets(0),
+        m_flushScheduled(false),
+        m_tickEnded(false)
     {
+        for (size_t channel = 0; channel < cChannelCount; ++channel)
+        {
+            m_inbound[channel] = InboundChannel(Channel(channel));
+            m_nextMessageId[channel] = 0;
+        }
     }
 
 
     Connection::~Connection()
     {
-        LogDebug() << "stats for" << m_peer << ": sent" << m_sentCount << "packets, confirmed" << m_ackdCount << "of them,"
-                   << "received" << m_recvCount << "packets, latest RTT was" << milliseconds(m_averageRTT);
+        LogDebug() << "stats for" << m_peer << ": sent" << m_stats.sentPackets << "packets, confirmed" << m_stats.confirmedPackets << "of them,"
+                   << "received" << m_stats.receivedPackets << "packets, srtt" << m_rtt.srtt() << "rttvar" << m_rtt.rttvar() << "rto" << m_rtt.rto()
+                   << "heartbeats sent" << m_stats.sentHeartbeats;
+        LogDebug() << "losses for" << m_peer << ": by timeout" << m_stats.lostByTimeout << "by fast retransmit" << m_stats.lostByFastRetransmit
+                   << "by seqNum gap" << m_stats.lostBySeqGap << "resent" << m_stats.resentPackets << "expired" << m_stats.expiredMessages
+                   << "final window" << m_congestion->window() << "bytes";
+        LogDebug() << "bursts for" << m_peer << ":" << m_stats.bursts << "longest" << m_stats.maxBurst << "packets, pacing rate"
+                   << uint64_t(m_pacer.rate()) << "bytes/s";
+        LogDebug() << "traffic for" << m_peer << ": urgent" << m_pending.sentBytes(UrgentTraffic) << "normal" << m_pending.sentBytes(NormalTraffic)
+                   << "bulk" << m_pending.sentBytes(BulkTraffic) << "bytes";
+        LogDebug() << "objects for" << m_peer << ": sent" << m_objects.stats().objectsSent << "received" << m_objects.stats().objectsReceived
+                   << "refused fragments" << m_objects.stats().refusedFragments;
+        LogDebug() << "files for" << m_peer << ": sent" << m_objects.stats().filesSent << "received" << m_objects.stats().filesReceived
+                   << "refused" << m_objects.stats().refusedFiles;
+        LogDebug() << "bundles for" << m_peer << ": sent" << m_coalescer.stats().sentBundles << "with" << m_coalescer.stats().bundledMessages
+                   << "messages, received" << m_coalescer.stats().receivedBundles << "with" << m_coalescer.stats().unbundledMessages << "messages";
+        LogDebug() << "datagrams for" << m_peer << ": up to" << m_pathMtu.current() << "bytes, probes sent" << m_stats.sentProbes
+                   << "sliced packets" << m_stats.slicedPackets;
     }
 
 
     void Connection::asyncSend(const PacketPtr& packet, size_t resendLimit)
     {
-        // note: lambda here catches packet by value!
-        m_socket.getIOService()->post([=]{ doSend(packet, resendLimit); });
+        if (!isSendable(packet->header().protocol))
+            return;
+        packet->header().channel = UnreliableChannel;
+        m_outbound.push(OutboundPacket(packet, resendLimit));
+        scheduleFlush();
+    }
+
+
+    void Connection::asyncSend(const PacketPtr& packet, Channel channel)
+    {
+        if (!isSendable(packet->header().protocol))
+            return;
+        packet->header().channel = channel;
+        m_outbound.push(OutboundPacket(packet, isReliableChannel(channel) ? cUnlimitedResends : 0));
+        scheduleFlush();
+    }
+
+
+    void Connection::asyncSendMany(const std::vector<PacketPtr>& packets, size_t resendLimit)
+    {
+        for (auto& packet : packets)
+        {
+            if (!isSendable(packet->header().protocol))
+                continue;
+            packet->header().channel = UnreliableChannel;
+            m_outbound.push(OutboundPacket(packet, resendLimit));
+        }
+        scheduleFlush();
+    }
+
+
+    void Connection::asyncSendMany(const std::vector<PacketPtr>& packets, Channel channel)
+    {
+        const size_t resendLimit = isReliableChannel(channel) ? cUnlimitedResends : 0;
+        for (auto& packet : packets)
+        {
+            if (!isSendable(packet->header().protocol))
+                continue;
+            packet->header().channel = channel;
+            m_outbound.push(OutboundPacket(packet, resendLimit));
+        }
+        scheduleFlush();
+    }
+
+
+    void Connection::flush()
+    {
+        m_tickEnded = true;
+        scheduleFlush();
+    }
+
+
+    // only the sender that raises the flag posts a handler, the rest just push; flag and
+    // queue are accessed sequentially consistent, so either the flush sees the pushed
+    // packet or the pusher sees the flag down and posts a new flush
+    void Connection::scheduleFlush()
+    {
+        if (!m_flushScheduled.exchange(true))
+        {
+            auto self = shared_from_this();
+            m_socket.getIOService()->post([self]{ self->flushOutbound(); });
+        }
+    }
+
+
+    void Connection::flushOutbound()
+    {
+        m_flushScheduled.exchange(false);
+
+        // packets wait in queue for handshake, establish() schedules flush again
+        if (!m_established)
+            return;
+
+        // read before draining, so that messages sent before flush() are drained with it
+        const bool tickEnded = m_tickEnded.exchange(false);
+
+        // everything goes through fair queue, so that classes take turns and rate caps hold;
+        // with coalescing, small messages are bundled on the way
+        const bool coalescing = m_socket.options().coalescing;
+        const auto now = system_clock::now();
+        OutboundPacket item;
+        while (m_outbound.pop(item))
+        {
+            item.trafficClass = trafficClassOf(*item.packet);
+            if (coalescing)
+                m_coalescer.add(item, now, m_coalesced);
+            else
+                enqueue(item);
+            item.packet.reset();
+        }
+
+        if (tickEnded)
+            m_coalescer.flush(m_coalesced);
+        enqueueCoalesced();
+
+        // objects started before handshake completed
+        feedFragments();
+        sendQueued();
+
+        // bundles left open go when their delay expires
+        if (coalescing)
+            armTimer(nextDeadline());
+    }
+
+
+    bool Connection::enqueueCoalesced()
+    {
+        for (const OutboundPacket& item : m_coalesced)
+            enqueue(item);
+
+        const bool any = !m_coalesced.empty();
+        m_coalesced.clear();
+        return any;
+    }
+
+
+    void Connection::enqueue(const OutboundPacket& item)
+    {
+        // numbered in the order they leave the queue, resends keep the number
+        PacketHeader& header = item.packet->header();
+        if (header.channel >= cChannelCount)
+            header.channel = UnreliableChannel;
+
+        // later ones wait behind held ones, numbering follows send order
+        const uint8_t channel = header.channel;
+        if (isReliableChannel(channel) &&
+            (!m_overWindow[channel].empty() || !m_outboundChannels[channel].fits(m_nextMessageId[channel])))
+        {
+            m_overWindow[channel].push_back(item);
+            return;
+        }
+        number(item);
+    }
+
+
+    bool Connection::releaseOverWindow()
+    {
+        bool released = false;
+        for (uint8_t channel = 0; channel < cChannelCount; ++channel)
+        {
+            std::deque<OutboundPacket>& held = m_overWindow[channel];
+            while (!held.empty() && m_outboundChannels[channel].fits(m_nextMessageId[channel]))
+            {
+                number(held.front());
+                held.pop_front();
+                released = true;
+            }
+        }
+        return released;
+    }
+
+
+    void Connection::number(const OutboundPacket& item)
+    {
+        PacketHeader& header = item.packet->header();
+        header.messageId = m_nextMessageId[header.channel]++;
+
+        OutboundPacket queued = item;
+        if (header.channel == UnreliableChannel || header.channel == SequencedChannel)
+            queued.expiry = system_clock::now() + m_socket.options().maxUnreliableDelay;
+        m_pending.push(queued);
+    }
+
+
+    void Connection::sendQueued()
+    {
+        if (m_socket.options().pacing && !m_pending.empty())
+        {
+            updatePacingRate(true);
+            m_socket.scheduler().activate(shared_from_this());
+        }
+        else
+        {
+            sendPending();
+        }
+    }
+
+
+    size_t Connection::feedFragments()
+    {
+        if (!m_established)
+            return 0;
+
+        std::vector<PacketPtr> fragments;
+        m_objects.takeFragments(fragments);
+        for (const PacketPtr& fragment : fragments)
+        {
+            fragment->header().channel = ReliableUnorderedChannel;
+            enqueue(OutboundPacket(fragment, cUnlimitedResends, BulkTraffic));
+        }
+        return fragments.size();
+    }
+
+
+    void Connection::sendObject(uint16_t protocol, const ObjectSource& source, const ObjectTransfer::CompletionHandler& onComplete)
+    {
+        if (!isSendable(protocol))
+            return;
+
+        auto self = shared_from_this();
+        m_socket.getIOService()->post([self, protocol, source, onComplete]
+        {
+            self->m_objects.start(protocol, source, onComplete);
+            if (self->feedFragments())
+                self->sendQueued();
+        });
+    }
+
+
+    void Connection::sendObject(uint16_t protocol, const std::shared_ptr<const std::vector<uint8_t>>& data, const ObjectTransfer::CompletionHandler& onComplete)
+    {
+        sendObject(protocol, ObjectSource(data, data->data(), data->size()), onComplete);
+    }
+
+
+    bool Connection::sendFile(uint16_t protocol, const std::string& path, const std::string& name, const ObjectTransfer::FileCompletionHandler& onComplete)
+    {
+        if (!ObjectTransfer::isValidFileName(name))
+        {
+            LogWarning() << "can't send" << path << "as" << name << ": file name must be plain";
+            return false;
+        }
+        if (!isSendable(protocol))
+            return false;
+
+        MappedFile::Ptr file = MappedFile::openRead(path);
+        if (!file)
+            return false;
+
+        auto self = shared_from_this();
+        m_socket.getIOService()->post([self, protocol, file, name, onComplete]
+        {
+            self->m_objects.startFile(protocol, file, name, onComplete);
+            if (self->feedFragments())
+                self->sendQueued();
+        });
+        return true;
+    }
+
+
+    void Connection::sendPending()
+    {
+        if (m_pending.empty())
+            return;
+
+        if (m_socket.options().pacing)
+        {
+            // window may have changed, and with it the rate
+            updatePacingRate(false);
+            m_socket.scheduler().activate(shared_from_this());
+            return;
+        }
+
+        const auto now = system_clock::now();
+        while (const OutboundPacket* next = m_pending.next(now))
+        {
+            m_stats.expiredMessages = m_pending.expiredPackets();
+            if (!canSend(next->packet->size()))
+                return;
+            OutboundPacket item = m_pending.pop();
+            doSend(item.packet, item.resendLimit);
+        }
+        m_stats.expiredMessages = m_pending.expiredPackets();
+
+        // rate caps hold the rest
+        if (!m_pending.empty())
+            armTimer(nextDeadline());
+    }
+
+
+    size_t Connection::pacedPacketSize(const SCTimePoint& now)
+    {
+        if (m_pending.empty())
+            return 0;
+
+        const OutboundPacket* next = m_pending.next(now);
+        m_stats.expiredMessages = m_pending.expiredPackets();
+        if (!next)
+        {
+            armTimer(nextDeadline());
+            return 0;
+        }
+        const size_t bytes = next->packet->size();
+        return canSend(bytes) ? bytes : 0;
+    }
+
+
+    void Connection::sendPacedPacket()
+    {
+        OutboundPacket item = m_pending.pop();
+        m_pacer.consume(item.packet->size());
+        doSend(item.packet, item.resendLimit);
+    }
+
+
+    TrafficClass Connection::trafficClassOf(const Packet& packet) const
+    {
+        const auto& classes = m_socket.options().trafficClasses;
+        if (classes.empty())
+            return NormalTraffic;
+        auto found = classes.find(packet.header().protocol);
+        return found != classes.end() ? found->second : NormalTraffic;
+    }
+
+
+    void Connection::configureTrafficClass(TrafficClass cls, size_t weight, double rateCap)
+    {
+        auto self = shared_from_this();
+        m_socket.getIOService()->post([self, cls, weight, rateCap]
+        {
+            self->m_pending.configure(cls, weight, rateCap);
+            self->sendPending();
+        });
+    }
+
+
+    // backlog rate is taken only when packets arrive, so that it stays the same while
+    // they drain and the last of them leaves by the end of interval
+    void Connection::updatePacingRate(bool newBacklog)
+    {
+        if (newBacklog)
+        {
+            const double interval = duration<double>(m_socket.options().pacingInterval).count();
+            m_backlogRate = interval > 0 ? (m_pending.bytes() + m_objects.unsentBytes()) / interval : std::numeric_limits<double>::max();
+        }
+
+        const double srtt = duration<double>(m_rtt.srtt()).count();
+        const double windowRate = cPacingGain * double(m_congestion->window()) / std::max(srtt, 1e-6);
+        m_pacer.setRate(std::min(m_backlogRate, windowRate));
+    }
+
+
+    // one packet may always go, so window smaller than a datagram doesn't stall connection
+    bool Connection::canSend(size_t bytes) const
+    {
+        if (m_packetsInFlight >= cMaxPacketsInFlight)
+            return false;
+        return m_bytesInFlight == 0 || m_bytesInFlight + bytes <= m_congestion->window();
     }
 
 
     void Connection::doSend(const PacketPtr& packet, size_t resendLimit)
     {
+        // queued or sent before datagram size fell back, or bigger than any datagram
+        if (packet->size() > m_pathMtu.current() && packet->header().protocol != cProtoProbe)
+        {
+            sendSliced(packet, resendLimit);
+            return;
+        }
+
         // store packet in the send buffer, get previous value
         PacketExt old = m_sentPackets.store(packet, resendLimit, m_ack);
-        
+        m_bytesInFlight += packet->size();
+        ++m_packetsInFlight;
+
         if (old.packet)
         {
             LogWarning() << "send buffer is full on connection with" << m_peer;
+            m_bytesInFlight -= old.packet->size();
+            --m_packetsInFlight;
+            // back to queue, not through asyncSend, so it keeps its messageId
             if (old.resendLimit > 0)
-                asyncSend(old.packet, old.resendLimit - 1);
+                m_pending.push(OutboundPacket(old.packet, old.resendLimit - 1, trafficClassOf(*old.packet)));
         }
 
+        // accepting side tags its packets with its id, the other side echoes that id back
+        packet->header().connId = headerConnId();
+
         uint16_t seqNum = packet->header().seqNum;
-        m_socket.rawSocket().async_send_to(boost::asio::buffer(packet->buffer()), m_peer,
-            boost::bind(&Connection::handleSend, this, packet, boost::asio::placeholders::error));
+        m_socket.sendDatagram(packet, m_peer);
+
+        // packets closer than cBurstGap to previous one extend current burst
+        const auto now = system_clock::now();
+        if (m_stats.bursts == 0 || now - m_sendTime > cBurstGap)
+        {
+            ++m_stats.bursts;
+            m_burstPackets = 0;
+        }
+        m_stats.maxBurst = std::max<uint64_t>(m_stats.maxBurst, ++m_burstPackets);
+
+        // our ack went along with data
+        m_sendTime = now;
+        m_ackPending = false;
+        m_unackedPackets = 0;
+        armTimer(nextDeadline());
 
         LogDebug() << "sending packet" << seqNum << "with protocol" << packet->header().protocol << "to" << m_peer;
-        ++m_sentCount;
+        ++m_stats.sentPackets;
     }
 
 
-    // handler for logging errors during async_send_to
+    // slices are unreliable messages of their own, acked one by one and resent within
+    // packet's limit; whole packet keeps its channel and messageId inside them
+    void Connection::sendSliced(const PacketPtr& packet, size_t resendLimit)
+    {
+        std::vector<PacketPtr> slices;
+        const uint32_t sliceId = m_nextSliceId++;
+        if (!slicePacket(*packet, sliceId, m_pathMtu.current(), slices))
+            return;
+
+        // ack of reliable packet slides its channel's window, fragment's that of its transfer
+        const PacketHeader& header = packet->header();
+        if (isReliableChannel(header.channel) || header.protocol == cProtoFragment ||
+            (header.protocol == cProtoSlice && m_sliced.count(sliceIdOf(*packet))))
+        {
+            SlicedPacket sliced = { packet, slices.size() };
+            m_sliced[sliceId] = sliced;
+        }
+
+        ++m_stats.slicedPackets;
+        for (const PacketPtr& slice : slices)
+        {
+            slice->header().channel = UnreliableChannel;
+            slice->header().messageId = m_nextMessageId[UnreliableChannel]++;
+            doSend(slice, resendLimit);
+        }
+    }
+
+
+    void Connection::sendProbe(size_t size)
+    {
+        PacketPtr probe = makePacket(cProtoProbe);
+        probe->buffer().resize(size);
+        probe->header().channel = UnreliableChannel;
+        probe->header().messageId = m_nextMessageId[UnreliableChannel]++;
+
+        LogDebug() << "probing path to" << m_peer << "with datagram of" << size << "bytes";
+        m_pathMtu.onProbeSent(size);
+        ++m_stats.sentProbes;
+        doSend(probe, 0);
+    }
+
+
+    void Connection::applyDatagramSize()
+    {
+        LogDebug() << "datagrams to" << m_peer << "are up to" << m_pathMtu.current() << "bytes now";
+        m_coalescer.setDatagramSize(m_pathMtu.current());
+        m_objects.setDatagramSize(m_pathMtu.current());
+    }
+
+
+    void Connection::sendControl(uint16_t protocol)
+    {
+        LogDebug() << "sending system packet" << protocol << "to" << m_peer;
+
+        PacketPtr packet = makeControlPacket(protocol, m_token, headerConnId());
+        packet->header().ack = m_ack;
+        m_socket.sendDatagram(packet, m_peer);
+
+        m_sendTime = system_clock::now();
+        m_ackPending = false;
+        m_unackedPackets = 0;
+    }
+
+
+    void Connection::answerRebind(uint64_t cookie)
+    {
+        LogDebug() << "proving to" << m_peer << "that we have moved";
+        m_socket.sendDatagram(makeRebindPacket(m_token, cookie, headerConnId()), m_peer);
+    }
+
+
+    void Connection::handleChallenge(uint64_t cookie)
+    {
+        m_recvTime = system_clock::now();
+        m_token = cookie;
+        sendControl(cProtoConnectResponse);
+    }
+
+
+    void Connection::establish(uint64_t token, uint32_t headerConnId)
+    {
+        m_recvTime = system_clock::now();
+        m_token = token;
+        if (headerConnId & cConnIdAssigned)
+            m_peerId = headerConnId & ~cConnIdAssigned;
+
+        m_established = true;
+        scheduleFlush();
+        armTimer(nextDeadline());
+    }
+
+
+    void Connection::handleHeartbeat(const PacketHeader& header)
+    {
+        m_recvTime = system_clock::now();
+        processPeerAcks(header.ack);
+        armTimer(nextDeadline());
+    }
+
+
+    void Connection::armTimer(const SCTimePoint& deadline)
+    {
+        if (m_timerArmed && m_timer.expires_at() <= deadline)
+            return;
+
+        // pending wait, if any, is cancelled and its handler sees operation_aborted; handler
+        // holds weak reference, so timer doesn't keep removed connection alive
+        m_timerArmed = true;
+        m_timer.expires_at(deadline);
+
+        std::weak_ptr<Connection> weak = shared_from_this();
+        m_timer.async_wait(makeArenaHandler(m_socket.m_handlerArena, [weak](const boost::system::error_code& error)
+        {
+            if (error == boost::asio::error::operation_aborted)
+                return;
+            if (auto self = weak.lock())
+                self->handleTimer();
+        }));
+    }
+
+
+    void Connection::handleTimer()
+    {
+        m_timerArmed = false;
+        if (m_isDead)
+            return;
+
+        const auto now = system_clock::now();
+        if (now - m_recvTime >= deadTimeout())
+        {
+            LogDebug() << "connection with" << m_peer << "missed" << cMissedHeartbeats << "heartbeats";
+            markDead(true);
+            return;
+        }
+
+        // retransmission timed out, wait longer for the next one until acks come back
+        if (detectLostPackets(now) > 0)
+        {
+            m_rtt.backoff();
+            m_congestion->onTimeout(now);
+        }
+
+        // bundles that waited long enough for more messages
+        m_coalescer.flushExpired(now, m_coalesced);
+        if (enqueueCoalesced())
+            sendQueued();
+        else
+            sendPending();
+
+        // path may carry bigger datagrams than we send
+        if (m_established)
+        {
+            if (const size_t probe = m_pathMtu.probeSize(now))
+                sendProbe(probe);
+        }
+
+        // nothing else went out lately, ack and keepalive go alone
+        if ((m_ackPending && now >= m_ackDeadline) || now - m_sendTime >= heartbeatInterval())
+        {
+            sendControl(cProtoHeartbeat);
+            ++m_stats.sentHeartbeats;
+        }
+
+        armTimer(nextDeadline());
+    }
+
+
+    SCTimePoint Connection::nextDeadline() const
+    {
+        SCTimePoint deadline = std::min(m_recvTime + deadTimeout(), m_sendTime + heartbeatInterval());
+        if (m_ackPending)
+            deadline = std::min(deadline, m_ackDeadline);
+        if (!m_sentPackets.empty())
+            deadline = std::min(deadline, m_sentPackets.oldestTime() + m_rtt.rto());
+        if (!m_pending.empty())
+            deadline = std::min(deadline, m_pending.capReadyTime(system_clock::now()));
+        if (m_established)
+            deadline = std::min(deadline, m_pathMtu.nextProbeTime());
+        return std::min(deadline, m_coalescer.deadline());
+    }
+
+
+    milliseconds Connection::heartbeatInterval() const
+    {
+        const milliseconds interval = duration_cast<milliseconds>(cHeartbeatRttFactor * m_rtt.srtt());
+        return std::min(cMaxHeartbeatInterval, std::max(cMinHeartbeatInterval, interval));
+    }
+
+
+    milliseconds Connection::deadTimeout() const
+    {
+        return std::max(cMinDeadTimeout, heartbeatInterval() * cMissedHeartbeats);
+    }
+
+
+    // handler for errors reported by socket when sending packet
     void Connection::handleSend(const PacketPtr& packet, const boost::system::error_code& error)
     {
         LogTrace() << "[+] Connection::handleSend";
@@ -71,98 +736,317 @@ namespace core {
         LogTrace() << "[-] Connection::handleSend";
     }
 
+    PacketExt Connection::releaseSent(uint16_t seqNum)
+    {
+        PacketExt pExt = m_sentPackets.release(seqNum);
+        m_bytesInFlight -= pExt.packet->size();
+        --m_packetsInFlight;
+        return pExt;
+    }
+
+    // resend goes out regardless of window, it replaces the lost packet in flight
     void Connection::removeUndeliveredPacket(uint16_t seqNum)
     {
         if (m_sentPackets.contains(seqNum))
         {
-            PacketExt pExt = m_sentPackets.release(seqNum);
-            if (pExt.resendLimit > 0)
+            PacketExt pExt = releaseSent(seqNum);
+            if (pExt.packet->header().protocol == cProtoProbe)
+            {
+                // lost or refused by socket as too big, the next one may go at once
+                m_pathMtu.onProbeLost(pExt.packet->size(), system_clock::now());
+                armTimer(nextDeadline());
+            }
+            else if (pExt.resendLimit > 0)
+            {
                 doSend(pExt.packet, pExt.resendLimit - 1);
+                ++m_stats.resentPackets;
+            }
         }
     }
 
-    void Connection::confirmPacketDelivery(uint16_t seqNum)
+    void Connection::handleLostPacket(uint16_t seqNum, const SCTimePoint& now)
     {
         if (m_sentPackets.contains(seqNum))
         {
-            PacketExt pExt = m_sentPackets.release(seqNum);
+            // packet is looked up before it's resent under another seqNum
+            // lost probe says its size doesn't get through, not that network is congested
+            const PacketExt& pExt = m_sentPackets.at(seqNum);
+            if (pExt.packet->header().protocol != cProtoProbe)
+            {
+                m_congestion->onPacketLost(pExt.packet->size(), pExt.timestamp, now);
+                if (m_pathMtu.onPacketLost(pExt.packet->size(), now))
+                    applyDatagramSize();
+            }
+            removeUndeliveredPacket(seqNum);
+        }
+    }
+
+    void Connection::confirmPacketDelivery(uint16_t seqNum, const SCTimePoint& now)
+    {
+        if (m_sentPackets.contains(seqNum))
+        {
+            PacketExt pExt = releaseSent(seqNum);
+
+            // resent packet gets new seqNum, so a sample is never ambiguous (Karn's rule holds)
+            microseconds observedRTT = duration_cast<microseconds>(now - pExt.timestamp);
+            m_rtt.addSample(observedRTT);
+            if (pExt.packet->header().protocol == cProtoProbe)
+            {
+                if (m_pathMtu.onProbeAcked(pExt.packet->size(), now))
+                    applyDatagramSize();
+            }
+            else
+            {
+                m_congestion->onPacketAcked(pExt.packet->size(), observedRTT, pExt.timestamp, now);
+                m_pathMtu.onPacketAcked(pExt.packet->size());
+            }
 
-            milliseconds observedRTT = duration_cast<milliseconds>(system_clock::now() - pExt.timestamp);
-            m_averageRTT = (9 * m_averageRTT + static_cast<size_t>(observedRTT.count())) / 10;
-            
             LogDebug() << "acknowledged packet" << pExt.packet->header().seqNum << "for peer" << m_peer
-                       << "RTT is" << observedRTT << "averageRTT" << milliseconds(m_averageRTT);
-            ++m_ackdCount;
+                       << "RTT is" << observedRTT << "srtt" << m_rtt.srtt() << "rto" << m_rtt.rto();
+            ++m_stats.confirmedPackets;
+
+            handleAckedPayload(*pExt.packet);
+        }
+    }
+
+
+    // packet that was cut into slices is acked with the last of them
+    void Connection::handleAckedPayload(const Packet& packet)
+    {
+        const PacketHeader& header = packet.header();
+        const uint16_t protocol = header.protocol;
+
+        // bundle or fragment is a message of its channel too
+        if (isReliableChannel(header.channel))
+            m_outboundChannels[header.channel].onAcked(header.messageId);
+
+        if (protocol == cProtoFragment)
+        {
+            m_objects.handleAcked(packet);
+            return;
         }
+        if (protocol != cProtoSlice)
+            return;
+
+        auto it = m_sliced.find(sliceIdOf(packet));
+        if (it == m_sliced.end() || --it->second.unacked > 0)
+            return;
+
+        PacketPtr whole = std::move(it->second.packet);
+        m_sliced.erase(it);
+        handleAckedPayload(*whole);
     }
 
 
-    // usually we receive packets in order, so most recent come later, so we search
-    // for insertion point from most recent to oldest
+    // packet passes through its channel: duplicates are acked but not delivered again,
+    // ordered messages wait until those before them arrive
     void Connection::handleReceive(const PacketPtr& packet)
     {
         LogTrace() << "[+] Connection::handleReceive";
 
         m_recvTime = system_clock::now();
-        ++m_recvCount;
+        ++m_stats.receivedPackets;
 
         const PacketHeader& header = packet->header();
-        
-        // remember received packet in my ack
-        m_ack.updateForSeqNum(header.seqNum);
 
+        // peer accepted this connection and told us its id
+        if (header.connId & cConnIdAssigned)
+            m_peerId = header.connId & ~cConnIdAssigned;
+        
         // confirm sent packets based on peer ack
         processPeerAcks(header.ack);
 
-        PacketPtr old = m_recvPackets.insert(header.seqNum, packet);
-        if (old)
+        const uint8_t channel = channelOf(header);
+        const InboundChannel::Verdict verdict = admit(packet);
+        if (verdict == InboundChannel::Refused)
         {
-            if (old->header().seqNum == header.seqNum)
-                LogDebug() << "received packet" << header.seqNum << "duplicate from" << m_peer;
-            else
-                LogError() << "recv buffer seems full, discarding old packet from" << m_peer;
+            // not acked, peer sends it again when ordered channel may have room
+            LogDebug() << "no room for message" << header.messageId << "on channel" << int(channel) << "from" << m_peer;
+            ++m_stats.refusedMessages;
+            return;
+        }
+
+        // remember received packet in my ack, duplicates too: peer may have missed our ack
+        m_ack.updateForSeqNum(header.seqNum);
+
+        // if we send nothing meanwhile, ack goes alone after a short delay
+        if (!m_ackPending)
+        {
+            m_ackPending = true;
+            m_ackDeadline = m_recvTime + cAckDelay;
+        }
+
+        if (channel == ReliableUnorderedChannel && ++m_unackedPackets >= cAckEveryPackets)
+        {
+            sendControl(cProtoHeartbeat);
+            ++m_stats.sentHeartbeats;
+        }
+        armTimer(nextDeadline());
+
+        if (verdict == InboundChannel::Discarded)
+        {
+            LogDebug() << "message" << header.messageId << "on channel" << int(channel) << "from" << m_peer << "is duplicate or stale";
+            ++m_stats.discardedMessages;
+            return;
+        }
+
+        bool transfers = deliverReady(channel);
+
+        // packets put together from slices pass their own channels as if they came whole;
+        // one that ordered channel has no room for yet is offered again with the next packet.
+        // Its slices are acked already, so it is never dropped: sender's windows of channels
+        // and of object transfers bound how many can wait
+        std::deque<PacketPtr> refused;
+        while (!m_unsliced.empty())
+        {
+            PacketPtr whole = std::move(m_unsliced.front());
+            m_unsliced.pop_front();
+
+            const InboundChannel::Verdict wholeVerdict = admit(whole);
+            if (wholeVerdict == InboundChannel::Refused)
+                refused.push_back(whole);
+            else if (wholeVerdict == InboundChannel::Accepted)
+                transfers = deliverReady(channelOf(whole->header())) || transfers;
         }
+        m_unsliced.swap(refused);
+
+        // file offers are answered, answers let file fragments go
+        if (transfers && feedFragments())
+            sendQueued();
 
         LogTrace() << "[-] Connection::handleReceive";
     }
 
 
+    // fragment of object that doesn't fit into reassembly budget is refused before
+    // its channel sees it, so that its resend isn't taken for duplicate
+    InboundChannel::Verdict Connection::admit(const PacketPtr& packet)
+    {
+        const PacketHeader& header = packet->header();
+        if (header.protocol == cProtoFragment && !m_objects.canAccept(*packet))
+            return InboundChannel::Refused;
+        return m_inbound[channelOf(header)].receive(packet);
+    }
+
+
+    // probes only needed acks; slices wait for the rest of their packet
+    bool Connection::deliverReady(uint8_t channel)
+    {
+        bool transfers = false;
+        while (PacketPtr ready = m_inbound[channel].next())
+        {
+            if (ready->header().protocol == cProtoProbe)
+                continue;
+
+            if (ready->header().protocol == cProtoSlice)
+            {
+                if (PacketPtr whole = m_slices.receive(*ready))
+                    m_unsliced.push_back(whole);
+                continue;
+            }
+
+            if (ready->header().protocol == cProtoBundle)
+            {
+                std::vector<PacketPtr> messages;
+                if (!m_coalescer.split(*ready, messages))
+                    LogWarning() << "malformed bundle from" << m_peer << ", messages after the bad one dropped";
+                for (const PacketPtr& message : messages)
+                    m_delivered.push(message);
+                continue;
+            }
+
+            if (isTransferProtocol(ready->header().protocol))
+            {
+                ready = m_objects.receive(*ready);
+                transfers = true;
+            }
+            if (ready)
+                m_delivered.push(ready);
+        }
+        return transfers;
+    }
+
+
     // clean up sent buffer, confirm delivered packets and remove (or resend) old ones
-    //   peerAck     - latest seqNum that peer received
-    //   peerAckBits - next 32 acks after latest
+    //   peerAck - latest seqNum that peer received and which of ack_type::cWindow - 1 before it did
     void Connection::processPeerAcks(const ack_type& peerAck)
     {
+        // clock is read once per header, packets it confirms all arrived with it
+        const auto now = system_clock::now();
+
         // confirm acknowledged packets
         peerAck.forEachAckedSeqNum([&](uint16_t seqNum){
-            confirmPacketDelivery(seqNum);
+            confirmPacketDelivery(seqNum, now);
         });
 
-        // consider oldest packet undelivered if its seqNum is less then peerAck - 256,
-        // or timestamp is more then two seconds away from current time
-        const auto minTime = system_clock::now() - seconds(2);
+        // consider oldest packet undelivered if its seqNum is less then peerAck - 256
         const uint16_t minSeqNum = peerAck.latestSeqNum() - 256;
+        while (!m_sentPackets.empty() && moreRecentSeqNum(minSeqNum, m_sentPackets.oldestSeqNum()))
+        {
+            handleLostPacket(m_sentPackets.oldestSeqNum(), now);
+            ++m_stats.lostBySeqGap;
+        }
+
+        // or if later packets got through without it
+        detectSkippedPackets(peerAck, now);
+
+        // or if it waits for ack longer than retransmission timeout
+        detectLostPackets(now);
+
+        // acks opened the window, and maybe window of object transfers or of reliable channels
+        const bool released = releaseOverWindow();
+        if (feedFragments() || released)
+            sendQueued();
+        else
+            sendPending();
+    }
+
+
+    // resent packets get seqNums past peer's latest ack, so loop never meets them
+    void Connection::detectSkippedPackets(const ack_type& peerAck, const SCTimePoint& now)
+    {
+        const uint16_t latest = peerAck.latestSeqNum();
+
+        // stale or bogus ack of something we haven't sent yet
+        if (!moreRecentSeqNum(m_sentPackets.latestSeqNum(), latest))
+            return;
 
-        while (!m_sentPackets.empty())
+        for (uint16_t seqNum = m_sentPackets.oldestSeqNum(); moreRecentSeqNum(latest, seqNum); ++seqNum)
         {
-            if (moreRecentSeqNum(minSeqNum, m_sentPackets.oldestSeqNum()) ||
-                minTime > m_sentPackets.oldestTime())
+            if (m_sentPackets.contains(seqNum) && peerAck.countAckedAfter(seqNum) >= cFastRetransmitThreshold)
             {
-                removeUndeliveredPacket(m_sentPackets.oldestSeqNum());
+                LogDebug() << "packet" << seqNum << "to" << m_peer << "was skipped by peer's ack, resending";
+                handleLostPacket(seqNum, now);
+                ++m_stats.lostByFastRetransmit;
             }
-            else break;
         }
     }
 
 
-    // dispatch all packets from oldest to most recent, to all active listeners
-    void Connection::dispatchReceivedPackets(const PacketDispatcher& dispatcher)
+    // resent packets are stored as most recent, so loop ends at packets sent after minTime
+    size_t Connection::detectLostPackets(const SCTimePoint& now)
     {
-        while (!m_recvPackets.empty())
+        const SCTimePoint minTime = now - m_rtt.rto();
+
+        size_t lost = 0;
+        while (!m_sentPackets.empty() && minTime >= m_sentPackets.oldestTime())
         {
-            PacketPtr packet = m_recvPackets.removeLast();
-            if (packet)
-                dispatcher.dispatchPacket(*this, packet);
+            // timer doesn't back off for lost probe
+            if (m_sentPackets.at(m_sentPackets.oldestSeqNum()).packet->header().protocol != cProtoProbe)
+                ++lost;
+            handleLostPacket(m_sentPackets.oldestSeqNum(), now);
         }
+        m_stats.lostByTimeout += lost;
+        return lost;
+    }
+
+
+    // dispatch all packets from oldest to most recent, to all active listeners
+    void Connection::dispatchReceivedPackets(const PacketDispatcher& dispatcher)
+    {
+        PacketPtr packet;
+        while (m_delivered.pop(packet))
+            dispatcher.dispatchPacket(*this, packet);
     }
 
 }
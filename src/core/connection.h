@@ -3,7 +3,20 @@
 #include "core/packet.h"
 #include "core/packet_buffer.h"
 #include "core/fast_spinlock.h"
+#include "core/concurrent_queue.h"
+#include "core/rtt_estimator.h"
+#include "core/congestion_controller.h"
+#include "core/pacing_scheduler.h"
+#include "core/channel.h"
+#include "core/fair_queue.h"
+#include "core/object_transfer.h"
+#include "core/coalescer.h"
+#include "core/path_mtu.h"
+#include <deque>
+#include <map>
+#include <boost/asio/system_timer.hpp>
 #include <set>
+#include <vector>
 
 
 namespace core {
@@ -13,53 +26,274 @@ namespace core {
     class SmartSocket;
 
 
+    // per-connection counters, updated only from io thread
+    struct ConnectionStats
+    {
+        ConnectionStats()
+          : sentPackets(0), confirmedPackets(0), receivedPackets(0), sentHeartbeats(0),
+            lostByTimeout(0), lostByFastRetransmit(0), lostBySeqGap(0), resentPackets(0),
+            bursts(0), maxBurst(0), expiredMessages(0), discardedMessages(0), refusedMessages(0), sentProbes(0), slicedPackets(0) {}
+
+        uint64_t sentPackets;
+        uint64_t confirmedPackets;
+        uint64_t receivedPackets;
+        uint64_t sentHeartbeats;
+
+        // packets declared lost: unacked longer than RTO, skipped by several later acks,
+        // or left 256 seqNums behind peer's ack
+        uint64_t lostByTimeout;
+        uint64_t lostByFastRetransmit;
+        uint64_t lostBySeqGap;
+
+        // lost packets that were sent again within their resend limit
+        uint64_t resentPackets;
+
+        // runs of data packets sent back-to-back, and the longest of them;
+        // sentPackets / bursts is the average burst size
+        uint64_t bursts;
+        uint64_t maxBurst;
+
+        // unreliable and sequenced messages dropped unsent after waiting longer than
+        // SocketOptions::maxUnreliableDelay
+        uint64_t expiredMessages;
+
+        // received messages dropped by their channel as duplicate or stale, and
+        // left unacked because ordered channel had no room to hold them
+        uint64_t discardedMessages;
+        uint64_t refusedMessages;
+
+        // path MTU probes, and packets that were too big for path and went in slices
+        uint64_t sentProbes;
+        uint64_t slicedPackets;
+    };
+
+
     class Connection :
         public IConnection,
         public std::enable_shared_from_this<Connection>
     {
     public:
 
-        Connection(SmartSocket& socket, const udp::endpoint& peer);
+        // connection that is not established yet holds outbound packets until handshake completes
+        Connection(SmartSocket& socket, const udp::endpoint& peer, bool established = true);
         ~Connection();
 
         // Implements IConnection::peer
-        const udp::endpoint& peer() const override { return m_peer; }
-
-        // makes new job for ioservice: doSend(packet, resendLimit)
+        udp::endpoint peer() const override
+        {
+            FastSpinLock::Guard guard(m_peerLock);
+            return m_peer;
+        }
+
+        // [any-thread] queue packet for sending, io thread picks it up with the rest of the batch;
+        // packet goes on unreliable channel, resent at most resendLimit times; packets under
+        // reserved protocols (see isReservedProtocol) are dropped here and by the calls below
         void asyncSend(const PacketPtr& packet, size_t resendLimit = 0);
 
+        // [any-thread] queue packet on given channel, reliable ones are resent until acked
+        void asyncSend(const PacketPtr& packet, Channel channel);
+
+        // [any-thread] queue several packets at once, io thread is signalled at most once
+        void asyncSendMany(const std::vector<PacketPtr>& packets, size_t resendLimit = 0);
+        void asyncSendMany(const std::vector<PacketPtr>& packets, Channel channel);
+
+        // [any-thread] application's tick is over: small messages bundled so far go now
+        // instead of waiting for their delay (see SocketOptions::coalescing)
+        void flush();
+
+        // [any-thread] send object of any size as fragments, peer's listeners of protocol get
+        // it whole in one packet; onComplete is called on io thread once peer has all of it
+        void sendObject(uint16_t protocol, const ObjectSource& source, const ObjectTransfer::CompletionHandler& onComplete = nullptr);
+        void sendObject(uint16_t protocol, const std::shared_ptr<const std::vector<uint8_t>>& data, const ObjectTransfer::CompletionHandler& onComplete = nullptr);
+
+        // [any-thread] send file straight from its mapping, peer stores it under given name
+        // in its fileDirectory and resumes it if an earlier attempt was cut; peer's listeners
+        // of protocol get FileTransferStats packet (see ObjectTransfer::parseFileReport),
+        // onComplete gets ours; false if file can't be mapped, name isn't plain or protocol is reserved
+        bool sendFile(uint16_t protocol, const std::string& path, const std::string& name, const ObjectTransfer::FileCompletionHandler& onComplete = nullptr);
+
+        // [any-thread] share of sending budget of given traffic class on this connection,
+        // relative to other classes, and its rate cap in bytes per second (0 is no cap)
+        void configureTrafficClass(TrafficClass cls, size_t weight, double rateCap = 0);
+
         bool isDead() const { return m_isDead; }
 
+        // handshake has completed, or wasn't required
+        bool isEstablished() const { return m_established; }
+
+        // id of accepted connection in socket's slab, 0 if there's none
+        uint32_t localId() const { return m_localId; }
+
         // dispatch all received packets to all active listeners
         void dispatchReceivedPackets(const PacketDispatcher& dispatcher);
 
         const SCTimePoint& lastActivityTime() const { return m_recvTime; }
 
+        const ConnectionStats& stats() const { return m_stats; }
+
+        const RttEstimator& rtt() const { return m_rtt; }
+
+        const ICongestionController& congestion() const { return *m_congestion; }
+
+        const TransferStats& transferStats() const { return m_objects.stats(); }
+
+        const CoalescingStats& coalescingStats() const { return m_coalescer.stats(); }
+
+        // biggest datagram connection sends now, as path MTU discovery found it
+        size_t datagramSize() const { return m_pathMtu.current(); }
+
     protected:
 
         friend class SmartSocket;
+        friend class PacingScheduler;
         
-        // [io-thread-handle] store packet in send buffer, call async_send_to
+        // [io-thread-handle] store packet in send buffer, pass it to socket; packet bigger
+        // than datagram size goes in slices
         void doSend(const PacketPtr& packet, size_t resendLimit);
 
-        // [io-thread-handle] success/failure handle for async_send_to
+        // [io-thread] send slices of packet that doesn't fit into datagram, each on its own
+        void sendSliced(const PacketPtr& packet, size_t resendLimit);
+
+        // [io-thread] send padded probe of given size
+        void sendProbe(size_t size);
+
+        // [io-thread] datagram size has changed, bundles and new transfers follow it
+        void applyDatagramSize();
+
+        // post flushOutbound unless it is already pending
+        void scheduleFlush();
+
+        // [io-thread-handle] send everything pushed to outbound queue so far, as window allows
+        void flushOutbound();
+
+        // [io-thread] number packet within its channel and queue it by its traffic class,
+        // reliable one is held while its id would not fit into peer's window
+        void enqueue(const OutboundPacket& item);
+
+        // [io-thread] number held reliable messages that window has room for now, return whether there were any
+        bool releaseOverWindow();
+
+        // [io-thread] give packet the next messageId of its channel and queue it
+        void number(const OutboundPacket& item);
+
+        // [io-thread] packets were queued: pace them at new rate, or send as window allows
+        void sendQueued();
+
+        // [io-thread] queue fragments that window of object transfers has room for, return how many
+        size_t feedFragments();
+
+        // [io-thread] queue bundles and messages coalescer let go, return whether there were any
+        bool enqueueCoalesced();
+
+        // [io-thread] send held packets while window allows
+        void sendPending();
+
+        // congestion window and send buffer have room for packet of this size
+        bool canSend(size_t bytes) const;
+
+        // [io-thread] size of next held packet if window has room for it, 0 otherwise
+        // (if rate caps of traffic classes hold it, timer wakes connection later)
+        size_t pacedPacketSize(const SCTimePoint& now);
+
+        // [io-thread] scheduler's turn: send next held packet, spending pacer's tokens
+        void sendPacedPacket();
+
+        // class of packet by its protocol, as socket options say
+        TrafficClass trafficClassOf(const Packet& packet) const;
+
+        // [io-thread] rate that spreads newly queued backlog over pacing interval,
+        // capped by what congestion window allows per round trip
+        void updatePacingRate(bool newBacklog);
+
+        // [io-thread-handle] failure handle for packet sent by socket
         void handleSend(const PacketPtr& packet, const boost::system::error_code& error);
 
         // [io-thread-handle] process packet headers, place packet into queue
         void handleReceive(const PacketPtr& packet);
 
+        // [io-thread] pass packet to its channel, unless it's fragment there's no room for
+        InboundChannel::Verdict admit(const PacketPtr& packet);
+
+        // [io-thread] deliver what channel has ready, return whether transfers got anything
+        bool deliverReady(uint8_t channel);
+
         // clean up send buffer, confirm delivered packets and remove (or resend) old ones
         void processPeerAcks(const ack_type& peerAck);
 
         // remove or resend packet which was considered undelivered
         void removeUndeliveredPacket(uint16_t seqNum);
 
-        // confirm packet, compute RTT, remove from send buffer
-        void confirmPacketDelivery(uint16_t seqNum);
+        // packet was lost in network: tell congestion control, resend or forget it
+        void handleLostPacket(uint16_t seqNum, const SCTimePoint& now);
+
+        // take packet out of send buffer, it's no longer in flight
+        PacketExt releaseSent(uint16_t seqNum);
+
+        // resend packets that peer's ack skipped while acking enough later ones
+        void detectSkippedPackets(const ack_type& peerAck, const SCTimePoint& now);
+
+        // give up on packets unacknowledged for longer than RTO, return how many
+        size_t detectLostPackets(const SCTimePoint& now);
+
+        // confirm packet, compute RTT, remove from send buffer; now is when its ack came
+        void confirmPacketDelivery(uint16_t seqNum, const SCTimePoint& now);
+
+        // [io-thread] peer has packet: fragment goes back to its transfer, slice counts
+        // towards packet it was cut from
+        void handleAckedPayload(const Packet& packet);
 
         // mark connection dead (to be removed later), or revive (if received any packets)
         void markDead(bool value) { m_isDead = value; }
 
+        // [io-thread] peer's address has changed (NAT rebinding), connection moves along
+        void rebind(const udp::endpoint& peer)
+        {
+            FastSpinLock::Guard guard(m_peerLock);
+            m_peer = peer;
+        }
+
+        // [io-thread] peer saw our id come from a new address: echo its cookie with our token
+        void answerRebind(uint64_t cookie);
+
+        // [io-thread] rebind challenge came with the id peer gave us
+        bool isPeerId(uint32_t headerConnId) const { return m_peerId && headerConnId == (m_peerId | cConnIdAssigned); }
+
+        // [io-thread] connection id we assigned on accept, peer echoes it back to us
+        void assignId(uint32_t id) { m_localId = id; }
+
+        // connection id to put into outgoing header
+        uint32_t headerConnId() const { return m_localId ? (m_localId | cConnIdAssigned) : m_peerId; }
+
+        // [io-thread] send system packet carrying handshake token, bypassing sequencing
+        void sendControl(uint16_t protocol);
+
+        // [io-thread] server challenged our connect, echo its cookie
+        void handleChallenge(uint64_t cookie);
+
+        // [io-thread] handshake completed with given token, release held packets
+        void establish(uint64_t token, uint32_t headerConnId = 0);
+
+        // [io-thread] cookie of completed handshake, authenticates disconnect
+        uint64_t token() const { return m_token; }
+
+        // [io-thread] ack-only packet from peer: confirm our packets, peer is alive
+        void handleHeartbeat(const PacketHeader& header);
+
+        // [io-thread] make sure timer fires no later than deadline
+        void armTimer(const SCTimePoint& deadline);
+
+        // [io-thread] send delayed ack or keepalive if due, detect silent peer
+        void handleTimer();
+
+        // nearest moment when timer has something to do
+        SCTimePoint nextDeadline() const;
+
+        // keepalive period when we have nothing to send, scales with RTT
+        std::chrono::milliseconds heartbeatInterval() const;
+
+        // silence after which peer is considered dead, a few missed heartbeats
+        std::chrono::milliseconds deadTimeout() const;
+
 
         static const size_t cQueueSize = 1024;
 
@@ -67,29 +301,114 @@ namespace core {
         // owner of this connection
         SmartSocket& m_socket;
 
-        // remote address of this connection
-        const udp::endpoint m_peer;
+        // remote address of this connection, changes only if peer's NAT rebinds; io thread
+        // reads it as is, other threads under lock
+        udp::endpoint m_peer;
+        mutable FastSpinLock m_peerLock;
+
+        // connection id in our socket's slab if we accepted connection, 0 otherwise
+        uint32_t m_localId;
+
+        // connection id that peer assigned and wants to see in our packets, 0 if none
+        uint32_t m_peerId;
         
         // peer disconnected
         std::atomic<bool> m_isDead;
 
-        // average round-trip time
-        size_t m_averageRTT;
-        size_t m_recvCount;
-        size_t m_sentCount;
-        size_t m_ackdCount;
+        // handshake completed, outbound packets may go
+        std::atomic<bool> m_established;
+
+        // cookie echoed in handshake, 0 until challenge arrives (or without handshake)
+        uint64_t m_token;
+
+        // round-trip time statistics and retransmission timeout
+        RttEstimator m_rtt;
+        ConnectionStats m_stats;
+
+        // sending window, and what's in flight against it
+        CongestionControllerPtr m_congestion;
+        size_t m_bytesInFlight;
+        size_t m_packetsInFlight;
 
         // time when received last packet
         SCTimePoint m_recvTime;
 
+        // time when sent last packet, any packet carries our ack
+        SCTimePoint m_sendTime;
+
+        // received data that peer hasn't got ack for yet, when ack-only packet is due,
+        // and how many packets it covers
+        bool m_ackPending;
+        SCTimePoint m_ackDeadline;
+        size_t m_unackedPackets;
+
+        // delayed ack, retransmission, keepalive and timeout timer
+        boost::asio::system_timer m_timer;
+        bool m_timerArmed;
+
         // acknowledgements for received packets
         ack_type m_ack;
         
         // packets awaiting aks response
         SendPacketBuffer<cQueueSize> m_sentPackets;
 
-        // received packets, ready to be dispatched
-        RecvPacketBuffer<cQueueSize> m_recvPackets;
+        // [io-thread] receiving ends of channels, and next messageId of each sending end
+        InboundChannel m_inbound[cChannelCount];
+        uint16_t m_nextMessageId[cChannelCount];
+
+        // [io-thread] unacked messageIds of reliable channels, and messages waiting for room among them
+        OutboundChannel m_outboundChannels[cChannelCount];
+        std::deque<OutboundPacket> m_overWindow[cChannelCount];
+
+        // received messages in delivery order, pushed by io thread, popped by dispatch
+        mpsc_queue<PacketPtr, PoolAllocator<PacketPtr>> m_delivered;
+
+        // packets pushed by application threads, drained by io thread
+        mpsc_queue<OutboundPacket, PoolAllocator<OutboundPacket>> m_outbound;
+
+        // [io-thread] drained packets that didn't fit into window, go out as acks come
+        // (or, with pacing, as scheduler takes them), traffic classes by their weights
+        FairQueue m_pending;
+
+        // [io-thread] pacing rate and tokens, rate the backlog asked for
+        Pacer m_pacer;
+        double m_backlogRate;
+
+        // [io-thread] objects being sent and reassembled
+        ObjectTransfer m_objects;
+
+        // [io-thread] open bundles of small messages, and what leaves them for the queue
+        Coalescer m_coalescer;
+        std::vector<OutboundPacket> m_coalesced;
+
+        // [io-thread] datagram size of path, and slices of received packets
+        PathMtu m_pathMtu;
+        SliceAssembler m_slices;
+
+        // [io-thread] packets put together from slices that their channel had no room for yet
+        std::deque<PacketPtr> m_unsliced;
+
+        struct SlicedPacket
+        {
+            PacketPtr packet;
+            size_t unacked;
+        };
+
+        // [io-thread] sent packets, whose ack matters, by sliceId of their slices
+        std::map<uint32_t, SlicedPacket> m_sliced;
+        uint32_t m_nextSliceId;
+
+        // [io-thread] connection is in scheduler's list
+        bool m_paceActive;
+
+        // [io-thread] length of current run of back-to-back packets
+        size_t m_burstPackets;
+
+        // flushOutbound is posted and hasn't started draining yet
+        std::atomic<bool> m_flushScheduled;
+
+        // application called flush(), next flushOutbound closes open bundles
+        std::atomic<bool> m_tickEnded;
     };
 
 
@@ -0,0 +1,168 @@
+#include "stdafx.h"
+#include "core/fair_queue.h"
+#include <algorithm>
+
+
+namespace core {
+
+    // default shares of urgent, normal and bulk classes
+    static const size_t cDefaultWeights[cTrafficClassCount] = { 8, 4, 1 };
+
+    // capped class may send this much at once
+    static const size_t cCapBurstBytes = 4 * cBaseDatagramSize;
+
+
+    FairQueue::ClassQueue::ClassQueue()
+      : quantum(cBaseDatagramSize),
+        deficit(0),
+        capped(false),
+        cap(cCapBurstBytes),
+        sentBytes(0)
+    {
+    }
+
+
+    FairQueue::FairQueue()
+      : m_current(0),
+        m_turnStarted(false),
+        m_selected(cTrafficClassCount),
+        m_bytes(0),
+        m_packets(0),
+        m_expired(0)
+    {
+        for (size_t cls = 0; cls < cTrafficClassCount; ++cls)
+            m_classes[cls].quantum = cDefaultWeights[cls] * cBaseDatagramSize;
+    }
+
+
+    void FairQueue::configure(TrafficClass cls, size_t weight, double rateCap)
+    {
+        ClassQueue& queue = m_classes[cls];
+        queue.quantum = std::max<size_t>(1, weight) * cBaseDatagramSize;
+        queue.capped = rateCap > 0;
+        queue.cap.setRate(rateCap);
+    }
+
+
+    void FairQueue::push(const OutboundPacket& item)
+    {
+        const size_t cls = item.trafficClass < cTrafficClassCount ? size_t(item.trafficClass) : size_t(NormalTraffic);
+        m_classes[cls].packets.push_back(item);
+        m_bytes += item.packet->size();
+        ++m_packets;
+    }
+
+
+    // a class that can't send now loses its turn; after cTrafficClassCount of those
+    // in a row nobody can, packets bigger than quantum just take several turns
+    const OutboundPacket* FairQueue::next(const SCTimePoint& now)
+    {
+        if (m_selected != cTrafficClassCount)
+        {
+            if (!dropExpired(m_classes[m_selected], now))
+                return &m_classes[m_selected].packets.front();
+            m_selected = cTrafficClassCount;
+        }
+
+        for (size_t idle = 0; idle < cTrafficClassCount; )
+        {
+            ClassQueue& queue = m_classes[m_current];
+            dropExpired(queue, now);
+            if (queue.packets.empty())
+            {
+                queue.deficit = 0;
+                advance();
+                ++idle;
+                continue;
+            }
+
+            const size_t bytes = queue.packets.front().packet->size();
+            if (queue.capped)
+            {
+                queue.cap.refill(now);
+                if (!queue.cap.canSend(bytes))
+                {
+                    advance();
+                    ++idle;
+                    continue;
+                }
+            }
+
+            if (!m_turnStarted)
+            {
+                queue.deficit += queue.quantum;
+                m_turnStarted = true;
+            }
+
+            if (queue.deficit >= bytes)
+            {
+                m_selected = m_current;
+                return &queue.packets.front();
+            }
+
+            advance();
+            idle = 0;
+        }
+        return nullptr;
+    }
+
+
+    OutboundPacket FairQueue::pop()
+    {
+        ClassQueue& queue = m_classes[m_selected];
+        OutboundPacket item = std::move(queue.packets.front());
+        queue.packets.pop_front();
+        m_selected = cTrafficClassCount;
+
+        const size_t bytes = item.packet->size();
+        queue.deficit -= bytes;
+        queue.sentBytes += bytes;
+        if (queue.capped)
+            queue.cap.consume(bytes);
+        m_bytes -= bytes;
+        --m_packets;
+
+        // emptied class doesn't save up its deficit
+        if (queue.packets.empty())
+        {
+            queue.deficit = 0;
+            advance();
+        }
+        return item;
+    }
+
+
+    SCTimePoint FairQueue::capReadyTime(const SCTimePoint& now) const
+    {
+        SCTimePoint ready = SCTimePoint::max();
+        for (const ClassQueue& queue : m_classes)
+        {
+            if (queue.capped && !queue.packets.empty())
+                ready = std::min(ready, queue.cap.readyTime(queue.packets.front().packet->size(), now));
+        }
+        return ready;
+    }
+
+
+    bool FairQueue::dropExpired(ClassQueue& queue, const SCTimePoint& now)
+    {
+        bool dropped = false;
+        while (!queue.packets.empty() && queue.packets.front().expiry <= now)
+        {
+            m_bytes -= queue.packets.front().packet->size();
+            --m_packets;
+            ++m_expired;
+            queue.packets.pop_front();
+            dropped = true;
+        }
+        return dropped;
+    }
+
+
+    void FairQueue::advance()
+    {
+        m_current = (m_current + 1) % cTrafficClassCount;
+        m_turnStarted = false;
+    }
+
+}
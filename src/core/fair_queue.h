@@ -0,0 +1,107 @@
+#pragma once
+#include "core/packet.h"
+#include "core/pacing_scheduler.h"
+#include <deque>
+
+
+namespace core {
+
+    // Share of connection's sending budget a packet competes for. Class is chosen by
+    // packet's protocol (SocketOptions::trafficClasses), normal by default.
+    enum TrafficClass : uint8_t
+    {
+        UrgentTraffic,      // small latency-critical packets: input, RPC
+        NormalTraffic,      // everything not classified otherwise
+        BulkTraffic         // uploads and transfers, take what's left
+    };
+
+    static const size_t cTrafficClassCount = 3;
+
+
+    struct OutboundPacket
+    {
+        OutboundPacket() : resendLimit(0), trafficClass(NormalTraffic), expiry(SCTimePoint::max()) {}
+        OutboundPacket(const PacketPtr& p, size_t limit, TrafficClass cls = NormalTraffic)
+            : packet(p), resendLimit(limit), trafficClass(cls), expiry(SCTimePoint::max()) {}
+
+        PacketPtr packet;
+        size_t resendLimit;
+        TrafficClass trafficClass;
+
+        // packet still queued at this moment is dropped instead of going out late
+        SCTimePoint expiry;
+    };
+
+
+    // Outbound queue of a connection, one FIFO per traffic class, served by deficit
+    // round robin: on its turn a class may send weight * cBaseDatagramSize bytes, so
+    // backlogged classes share bandwidth by weight and a small urgent packet waits for
+    // at most one turn of the others. A class may also be capped at a rate, it's
+    // skipped while its token bucket is empty. Packets past their expiry are dropped
+    // when they get to the front of their class.
+    class FairQueue
+    {
+    public:
+
+        FairQueue();
+
+        // weight is a share relative to other classes, rateCap in bytes per second, 0 is no cap
+        void configure(TrafficClass cls, size_t weight, double rateCap);
+
+        void push(const OutboundPacket& item);
+
+        bool empty() const { return m_packets == 0; }
+
+        // bytes waiting in all classes
+        size_t bytes() const { return m_bytes; }
+
+        // packet to be sent next, nullptr if all classes are empty or capped; the same
+        // packet is returned until it's popped or expires
+        const OutboundPacket* next(const SCTimePoint& now);
+
+        // take packet returned by next()
+        OutboundPacket pop();
+
+        // earliest moment when a capped class may send again, max() if nothing waits for cap
+        SCTimePoint capReadyTime(const SCTimePoint& now) const;
+
+        // bytes taken from each class so far
+        uint64_t sentBytes(TrafficClass cls) const { return m_classes[cls].sentBytes; }
+
+        // packets dropped unsent because they expired
+        uint64_t expiredPackets() const { return m_expired; }
+
+    private:
+
+        struct ClassQueue
+        {
+            ClassQueue();
+
+            std::deque<OutboundPacket> packets;
+            size_t quantum;
+            size_t deficit;
+            bool capped;
+            Pacer cap;
+            uint64_t sentBytes;
+        };
+
+        void advance();
+
+        // drop expired packets at the front of class, return whether there were any
+        bool dropExpired(ClassQueue& queue, const SCTimePoint& now);
+
+        ClassQueue m_classes[cTrafficClassCount];
+
+        // class whose turn it is, and whether its quantum was granted for this turn
+        size_t m_current;
+        bool m_turnStarted;
+
+        // class of packet returned by next(), or cTrafficClassCount
+        size_t m_selected;
+
+        size_t m_bytes;
+        size_t m_packets;
+        uint64_t m_expired;
+    };
+
+}
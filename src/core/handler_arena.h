@@ -0,0 +1,160 @@
+#pragma once
+#include "core/fast_spinlock.h"
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+namespace core {
+
+    // Recycled memory for asio completion handlers of one socket. Every asynchronous
+    // operation needs storage for its handler until completion; blocks freed by completed
+    // operations are reused by next ones, so in steady state no operation hits the heap.
+    // Operations are mostly started and completed on io thread, the lock is uncontended
+    // then; handlers share ownership of arena, as aborted operations may be destroyed by
+    // io_service after their socket is gone.
+    class HandlerArena : private boost::noncopyable
+    {
+    public:
+
+        // big enough for any socket operation with its bound handler
+        static const size_t cBlockSize = 512;
+
+        HandlerArena() : m_heapAllocations(0) {}
+
+        ~HandlerArena()
+        {
+            for (void* block : m_free)
+                ::operator delete(block);
+        }
+
+        void* allocate(size_t size)
+        {
+            FastSpinLock::Guard guard(m_lock);
+            if (size <= cBlockSize && !m_free.empty())
+            {
+                void* block = m_free.back();
+                m_free.pop_back();
+                return block;
+            }
+
+            ++m_heapAllocations;
+            return ::operator new(size <= cBlockSize ? cBlockSize : size);
+        }
+
+        void deallocate(void* ptr, size_t size)
+        {
+            if (size <= cBlockSize)
+            {
+                FastSpinLock::Guard guard(m_lock);
+                m_free.push_back(ptr);
+            }
+            else
+            {
+                ::operator delete(ptr);
+            }
+        }
+
+        // blocks taken from the heap so far, stops growing once arena is warmed up
+        uint64_t heapAllocations() const { return m_heapAllocations; }
+
+    private:
+
+        FastSpinLock m_lock;
+        std::vector<void*> m_free;
+        uint64_t m_heapAllocations;
+    };
+
+    typedef std::shared_ptr<HandlerArena> HandlerArenaPtr;
+
+
+    // std-compatible allocator on top of HandlerArena, newer asio takes it from handler
+    template <class T>
+    class ArenaAllocator
+    {
+    public:
+
+        typedef T value_type;
+
+        template <class U>
+        struct rebind { typedef ArenaAllocator<U> other; };
+
+        explicit ArenaAllocator(HandlerArena& arena) : m_arena(&arena) {}
+
+        template <class U>
+        ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.arena()) {}
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(m_arena->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n)
+        {
+            m_arena->deallocate(ptr, n * sizeof(T));
+        }
+
+        HandlerArena* arena() const { return m_arena; }
+
+    private:
+
+        HandlerArena* m_arena;
+    };
+
+    template <class T, class U>
+    inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() == b.arena(); }
+
+    template <class T, class U>
+    inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() != b.arena(); }
+
+
+    // completion handler whose operation storage comes from an arena; older asio finds
+    // the arena through allocation hooks, newer through allocator_type
+    template <class Handler>
+    class ArenaHandler
+    {
+    public:
+
+        typedef ArenaAllocator<void> allocator_type;
+
+        ArenaHandler(const HandlerArenaPtr& arena, Handler handler)
+          : m_arena(arena),
+            m_handler(std::move(handler))
+        {}
+
+        allocator_type get_allocator() const { return allocator_type(*m_arena); }
+
+        template <class... Args>
+        void operator()(Args&&... args)
+        {
+            m_handler(std::forward<Args>(args)...);
+        }
+
+        friend void* asio_handler_allocate(size_t size, ArenaHandler* self)
+        {
+            return self->m_arena->allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void* ptr, size_t size, ArenaHandler* self)
+        {
+            self->m_arena->deallocate(ptr, size);
+        }
+
+    private:
+
+        HandlerArenaPtr m_arena;
+        Handler m_handler;
+    };
+
+
+    template <class Handler>
+    inline ArenaHandler<Handler> makeArenaHandler(const HandlerArenaPtr& arena, Handler handler)
+    {
+        return ArenaHandler<Handler>(arena, std::move(handler));
+    }
+
+}
@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "core/handshake.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+
+
+namespace core {
+
+    PacketPtr makeControlPacket(uint16_t protocol, uint64_t token, uint32_t connId)
+    {
+        PacketPtr packet = makePacket(protocol);
+        packet->header().connId = connId;
+
+        PacketBytes& bytes = packet->buffer();
+        bytes.resize(cControlPacketSize);
+        std::memcpy(bytes.data() + sizeof(PacketHeader), &token, sizeof(token));
+        return packet;
+    }
+
+
+    uint64_t controlToken(const Packet& packet)
+    {
+        uint64_t token = 0;
+        if (packet.payloadSize() >= sizeof(token))
+            packet.copyPayload(0, &token, sizeof(token));
+        return token;
+    }
+
+
+    PacketPtr makeRebindPacket(uint64_t token, uint64_t cookie, uint32_t connId)
+    {
+        PacketPtr packet = makeControlPacket(cProtoRebind, token, connId);
+
+        PacketBytes& bytes = packet->buffer();
+        bytes.resize(sizeof(PacketHeader) + sizeof(token) + sizeof(cookie));
+        std::memcpy(bytes.data() + sizeof(PacketHeader) + sizeof(token), &cookie, sizeof(cookie));
+        return packet;
+    }
+
+
+    uint64_t rebindCookie(const Packet& packet)
+    {
+        uint64_t cookie = 0;
+        if (packet.payloadSize() >= 2 * sizeof(cookie))
+            packet.copyPayload(sizeof(cookie), &cookie, sizeof(cookie));
+        return cookie;
+    }
+
+
+    namespace {
+
+        inline uint64_t rotl(uint64_t x, int b)
+        {
+            return (x << b) | (x >> (64 - b));
+        }
+
+        inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+        {
+            v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+            v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+            v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+            v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+        }
+
+        inline uint64_t readLE64(const uint8_t* p)
+        {
+            uint64_t v = 0;
+            for (int i = 7; i >= 0; --i)
+                v = (v << 8) | p[i];
+            return v;
+        }
+    }
+
+
+    uint64_t sipHash24(const uint64_t key[2], const void* data, size_t len)
+    {
+        uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+        uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+        uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+        uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+        const uint8_t* in = static_cast<const uint8_t*>(data);
+        const uint8_t* end = in + (len & ~size_t(7));
+        for (; in != end; in += 8)
+        {
+            uint64_t m = readLE64(in);
+            v3 ^= m;
+            sipRound(v0, v1, v2, v3);
+            sipRound(v0, v1, v2, v3);
+            v0 ^= m;
+        }
+
+        // last block: remaining bytes and message length in the top byte
+        uint64_t b = uint64_t(len) << 56;
+        for (size_t i = 0; i < (len & 7); ++i)
+            b |= uint64_t(in[i]) << (8 * i);
+
+        v3 ^= b;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= b;
+
+        v2 ^= 0xff;
+        for (int i = 0; i < 4; ++i)
+            sipRound(v0, v1, v2, v3);
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+
+    CookieJar::CookieJar()
+    {
+        std::random_device random;
+        for (uint64_t& key : m_key)
+            key = (uint64_t(random()) << 32) ^ random();
+    }
+
+    CookieJar::CookieJar(uint64_t key0, uint64_t key1)
+    {
+        m_key[0] = key0;
+        m_key[1] = key1;
+    }
+
+    uint64_t CookieJar::make(const udp::endpoint& peer, const SCTimePoint& now) const
+    {
+        return make(peer, bucket(now));
+    }
+
+    bool CookieJar::check(const udp::endpoint& peer, uint64_t cookie, const SCTimePoint& now) const
+    {
+        const int64_t current = bucket(now);
+        return cookie == make(peer, current) || cookie == make(peer, current - 1);
+    }
+
+    uint64_t CookieJar::make(const udp::endpoint& peer, int64_t bucket) const
+    {
+        // address (v4 mapped into v6), port and bucket
+        uint8_t input[16 + 2 + 8];
+        const auto address = peer.address().is_v4()
+            ? boost::asio::ip::address_v6::v4_mapped(peer.address().to_v4()).to_bytes()
+            : peer.address().to_v6().to_bytes();
+        const uint16_t port = peer.port();
+
+        std::memcpy(input, address.data(), 16);
+        std::memcpy(input + 16, &port, sizeof(port));
+        std::memcpy(input + 18, &bucket, sizeof(bucket));
+        return sipHash24(m_key, input, sizeof(input));
+    }
+
+    int64_t CookieJar::bucket(const SCTimePoint& now)
+    {
+        using namespace std::chrono;
+        return duration_cast<seconds>(now.time_since_epoch()).count() / cLifetimeSeconds;
+    }
+
+}
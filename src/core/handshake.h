@@ -0,0 +1,82 @@
+#pragma once
+#include "core/packet.h"
+#include "core/logger.h"
+#include <cstdint>
+
+
+namespace core {
+
+    // protocols from this number up are handled by socket itself and never reach
+    // listeners, their packets are not sequenced and not acknowledged
+    static const uint16_t cSystemProtocolBase = 0xFF00;
+
+    enum SystemProtocol : uint16_t
+    {
+        cProtoConnect = cSystemProtocolBase,    // client asks for connection
+        cProtoChallenge,                        // server answers with cookie, remembers nothing
+        cProtoConnectResponse,                  // client echoes cookie, server creates connection
+        cProtoAccept,                           // server confirms, connection is established
+        cProtoDisconnect,                       // either side leaves, state is freed at once
+        cProtoHeartbeat,                        // keepalive carrying only ack, for one-way or idle flows
+        cProtoRebindChallenge,                  // connection's id came from new address, cookie for that address
+        cProtoRebind                            // peer echoes cookie with connection's token, connection moves
+    };
+
+    inline bool isSystemProtocol(uint16_t protocol) { return protocol >= cSystemProtocolBase; }
+
+    // protocols just below system ones carry connection's own messages (fragments, bundles,
+    // probes): they are sequenced and acked like data, but listeners never see them
+    static const uint16_t cInternalProtocolBase = cSystemProtocolBase - 16;
+
+    inline bool isInternalProtocol(uint16_t protocol) { return protocol >= cInternalProtocolBase && protocol < cSystemProtocolBase; }
+
+    // application can't send under either kind, peer would take such packet for socket's own
+    inline bool isReservedProtocol(uint16_t protocol) { return isInternalProtocol(protocol) || isSystemProtocol(protocol); }
+
+    // system packet: header followed by 64-bit token (cookie of the handshake)
+    static const size_t cControlPacketSize = sizeof(PacketHeader) + sizeof(uint64_t);
+
+    PacketPtr makeControlPacket(uint16_t protocol, uint64_t token, uint32_t connId = 0);
+
+    // token of system packet, 0 if packet is too short to carry one
+    uint64_t controlToken(const Packet& packet);
+
+    // rebind packet: connection's token followed by cookie of rebind challenge
+    PacketPtr makeRebindPacket(uint64_t token, uint64_t cookie, uint32_t connId);
+
+    // cookie echoed by rebind packet, 0 if packet is too short to carry one
+    uint64_t rebindCookie(const Packet& packet);
+
+    // SipHash-2-4 of data under 128-bit key
+    uint64_t sipHash24(const uint64_t key[2], const void* data, size_t len);
+
+
+    // Handshake cookies, keyed hash of peer address and time bucket. Server recomputes
+    // cookie to check the echoed one, so it keeps nothing about peers that haven't
+    // proven they receive at their address. Cookie is valid for one to two lifetimes.
+    class CookieJar
+    {
+    public:
+
+        static const int64_t cLifetimeSeconds = 10;
+
+        // random secret, cookies of another socket or run never match
+        CookieJar();
+
+        CookieJar(uint64_t key0, uint64_t key1);
+
+        uint64_t make(const udp::endpoint& peer, const SCTimePoint& now) const;
+
+        // cookie was made for this peer in current or previous time bucket
+        bool check(const udp::endpoint& peer, uint64_t cookie, const SCTimePoint& now) const;
+
+    private:
+
+        uint64_t make(const udp::endpoint& peer, int64_t bucket) const;
+
+        static int64_t bucket(const SCTimePoint& now);
+
+        uint64_t m_key[2];
+    };
+
+}
@@ -10,7 +10,8 @@ namespace core {
     {
     public:
 
-        virtual const udp::endpoint& peer() const = 0;
+        // returned by value, address may change while application thread looks at it
+        virtual udp::endpoint peer() const = 0;
     };
 
 }
\ No newline at end of file
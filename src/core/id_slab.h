@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+
+namespace core {
+
+
+    // Values addressed by 31-bit ids: low bits index a contiguous slot array, high bits
+    // hold slot's generation, which changes whenever slot is freed, so a stale id never
+    // finds the next value placed into its slot. Id 0 is never given out. Not thread safe.
+    template <class Value>
+    class IdSlab
+    {
+    public:
+
+        static const uint32_t cIndexBits = 20;
+        static const uint32_t cMaxSize = 1u << cIndexBits;
+        static const uint32_t cGenerationMask = (1u << (31 - cIndexBits)) - 1;
+
+        // store value, return its id or 0 if slab is full
+        uint32_t add(const Value& value)
+        {
+            uint32_t index;
+            if (!m_free.empty())
+            {
+                index = m_free.back();
+                m_free.pop_back();
+            }
+            else if (m_slots.size() < cMaxSize)
+            {
+                index = static_cast<uint32_t>(m_slots.size());
+                m_slots.push_back(Slot());
+            }
+            else
+            {
+                return 0;
+            }
+
+            Slot& slot = m_slots[index];
+            slot.value = value;
+            slot.used = true;
+            return (slot.generation << cIndexBits) | index;
+        }
+
+        // value for id, or nullptr if id is stale or unknown
+        const Value* find(uint32_t id) const
+        {
+            const uint32_t index = id & (cMaxSize - 1);
+            if (index >= m_slots.size())
+                return nullptr;
+
+            const Slot& slot = m_slots[index];
+            if (!slot.used || slot.generation != id >> cIndexBits)
+                return nullptr;
+            return &slot.value;
+        }
+
+        void remove(uint32_t id)
+        {
+            const uint32_t index = id & (cMaxSize - 1);
+            if (!find(id))
+                return;
+
+            Slot& slot = m_slots[index];
+            slot.value = Value();
+            slot.used = false;
+
+            // generation 0 is skipped, so that ids are never 0
+            slot.generation = slot.generation == cGenerationMask ? 1 : slot.generation + 1;
+            m_free.push_back(index);
+        }
+
+        size_t size() const { return m_slots.size() - m_free.size(); }
+
+    private:
+
+        struct Slot
+        {
+            Slot() : value(), generation(1), used(false) {}
+
+            Value value;
+            uint32_t generation;
+            bool used;
+        };
+
+        std::vector<Slot> m_slots;
+        std::vector<uint32_t> m_free;
+    };
+
+
+}
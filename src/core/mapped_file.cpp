@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "core/mapped_file.h"
+#include "core/logger.h"
+#include <fstream>
+#include <limits>
+
+
+namespace core {
+
+    using namespace boost::interprocess;
+
+
+    MappedFile::MappedFile(const std::string& path, size_t size, boost::interprocess::mode_t mode)
+      : m_path(path),
+        m_size(size)
+    {
+        if (m_size == 0)
+            return;
+
+        m_file = file_mapping(path.c_str(), mode);
+        m_region = mapped_region(m_file, mode, 0, m_size);
+    }
+
+
+    MappedFile::Ptr MappedFile::openRead(const std::string& path)
+    {
+        const int64_t size = fileSize(path);
+        if (size < 0)
+        {
+            LogWarning() << "can't open" << path << "for reading";
+            return nullptr;
+        }
+        if (uint64_t(size) > std::numeric_limits<size_t>::max())
+        {
+            LogWarning() << "can't map" << path << "of" << size << "bytes at once";
+            return nullptr;
+        }
+
+        try
+        {
+            Ptr file(new MappedFile(path, size_t(size), read_only));
+
+            // fragments are taken front to back, kernel may read ahead and drop pages behind
+            if (file->m_size)
+                file->m_region.advise(mapped_region::advice_sequential);
+            return file;
+        }
+        catch (const interprocess_exception& e)
+        {
+            LogWarning() << "can't map" << path << ":" << e.what();
+            return nullptr;
+        }
+    }
+
+
+    MappedFile::Ptr MappedFile::openWrite(const std::string& path, uint64_t size)
+    {
+        if (size > std::numeric_limits<size_t>::max())
+        {
+            LogWarning() << "can't map" << path << "of" << size << "bytes at once";
+            return nullptr;
+        }
+
+        if (fileSize(path) != int64_t(size))
+        {
+            // sized by writing its last byte, file system allocates the rest as it's filled
+            std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+            if (size)
+            {
+                out.seekp(std::streamoff(size - 1));
+                out.put(0);
+            }
+            if (!out)
+            {
+                LogWarning() << "can't create" << path << "of" << size << "bytes";
+                return nullptr;
+            }
+        }
+
+        try
+        {
+            return Ptr(new MappedFile(path, size_t(size), read_write));
+        }
+        catch (const interprocess_exception& e)
+        {
+            LogWarning() << "can't map" << path << ":" << e.what();
+            return nullptr;
+        }
+    }
+
+
+    int64_t MappedFile::fileSize(const std::string& path)
+    {
+        std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+        return in ? int64_t(in.tellg()) : -1;
+    }
+
+
+    void MappedFile::flush()
+    {
+        if (m_size)
+            m_region.flush();
+    }
+
+}
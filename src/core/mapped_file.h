@@ -0,0 +1,49 @@
+#pragma once
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+namespace core {
+
+    // File mapped into memory as a whole. Packets slice their bodies right out of a read
+    // mapping, so file bytes go to the socket without being copied; a write mapping is
+    // preallocated to its final size and filled in any order. Empty file maps to nothing.
+    class MappedFile
+    {
+    public:
+
+        typedef std::shared_ptr<MappedFile> Ptr;
+
+        // nullptr if file can't be opened or mapped
+        static Ptr openRead(const std::string& path);
+
+        // existing file of this size keeps its bytes, otherwise it's created or resized
+        static Ptr openWrite(const std::string& path, uint64_t size);
+
+        // size of file, -1 if there is none
+        static int64_t fileSize(const std::string& path);
+
+        const uint8_t* data() const { return static_cast<const uint8_t*>(m_region.get_address()); }
+        uint8_t* data() { return static_cast<uint8_t*>(m_region.get_address()); }
+
+        size_t size() const { return m_size; }
+
+        const std::string& path() const { return m_path; }
+
+        // write dirty pages back to file
+        void flush();
+
+    private:
+
+        MappedFile(const std::string& path, size_t size, boost::interprocess::mode_t mode);
+
+        std::string m_path;
+        size_t m_size;
+        boost::interprocess::file_mapping m_file;
+        boost::interprocess::mapped_region m_region;
+    };
+
+}
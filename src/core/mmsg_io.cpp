@@ -0,0 +1,267 @@
+#include "stdafx.h"
+#include "core/mmsg_io.h"
+#include "core/logger.h"
+#include <boost/asio/error.hpp>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+
+namespace core {
+
+    // largest message kernel accepts or returns with segmentation offload
+    static const size_t cMaxCoalescedSize = 65507;
+
+    // max datagrams per offloaded message (UDP_MAX_SEGMENTS in kernel)
+    static const size_t cMaxSegments = 64;
+
+    // coalesced message smaller than this is copied out datagram by datagram, so a few
+    // datagrams don't pin a whole message buffer for as long as any of them lives
+    static const size_t cMinSharedMessage = cMaxCoalescedSize / 8;
+
+
+    static boost::system::error_code lastSystemError()
+    {
+        return boost::system::error_code(errno, boost::asio::error::get_system_category());
+    }
+
+
+    MMsgReceiver::MMsgReceiver(size_t batchSize, bool gro, size_t datagramSize)
+      : m_gro(gro),
+        m_datagramSize(datagramSize),
+        m_kernelDrops(0),
+        m_datagrams(batchSize),
+        m_truncated(batchSize),
+        m_headers(batchSize),
+        m_iovecs(batchSize),
+        m_addresses(batchSize),
+        m_controls(batchSize)
+    {
+        if (m_gro)
+            m_messages.resize(batchSize);
+    }
+
+    size_t MMsgReceiver::receive(int fd, boost::system::error_code& error)
+    {
+        size_t batchSize = m_headers.size();
+        for (size_t i = 0; i < batchSize; ++i)
+        {
+            const size_t room = m_gro ? cMaxCoalescedSize : m_datagramSize;
+            PacketPtr& packet = m_gro ? m_messages[i] : m_datagrams[i].packet;
+            if (!packet)
+                packet = makePacket(Packet::ReceiveTag(), room);
+            else
+                packet->buffer().resize(room);
+
+            m_iovecs[i].iov_base = packet->buffer().data();
+            m_iovecs[i].iov_len = packet->buffer().size();
+
+            msghdr& hdr = m_headers[i].msg_hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &m_addresses[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &m_iovecs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = m_controls[i].data;
+            hdr.msg_controllen = sizeof(ControlBuffer);
+        }
+
+        int count = ::recvmmsg(fd, m_headers.data(), static_cast<unsigned>(batchSize), MSG_DONTWAIT, nullptr);
+        if (count < 0)
+        {
+            error = lastSystemError();
+            return 0;
+        }
+
+        error.clear();
+        return m_gro ? receiveCoalesced(count) : receiveDirect(count);
+    }
+
+    size_t MMsgReceiver::receiveDirect(int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            Datagram& dgram = m_datagrams[i];
+            const msghdr& hdr = m_headers[i].msg_hdr;
+
+            dgram.packet->buffer().resize(std::min<size_t>(m_headers[i].msg_len, m_datagramSize));
+            std::memcpy(dgram.peer.data(), hdr.msg_name, hdr.msg_namelen);
+            dgram.peer.resize(hdr.msg_namelen);
+            m_truncated[i] = (hdr.msg_flags & MSG_TRUNC) != 0;
+
+            size_t segment = 0;
+            parseControl(hdr, segment);
+        }
+        return static_cast<size_t>(count);
+    }
+
+    size_t MMsgReceiver::receiveCoalesced(int count)
+    {
+        m_datagrams.clear();
+        m_truncated.clear();
+
+        for (int i = 0; i < count; ++i)
+        {
+            const msghdr& hdr = m_headers[i].msg_hdr;
+            size_t size = m_headers[i].msg_len;
+
+            // coalesced message comes with size of its segments, all but last are equal
+            size_t segment = size;
+            parseControl(hdr, segment);
+
+            udp::endpoint peer;
+            std::memcpy(peer.data(), hdr.msg_name, hdr.msg_namelen);
+            peer.resize(hdr.msg_namelen);
+
+            // message goes to its segments, the slot gets a new one on next receive
+            PacketPtr message = size >= cMinSharedMessage ? std::move(m_messages[i]) : nullptr;
+            const uint8_t* data = m_messages[i] ? m_messages[i]->buffer().data() : message->buffer().data();
+
+            for (size_t offset = 0; offset < size; offset += segment)
+            {
+                size_t len = std::min(segment, size - offset);
+                size_t kept = std::min(len, m_datagramSize);
+
+                PacketPtr packet;
+                if (message)
+                    packet = makePacket(Packet::SegmentTag(), message, offset, kept);
+                else
+                {
+                    packet = makePacket(Packet::ReceiveTag(), kept);
+                    std::memcpy(packet->buffer().data(), data + offset, kept);
+                }
+
+                m_datagrams.push_back(Datagram(packet, peer));
+                m_truncated.push_back(len > kept || (hdr.msg_flags & MSG_TRUNC) != 0);
+            }
+        }
+        return m_datagrams.size();
+    }
+
+
+    void MMsgReceiver::parseControl(const msghdr& hdr, size_t& segment)
+    {
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int gsoSize = 0;
+                std::memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+                if (gsoSize > 0)
+                    segment = gsoSize;
+            }
+            else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            {
+                std::memcpy(&m_kernelDrops, CMSG_DATA(cmsg), sizeof(m_kernelDrops));
+            }
+        }
+    }
+
+
+    MMsgSender::MMsgSender(size_t batchSize, bool gso)
+      : m_batchSize(batchSize),
+        m_gso(gso),
+        m_headers(batchSize),
+        m_iovecs(2 * batchSize * (gso ? cMaxSegments : 1)),
+        m_controls(batchSize),
+        m_segments(batchSize)
+    {
+    }
+
+    size_t MMsgSender::prepare(const DatagramQueue& queue)
+    {
+        size_t messages = 0;
+        size_t queued = 0;
+        iovec* iov = m_iovecs.data();
+
+        while (messages < m_batchSize && queued < queue.size())
+        {
+            const Datagram& first = queue[queued];
+            const size_t segment = first.packet->size();
+
+            msghdr& hdr = m_headers[messages].msg_hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = const_cast<void*>(static_cast<const void*>(first.peer.data()));
+            hdr.msg_namelen = static_cast<socklen_t>(first.peer.size());
+            hdr.msg_iov = iov;
+
+            size_t segments = 0;
+            size_t total = 0;
+            for (;;)
+            {
+                const Datagram& dgram = queue[queued];
+                for (auto& buf : dgram.packet->constBuffers())
+                {
+                    if (boost::asio::buffer_size(buf) == 0)
+                        continue;
+                    iov->iov_base = const_cast<void*>(boost::asio::buffer_cast<const void*>(buf));
+                    iov->iov_len = boost::asio::buffer_size(buf);
+                    ++iov;
+                    ++hdr.msg_iovlen;
+                }
+                total += dgram.packet->size();
+                ++segments;
+                ++queued;
+
+                // next datagram joins this message only if kernel can cut it at the same
+                // boundary: same peer, not bigger than segment, and only last may be smaller
+                if (!m_gso || queued == queue.size() || segments == cMaxSegments || dgram.packet->size() != segment)
+                    break;
+
+                const Datagram& next = queue[queued];
+                if (next.peer != first.peer || next.packet->size() > segment || total + next.packet->size() > cMaxCoalescedSize)
+                    break;
+            }
+
+            if (segments > 1)
+            {
+                hdr.msg_control = m_controls[messages].data;
+                hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                uint16_t gsoSize = static_cast<uint16_t>(segment);
+                std::memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+            }
+
+            m_segments[messages] = segments;
+            ++messages;
+        }
+        return messages;
+    }
+
+    size_t MMsgSender::send(int fd, const DatagramQueue& queue, boost::system::error_code& error)
+    {
+        size_t messages = prepare(queue);
+        int sent = ::sendmmsg(fd, m_headers.data(), static_cast<unsigned>(messages), MSG_DONTWAIT);
+
+        if (sent < 0 && m_gso && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            // device or path can't do segmentation offload, fall back to plain datagrams
+            LogWarning() << "udp segmentation offload failed:" << lastSystemError().message() << ", disabling it";
+            m_gso = false;
+            messages = prepare(queue);
+            sent = ::sendmmsg(fd, m_headers.data(), static_cast<unsigned>(messages), MSG_DONTWAIT);
+        }
+
+        if (sent < 0)
+        {
+            error = lastSystemError();
+            return 0;
+        }
+
+        error.clear();
+
+        size_t datagrams = 0;
+        for (int i = 0; i < sent; ++i)
+            datagrams += m_segments[i];
+        return datagrams;
+    }
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+#include "core/packet.h"
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <deque>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+
+namespace core {
+
+    // packet with its remote address, unit of batched i/o
+    struct Datagram
+    {
+        Datagram() {}
+        Datagram(const PacketPtr& p, const udp::endpoint& e) : packet(p), peer(e) {}
+
+        PacketPtr packet;
+        udp::endpoint peer;
+    };
+
+    typedef std::deque<Datagram> DatagramQueue;
+
+
+#ifdef __linux__
+
+    // properly aligned room for ancillary data of one message
+    union ControlBuffer
+    {
+        cmsghdr header;
+        char data[64];
+    };
+
+
+    // receives many datagrams with one recvmmsg call, straight into pooled packets;
+    // with generic receive offload kernel may coalesce several datagrams of one peer
+    // into one message, those are received into pooled message packets and handed out
+    // as segments that share message's buffer (see Packet::SegmentTag)
+    class MMsgReceiver : private boost::noncopyable
+    {
+    public:
+
+        // datagrams bigger than datagramSize are truncated
+        MMsgReceiver(size_t batchSize, bool gro, size_t datagramSize);
+
+        // receive up to batch size pending messages without blocking; returns number of
+        // received datagrams, zero and would_block error if there was nothing to receive
+        size_t receive(int fd, boost::system::error_code& error);
+
+        // received datagram, caller may take packet away, it is replaced on next receive
+        Datagram& datagram(size_t index) { return m_datagrams[index]; }
+
+        // datagram did not fit into packet buffer, packet holds only its beginning
+        bool truncated(size_t index) const { return m_truncated[index] != 0; }
+
+        // latest SO_RXQ_OVFL counter: datagrams dropped by kernel since socket was opened
+        uint32_t kernelDrops() const { return m_kernelDrops; }
+
+    private:
+
+        size_t receiveDirect(int count);
+        size_t receiveCoalesced(int count);
+
+        // pick drop counter and gro segment size out of message's ancillary data
+        void parseControl(const msghdr& hdr, size_t& segment);
+
+        bool m_gro;
+        size_t m_datagramSize;
+        uint32_t m_kernelDrops;
+        std::vector<Datagram> m_datagrams;
+        std::vector<char> m_truncated;
+
+        std::vector<mmsghdr> m_headers;
+        std::vector<iovec> m_iovecs;
+        std::vector<sockaddr_storage> m_addresses;
+        std::vector<ControlBuffer> m_controls;
+        std::vector<PacketPtr> m_messages;   // coalesced messages, gro only
+    };
+
+
+    // sends many queued datagrams with one sendmmsg call, using scatter/gather per packet;
+    // with segmentation offload consecutive same-sized datagrams to one peer are handed
+    // to kernel as one message (UDP_SEGMENT) and split into wire datagrams there
+    class MMsgSender : private boost::noncopyable
+    {
+    public:
+
+        MMsgSender(size_t batchSize, bool gso);
+
+        // send up to batch size messages from the front of the queue without blocking;
+        // returns number of sent datagrams (they are not removed from the queue)
+        size_t send(int fd, const DatagramQueue& queue, boost::system::error_code& error);
+
+    private:
+
+        // fill headers for messages starting at the front of the queue, returns message count
+        size_t prepare(const DatagramQueue& queue);
+
+        size_t m_batchSize;
+        bool m_gso;
+        std::vector<mmsghdr> m_headers;
+        std::vector<iovec> m_iovecs;
+        std::vector<ControlBuffer> m_controls;
+        std::vector<size_t> m_segments;      // datagrams per message
+    };
+
+#endif
+
+}
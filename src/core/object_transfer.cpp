@@ -0,0 +1,622 @@
+#include "stdafx.h"
+#include "core/object_transfer.h"
+#include "core/logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+
+namespace core {
+
+    using namespace std::chrono;
+
+    // ids of completed incoming objects remembered, so late duplicates don't start them again
+    static const size_t cCompletedMemory = 64;
+
+    namespace {
+
+        // head of file.part, fragment bitmap follows
+        const uint64_t cRecordMagic = 0x7472617074656e2eULL;
+
+#pragma pack (push, 1)
+        struct ResumeRecord
+        {
+            uint64_t magic;
+            uint64_t fileKey;
+            uint64_t totalSize;
+            uint16_t fragmentPayload;
+        };
+
+        // body of packet listener gets for received file, name and path follow
+        struct FileReportHeader
+        {
+            uint64_t size;
+            uint64_t resumedBytes;
+            int64_t elapsed;
+            uint16_t nameLength;
+        };
+#pragma pack (pop)
+
+        inline bool testBit(const uint8_t* bits, size_t i) { return (bits[i >> 3] >> (i & 7)) & 1; }
+        inline void setBit(uint8_t* bits, size_t i) { bits[i >> 3] |= uint8_t(1 << (i & 7)); }
+
+        inline bool isValidFragmentPayload(size_t payload) { return payload >= cFragmentPayload && payload <= cMaxFragmentPayload; }
+
+        inline uint32_t fragmentCount(uint64_t size, size_t payload)
+        {
+            return static_cast<uint32_t>(std::max<uint64_t>(1, (size + payload - 1) / payload));
+        }
+
+        inline size_t fragmentBytes(uint64_t size, uint32_t index, size_t payload)
+        {
+            return size_t(std::min<uint64_t>(payload, size - uint64_t(index) * payload));
+        }
+
+        inline uint64_t recordSize(uint32_t count) { return sizeof(ResumeRecord) + (count + 7) / 8; }
+
+        // version of file: its size and samples spread over content. Hashing all of it would
+        // read the whole file before the first fragment; new versions of assets are written
+        // whole, so they differ in samples too
+        uint64_t fileKey(const MappedFile& file)
+        {
+            static const uint64_t cKey[2] = { 0x6e65746261736531ULL, 0x66696c656b657931ULL };
+            static const size_t cSamples = 64;
+            static const size_t cSampleBytes = 64;
+
+            const uint64_t size = file.size();
+            std::vector<uint8_t> input(sizeof(size));
+            std::memcpy(input.data(), &size, sizeof(size));
+
+            const size_t sampleBytes = std::min<size_t>(cSampleBytes, file.size());
+            for (size_t i = 0; i < cSamples && sampleBytes; ++i)
+            {
+                const size_t offset = size_t((size - sampleBytes) * i / (cSamples - 1));
+                input.insert(input.end(), file.data() + offset, file.data() + offset + sampleBytes);
+            }
+            return sipHash24(cKey, input.data(), input.size());
+        }
+    }
+
+
+    ObjectTransfer::ObjectTransfer(size_t reassemblyBudget, const std::string& fileDirectory, uint64_t maxFileSize)
+      : m_nextId(1),
+        m_lastServed(0),
+        m_inFlight(0),
+        m_unsentBytes(0),
+        m_fragmentPayload(cFragmentPayload),
+        m_budget(reassemblyBudget),
+        m_reserved(0),
+        m_fileDirectory(fileDirectory),
+        m_maxFileSize(std::min<uint64_t>(maxFileSize, std::numeric_limits<size_t>::max()))
+    {
+    }
+
+
+    uint32_t ObjectTransfer::start(uint16_t protocol, const ObjectSource& source, const CompletionHandler& onComplete)
+    {
+        Outgoing transfer;
+        transfer.protocol = protocol;
+        transfer.source = source;
+        transfer.fragmentPayload = m_fragmentPayload;
+        transfer.count = fragmentCount(source.size, transfer.fragmentPayload);
+        transfer.next = 0;
+        transfer.acked = 0;
+        transfer.onComplete = onComplete;
+        transfer.isFile = false;
+        transfer.offered = false;
+        transfer.answered = false;
+        transfer.fileKey = 0;
+
+        const uint32_t id = m_nextId++;
+        m_outgoing.insert(std::make_pair(id, transfer));
+        m_unsentBytes += source.size;
+        return id;
+    }
+
+
+    uint32_t ObjectTransfer::startFile(uint16_t protocol, const MappedFile::Ptr& file, const std::string& name, const FileCompletionHandler& onComplete)
+    {
+        const uint32_t id = start(protocol, ObjectSource(file, file->data(), file->size()), nullptr);
+
+        Outgoing& transfer = m_outgoing[id];
+        transfer.isFile = true;
+        transfer.name = name;
+        transfer.fileKey = fileKey(*file);
+        transfer.stats.name = name;
+        transfer.stats.size = file->size();
+        transfer.started = system_clock::now();
+        transfer.onFileComplete = onComplete;
+        return id;
+    }
+
+
+    void ObjectTransfer::setDatagramSize(size_t size)
+    {
+        m_fragmentPayload = std::max(cFragmentPayload, std::min(size - sizeof(PacketHeader) - sizeof(FragmentHeader), cMaxFragmentPayload));
+    }
+
+
+    bool ObjectTransfer::isValidFileName(const std::string& name)
+    {
+        if (name.empty() || name == "." || name == ".." || name.size() > cBaseDatagramSize - sizeof(PacketHeader) - sizeof(FileOfferHeader))
+            return false;
+        return name.find_first_of(std::string("/\\:\0", 4)) == std::string::npos;
+    }
+
+
+    bool ObjectTransfer::parseFileReport(const Packet& report, FileTransferStats& stats)
+    {
+        FileReportHeader header;
+        if (report.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+            return false;
+
+        std::string text(report.payloadSize() - sizeof(header), '\0');
+        report.copyPayload(sizeof(header), &text[0], text.size());
+        if (header.nameLength > text.size())
+            return false;
+
+        stats.name = text.substr(0, header.nameLength);
+        stats.path = text.substr(header.nameLength);
+        stats.size = header.size;
+        stats.resumedBytes = header.resumedBytes;
+        stats.elapsed = microseconds(header.elapsed);
+        stats.delivered = true;
+        return true;
+    }
+
+
+    // round robin starts after the transfer served last, so a big object doesn't hold
+    // small ones started after it
+    size_t ObjectTransfer::takeFragments(std::vector<PacketPtr>& out)
+    {
+        size_t taken = 0;
+
+        // offers are small and don't take window, receiver needs them to answer
+        for (auto& entry : m_outgoing)
+        {
+            if (entry.second.isFile && !entry.second.offered)
+            {
+                out.push_back(makeOffer(entry.first, entry.second));
+                entry.second.offered = true;
+                ++taken;
+            }
+        }
+
+        while (m_inFlight < cWindow)
+        {
+            auto it = m_outgoing.upper_bound(m_lastServed);
+            for (size_t tried = 0; tried < m_outgoing.size(); ++tried, ++it)
+            {
+                if (it == m_outgoing.end())
+                    it = m_outgoing.begin();
+                if (hasFragmentToSend(it->second))
+                    break;
+            }
+            if (m_outgoing.empty() || it == m_outgoing.end() || !hasFragmentToSend(it->second))
+                break;
+
+            Outgoing& transfer = it->second;
+            const size_t offset = size_t(transfer.next) * transfer.fragmentPayload;
+            const size_t bytes = std::min(transfer.fragmentPayload, transfer.source.size - offset);
+
+            PacketPtr fragment = makePacket(cProtoFragment, transfer.source.owner,
+                boost::asio::const_buffer(transfer.source.data + offset, bytes));
+
+            FragmentHeader header = { it->first, transfer.next, transfer.count, transfer.source.size, uint16_t(transfer.fragmentPayload), transfer.protocol };
+            PacketBytes& buffer = fragment->buffer();
+            buffer.resize(sizeof(PacketHeader) + sizeof(FragmentHeader));
+            std::memcpy(buffer.data() + sizeof(PacketHeader), &header, sizeof(header));
+
+            out.push_back(fragment);
+            ++transfer.next;
+            ++m_inFlight;
+            ++taken;
+            m_unsentBytes -= bytes;
+            m_lastServed = it->first;
+        }
+        return taken;
+    }
+
+
+    bool ObjectTransfer::hasFragmentToSend(Outgoing& transfer)
+    {
+        if (transfer.isFile && !transfer.answered)
+            return false;
+
+        while (transfer.next < transfer.skip.size() && transfer.skip[transfer.next])
+            ++transfer.next;
+        return transfer.next < transfer.count;
+    }
+
+
+    PacketPtr ObjectTransfer::makeOffer(uint32_t id, const Outgoing& transfer) const
+    {
+        PacketPtr offer = makePacket(cProtoFileOffer);
+        FileOfferHeader header = { id, transfer.source.size, transfer.fileKey, uint16_t(transfer.fragmentPayload), transfer.protocol };
+
+        PacketBytes& buffer = offer->buffer();
+        buffer.resize(sizeof(PacketHeader) + sizeof(header) + transfer.name.size());
+        std::memcpy(buffer.data() + sizeof(PacketHeader), &header, sizeof(header));
+        std::memcpy(buffer.data() + sizeof(PacketHeader) + sizeof(header), transfer.name.data(), transfer.name.size());
+        return offer;
+    }
+
+
+    void ObjectTransfer::handleAcked(const Packet& fragment)
+    {
+        FragmentHeader header;
+        if (!parse(fragment, header))
+            return;
+
+        auto it = m_outgoing.find(header.transferId);
+        if (it == m_outgoing.end())
+            return;
+
+        --m_inFlight;
+        Outgoing& transfer = it->second;
+        if (++transfer.acked < transfer.count)
+            return;
+
+        if (transfer.isFile)
+        {
+            completeFile(it, true);
+            return;
+        }
+
+        // answers to offers are ours, not application's objects
+        if (transfer.protocol != cProtoFileResume)
+        {
+            ++m_stats.objectsSent;
+            m_stats.bytesSent += transfer.source.size;
+        }
+
+        // handler may start another transfer, so it's called after this one is gone
+        CompletionHandler onComplete = std::move(transfer.onComplete);
+        m_outgoing.erase(it);
+        if (onComplete)
+            onComplete();
+    }
+
+
+    bool ObjectTransfer::canAccept(const Packet& fragment)
+    {
+        FragmentHeader header;
+        if (!parse(fragment, header) || m_incoming.count(header.transferId))
+            return true;
+        if (std::find(m_completed.begin(), m_completed.end(), header.transferId) != m_completed.end())
+            return true;
+
+        if (header.totalSize <= m_budget - m_reserved)
+            return true;
+
+        if (header.totalSize > m_budget)
+            LogWarning() << "object of" << header.totalSize << "bytes will never fit into reassembly budget of" << m_budget << "bytes";
+        ++m_stats.refusedFragments;
+        return false;
+    }
+
+
+    PacketPtr ObjectTransfer::receive(const Packet& fragment)
+    {
+        if (fragment.header().protocol == cProtoFileOffer)
+            return receiveOffer(fragment);
+
+        FragmentHeader header;
+        if (!parse(fragment, header))
+        {
+            LogWarning() << "malformed object fragment dropped";
+            return nullptr;
+        }
+
+        if (std::find(m_completed.begin(), m_completed.end(), header.transferId) != m_completed.end())
+            return nullptr;
+
+        auto it = m_incoming.find(header.transferId);
+        if (it == m_incoming.end())
+        {
+            // whole object is reserved at once, listener gets it as one packet
+            Incoming incoming;
+            incoming.object = makePacket(header.protocol);
+            incoming.object->buffer().resize(sizeof(PacketHeader) + size_t(header.totalSize));
+            incoming.fragmentPayload = header.fragmentPayload;
+            incoming.count = header.count;
+            incoming.received = 0;
+            incoming.have.resize(header.count);
+
+            it = m_incoming.insert(std::make_pair(header.transferId, std::move(incoming))).first;
+            m_reserved += size_t(header.totalSize);
+        }
+
+        Incoming& incoming = it->second;
+        if (incoming.count != header.count || incoming.fragmentPayload != header.fragmentPayload)
+            return nullptr;
+
+        const size_t payload = fragment.payloadSize() - sizeof(FragmentHeader);
+        const uint64_t offset = uint64_t(header.index) * incoming.fragmentPayload;
+
+        // file fragment goes to its place in sink, record notes it's there
+        if (incoming.sink)
+        {
+            uint8_t* bitmap = incoming.record->data() + sizeof(ResumeRecord);
+            if (header.totalSize != incoming.stats.size || testBit(bitmap, header.index))
+                return nullptr;
+            if (offset > incoming.sink->size() || payload > incoming.sink->size() - offset)
+                return nullptr;
+
+            fragment.copyPayload(sizeof(FragmentHeader), incoming.sink->data() + offset, payload);
+            setBit(bitmap, header.index);
+            return ++incoming.received < incoming.count ? nullptr : finishFile(it);
+        }
+
+        if (incoming.have[header.index])
+            return nullptr;
+        if (offset + payload > incoming.object->size() - sizeof(PacketHeader))
+            return nullptr;
+
+        fragment.copyPayload(sizeof(FragmentHeader), incoming.object->buffer().data() + sizeof(PacketHeader) + offset, payload);
+        incoming.have[header.index] = true;
+        if (++incoming.received < incoming.count)
+            return nullptr;
+
+        PacketPtr object = std::move(incoming.object);
+        const size_t size = object->size() - sizeof(PacketHeader);
+        m_reserved -= size;
+        m_incoming.erase(it);
+        rememberCompleted(header.transferId);
+
+        if (object->header().protocol == cProtoFileResume)
+        {
+            receiveResume(*object);
+            return nullptr;
+        }
+
+        ++m_stats.objectsReceived;
+        m_stats.bytesReceived += size;
+        return object;
+    }
+
+
+    // record of earlier attempt counts only if it's about the same version of file,
+    // otherwise the file is received from scratch in fragments of size sender offers
+    PacketPtr ObjectTransfer::receiveOffer(const Packet& offer)
+    {
+        FileOfferHeader header;
+        if (offer.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+        {
+            LogWarning() << "malformed file offer dropped";
+            return nullptr;
+        }
+
+        std::string name(offer.payloadSize() - sizeof(header), '\0');
+        offer.copyPayload(sizeof(header), &name[0], name.size());
+
+        if (m_incoming.count(header.transferId) || std::find(m_completed.begin(), m_completed.end(), header.transferId) != m_completed.end())
+            return nullptr;
+
+        bool busy = false;
+        for (const auto& entry : m_incoming)
+            busy = busy || (entry.second.sink && entry.second.stats.name == name);
+
+        if (!isValidFragmentPayload(header.fragmentPayload))
+        {
+            LogWarning() << "file offer with fragments of" << header.fragmentPayload << "bytes dropped";
+            return nullptr;
+        }
+
+        Incoming incoming;
+        incoming.fragmentPayload = header.fragmentPayload;
+        incoming.received = 0;
+        incoming.protocol = header.protocol;
+        incoming.stats.name = name;
+        incoming.stats.path = m_fileDirectory + "/" + name;
+        incoming.stats.size = header.totalSize;
+        incoming.started = system_clock::now();
+
+        const std::string recordPath = incoming.stats.path + ".part";
+
+        bool resumed = false;
+        if (!m_fileDirectory.empty() && isValidFileName(name) && !busy && header.totalSize <= m_maxFileSize)
+        {
+            // record is read before its size is known to be right: that depends on its fragment size
+            const int64_t existing = MappedFile::fileSize(recordPath);
+            if (MappedFile::fileSize(incoming.stats.path) == int64_t(header.totalSize) && existing >= int64_t(sizeof(ResumeRecord)))
+            {
+                incoming.record = MappedFile::openWrite(recordPath, uint64_t(existing));
+                const ResumeRecord* record = incoming.record ? reinterpret_cast<const ResumeRecord*>(incoming.record->data()) : nullptr;
+                resumed = record && record->magic == cRecordMagic && record->fileKey == header.fileKey && record->totalSize == header.totalSize
+                    && isValidFragmentPayload(record->fragmentPayload)
+                    && existing == int64_t(recordSize(fragmentCount(header.totalSize, record->fragmentPayload)));
+                if (resumed)
+                    incoming.fragmentPayload = record->fragmentPayload;
+            }
+
+            incoming.count = fragmentCount(header.totalSize, incoming.fragmentPayload);
+            incoming.sink = MappedFile::openWrite(incoming.stats.path, header.totalSize);
+            if (!resumed)
+            {
+                incoming.record.reset();
+                incoming.record = MappedFile::openWrite(recordPath, recordSize(incoming.count));
+            }
+        }
+
+        if (!incoming.sink || !incoming.record)
+        {
+            LogWarning() << "file" << name << "of" << header.totalSize << "bytes refused";
+            ++m_stats.refusedFiles;
+            answerOffer(header.transferId, false, header.fragmentPayload, nullptr, 0);
+            return nullptr;
+        }
+
+        const size_t bitmapBytes = (incoming.count + 7) / 8;
+
+        uint8_t* bitmap = incoming.record->data() + sizeof(ResumeRecord);
+        if (resumed)
+        {
+            for (uint32_t i = 0; i < incoming.count; ++i)
+            {
+                if (testBit(bitmap, i))
+                {
+                    ++incoming.received;
+                    incoming.stats.resumedBytes += fragmentBytes(header.totalSize, i, incoming.fragmentPayload);
+                }
+            }
+            LogInfo() << "file" << name << "resumed with" << incoming.stats.resumedBytes << "of" << header.totalSize << "bytes";
+        }
+        else
+        {
+            ResumeRecord record = { cRecordMagic, header.fileKey, header.totalSize, uint16_t(incoming.fragmentPayload) };
+            std::memcpy(incoming.record->data(), &record, sizeof(record));
+            std::memset(bitmap, 0, bitmapBytes);
+        }
+
+        // fresh file needs no bitmap, peer sends everything
+        answerOffer(header.transferId, true, incoming.fragmentPayload, bitmap, incoming.received ? bitmapBytes : 0);
+
+        auto it = m_incoming.insert(std::make_pair(header.transferId, std::move(incoming))).first;
+        return it->second.received < it->second.count ? nullptr : finishFile(it);
+    }
+
+
+    void ObjectTransfer::answerOffer(uint32_t id, bool accepted, size_t fragmentPayload, const uint8_t* bitmap, size_t bitmapBytes)
+    {
+        auto answer = std::make_shared<std::vector<uint8_t>>(sizeof(FileResumeHeader) + bitmapBytes);
+        FileResumeHeader header = { id, uint8_t(accepted), uint16_t(fragmentPayload) };
+        std::memcpy(answer->data(), &header, sizeof(header));
+        if (bitmapBytes)
+            std::memcpy(answer->data() + sizeof(header), bitmap, bitmapBytes);
+
+        start(cProtoFileResume, ObjectSource(answer, answer->data(), answer->size()), nullptr);
+    }
+
+
+    void ObjectTransfer::receiveResume(const Packet& resume)
+    {
+        FileResumeHeader header;
+        if (resume.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+            return;
+
+        auto it = m_outgoing.find(header.transferId);
+        if (it == m_outgoing.end() || !it->second.isFile || it->second.answered)
+            return;
+
+        Outgoing& transfer = it->second;
+        transfer.answered = true;
+        if (!header.accepted)
+        {
+            LogWarning() << "peer refused file" << transfer.name;
+            m_unsentBytes -= transfer.source.size;
+            completeFile(it, false);
+            return;
+        }
+
+        // no fragment has gone yet, so they can still take size of receiver's earlier attempt
+        if (header.fragmentPayload != transfer.fragmentPayload && isValidFragmentPayload(header.fragmentPayload))
+        {
+            transfer.fragmentPayload = header.fragmentPayload;
+            transfer.count = fragmentCount(transfer.source.size, transfer.fragmentPayload);
+        }
+
+        // fragments peer has count as acked and are never taken
+        std::vector<uint8_t> bitmap(resume.payloadSize() - sizeof(header));
+        if (bitmap.size() == (transfer.count + 7) / 8)
+        {
+            resume.copyPayload(sizeof(header), bitmap.data(), bitmap.size());
+            transfer.skip.resize(transfer.count);
+            for (uint32_t i = 0; i < transfer.count; ++i)
+            {
+                if (testBit(bitmap.data(), i))
+                {
+                    transfer.skip[i] = true;
+                    ++transfer.acked;
+                    transfer.stats.resumedBytes += fragmentBytes(transfer.source.size, i, transfer.fragmentPayload);
+                }
+            }
+            m_unsentBytes -= transfer.stats.resumedBytes;
+        }
+
+        if (transfer.acked == transfer.count)
+            completeFile(it, true);
+    }
+
+
+    void ObjectTransfer::completeFile(std::map<uint32_t, Outgoing>::iterator it, bool delivered)
+    {
+        Outgoing& transfer = it->second;
+        FileTransferStats stats = transfer.stats;
+        stats.delivered = delivered;
+        stats.elapsed = duration_cast<microseconds>(system_clock::now() - transfer.started);
+
+        if (delivered)
+        {
+            ++m_stats.filesSent;
+            LogInfo() << "file" << stats.name << "sent," << stats.size - stats.resumedBytes << "of" << stats.size << "bytes in"
+                      << stats.elapsed << "," << stats.throughput() / 1e6 << "MB/s";
+        }
+
+        // handler may start another transfer, so it's called after this one is gone
+        FileCompletionHandler onComplete = std::move(transfer.onFileComplete);
+        m_outgoing.erase(it);
+        if (onComplete)
+            onComplete(stats);
+    }
+
+
+    PacketPtr ObjectTransfer::finishFile(std::map<uint32_t, Incoming>::iterator it)
+    {
+        Incoming& incoming = it->second;
+        FileTransferStats& stats = incoming.stats;
+        stats.delivered = true;
+        stats.elapsed = duration_cast<microseconds>(system_clock::now() - incoming.started);
+        ++m_stats.filesReceived;
+        LogInfo() << "file" << stats.path << "received," << stats.size - stats.resumedBytes << "of" << stats.size << "bytes in"
+                  << stats.elapsed << "," << stats.throughput() / 1e6 << "MB/s";
+
+        // file is whole, its record goes once it's unmapped
+        const std::string recordPath = incoming.record->path();
+        incoming.sink->flush();
+        incoming.sink.reset();
+        incoming.record.reset();
+        std::remove(recordPath.c_str());
+
+        PacketPtr report = makePacket(incoming.protocol);
+        FileReportHeader header = { stats.size, stats.resumedBytes, stats.elapsed.count(), uint16_t(stats.name.size()) };
+        PacketBytes& buffer = report->buffer();
+        buffer.resize(sizeof(PacketHeader) + sizeof(header) + stats.name.size() + stats.path.size());
+        uint8_t* out = buffer.data() + sizeof(PacketHeader);
+        std::memcpy(out, &header, sizeof(header));
+        std::memcpy(out + sizeof(header), stats.name.data(), stats.name.size());
+        std::memcpy(out + sizeof(header) + stats.name.size(), stats.path.data(), stats.path.size());
+
+        rememberCompleted(it->first);
+        m_incoming.erase(it);
+        return report;
+    }
+
+
+    void ObjectTransfer::rememberCompleted(uint32_t id)
+    {
+        m_completed.push_back(id);
+        if (m_completed.size() > cCompletedMemory)
+            m_completed.pop_front();
+    }
+
+
+    // fragment must carry exactly its share of the object
+    bool ObjectTransfer::parse(const Packet& fragment, FragmentHeader& header)
+    {
+        if (fragment.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+            return false;
+        if (!isValidFragmentPayload(header.fragmentPayload))
+            return false;
+
+        const uint64_t payload = header.fragmentPayload;
+        const uint64_t count = std::max<uint64_t>(1, (header.totalSize + payload - 1) / payload);
+        if (header.count != count || header.index >= header.count)
+            return false;
+
+        const uint64_t offset = uint64_t(header.index) * payload;
+        const uint64_t expected = std::min<uint64_t>(payload, header.totalSize - offset);
+        return fragment.size() == sizeof(PacketHeader) + sizeof(FragmentHeader) + expected;
+    }
+
+}
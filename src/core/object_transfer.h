@@ -0,0 +1,261 @@
+#pragma once
+#include "core/packet.h"
+#include "core/handshake.h"
+#include "core/mapped_file.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace core {
+
+    // fragments of big objects travel under this protocol on reliable-unordered channel
+    // as bulk traffic; listeners never see them, they get the whole object under its own protocol
+    static const uint16_t cProtoFragment = cSystemProtocolBase - 1;
+
+    // file transfer starts with sender's offer, receiver answers with fragments it already
+    // has from earlier attempts (as an object, bitmap may not fit into datagram)
+    static const uint16_t cProtoFileOffer = cSystemProtocolBase - 2;
+    static const uint16_t cProtoFileResume = cSystemProtocolBase - 3;
+
+    inline bool isTransferProtocol(uint16_t protocol) { return protocol >= cProtoFileResume && protocol <= cProtoFragment; }
+
+#pragma pack (push, 1)
+    struct FragmentHeader
+    {
+        uint32_t transferId;
+        uint32_t index;
+        uint32_t count;
+        uint64_t totalSize;
+        uint16_t fragmentPayload;   // object bytes per fragment, the same for whole transfer
+        uint16_t protocol;          // protocol the object is delivered under
+    };
+
+    struct FileOfferHeader
+    {
+        uint32_t transferId;
+        uint64_t totalSize;
+        uint64_t fileKey;           // tells versions of file apart, resume only continues the same one
+        uint16_t fragmentPayload;   // sender's, receiver may answer with that of earlier attempt
+        uint16_t protocol;          // followed by file name
+    };
+
+    struct FileResumeHeader
+    {
+        uint32_t transferId;
+        uint8_t accepted;
+        uint16_t fragmentPayload;   // followed by bitmap of fragments receiver has, none if it has nothing
+    };
+#pragma pack (pop)
+
+    // object bytes carried by fragment of base datagram size, and of the biggest one (last
+    // fragment may carry less); transfer takes size of connection's datagram when it starts
+    static const size_t cFragmentPayload = cBaseDatagramSize - sizeof(PacketHeader) - sizeof(FragmentHeader);
+    static const size_t cMaxFragmentPayload = cMaxDatagramSize - sizeof(PacketHeader) - sizeof(FragmentHeader);
+
+
+    // memory of object being sent, owner keeps it alive until transfer completes
+    struct ObjectSource
+    {
+        ObjectSource() : data(nullptr), size(0) {}
+        ObjectSource(const std::shared_ptr<const void>& o, const uint8_t* d, size_t s) : owner(o), data(d), size(s) {}
+
+        std::shared_ptr<const void> owner;
+        const uint8_t* data;
+        size_t size;
+    };
+
+
+    // one file transfer, sender gets it on completion, receiver's listener in place of file
+    struct FileTransferStats
+    {
+        FileTransferStats() : size(0), resumedBytes(0), elapsed(0), delivered(false) {}
+
+        std::string name;
+        std::string path;                       // receiver only: where file is stored
+        uint64_t size;
+        uint64_t resumedBytes;                  // receiver had them from earlier attempt
+        std::chrono::microseconds elapsed;      // from offer to last fragment
+        bool delivered;                         // receiver has the whole file
+
+        // bytes per second that crossed the network
+        double throughput() const { return elapsed.count() > 0 ? (size - resumedBytes) * 1e6 / elapsed.count() : 0; }
+    };
+
+
+    struct TransferStats
+    {
+        TransferStats()
+          : objectsSent(0), objectsReceived(0), bytesSent(0), bytesReceived(0), refusedFragments(0),
+            filesSent(0), filesReceived(0), refusedFiles(0) {}
+
+        // objects fully acked by peer, and fully reassembled from peer's fragments
+        uint64_t objectsSent;
+        uint64_t objectsReceived;
+        uint64_t bytesSent;
+        uint64_t bytesReceived;
+
+        // fragments of new objects left unacked because reassembly budget was taken
+        uint64_t refusedFragments;
+
+        // files are counted apart from objects, their bytes are in FileTransferStats
+        uint64_t filesSent;
+        uint64_t filesReceived;
+        uint64_t refusedFiles;
+    };
+
+
+    // Fragmentation and reassembly of objects bigger than a datagram, both directions
+    // of one connection. Sender keeps at most cWindow fragments in flight across all its
+    // transfers, taking turns between them; connection resends lost fragments like any
+    // reliable packet and reports acked ones back, which slides the window. Receiver
+    // reserves whole object on its first fragment, within budget; fragments of objects
+    // that don't fit are refused and come again when earlier objects are done. Fragments
+    // of a transfer are all of the datagram size it started with; when path's size falls
+    // below it later, connection slices them.
+    //
+    // Files go the same way, fragments sliced from read mapping of source file, but
+    // receiver writes them straight into mapped file of final size instead of memory.
+    // Next to it, file.part records which fragments are there; when the same file is
+    // offered again, say after reconnect, receiver answers with that record and sender
+    // skips what it has; fragment size of earlier attempt holds, so the record stays
+    // valid whatever datagram size the new connection has. Listener of file's protocol
+    // gets FileTransferStats packet (see parseFileReport) once the file is complete.
+    class ObjectTransfer
+    {
+    public:
+
+        // io thread calls it when peer has every fragment
+        typedef std::function<void()> CompletionHandler;
+        typedef std::function<void(const FileTransferStats&)> FileCompletionHandler;
+
+        static const size_t cWindow = 256;
+
+        // incoming files go into fileDirectory, they are refused without it or when bigger than maxFileSize
+        explicit ObjectTransfer(size_t reassemblyBudget, const std::string& fileDirectory = std::string(),
+                                uint64_t maxFileSize = std::numeric_limits<size_t>::max());
+
+        // [io-thread] start sending object under given protocol, return its transfer id
+        uint32_t start(uint16_t protocol, const ObjectSource& source, const CompletionHandler& onComplete);
+
+        // [io-thread] offer file under given name, fragments follow when receiver answers
+        uint32_t startFile(uint16_t protocol, const MappedFile::Ptr& file, const std::string& name, const FileCompletionHandler& onComplete);
+
+        // [io-thread] transfers started from now on fill datagrams of this size
+        void setDatagramSize(size_t size);
+
+        // plain name that fits into offer, no directories
+        static bool isValidFileName(const std::string& name);
+
+        // receiver's report of completed file, false if packet isn't one
+        static bool parseFileReport(const Packet& report, FileTransferStats& stats);
+
+        // [io-thread] new fragments as window allows, one of every transfer in turn,
+        // preceded by offers of new files
+        size_t takeFragments(std::vector<PacketPtr>& out);
+
+        // [io-thread] peer acked our fragment, completes its transfer with the last one
+        void handleAcked(const Packet& fragment);
+
+        // [io-thread] bytes of started objects not yet taken as fragments
+        uint64_t unsentBytes() const { return m_unsentBytes; }
+
+        // [io-thread] receiver has room for fragment: its object is known or fits into budget
+        bool canAccept(const Packet& fragment);
+
+        // [io-thread] place fragment, return the whole object once its last fragment arrives,
+        // or report of the file; offers and answers to them are handled inside
+        PacketPtr receive(const Packet& fragment);
+
+        // bytes reserved for objects being reassembled
+        size_t reassemblyBytes() const { return m_reserved; }
+
+        const TransferStats& stats() const { return m_stats; }
+
+    private:
+
+        struct Outgoing
+        {
+            uint16_t protocol;
+            ObjectSource source;
+            size_t fragmentPayload;
+            uint32_t count;
+            uint32_t next;
+            uint32_t acked;
+            CompletionHandler onComplete;
+
+            // file: fragments wait for answer to offer, those receiver has are skipped
+            bool isFile;
+            bool offered;
+            bool answered;
+            std::string name;
+            uint64_t fileKey;
+            std::vector<bool> skip;
+            FileTransferStats stats;
+            SCTimePoint started;
+            FileCompletionHandler onFileComplete;
+        };
+
+        struct Incoming
+        {
+            PacketPtr object;
+            size_t fragmentPayload;
+            uint32_t count;
+            uint32_t received;
+            std::vector<bool> have;
+
+            // file: fragments go into sink, record keeps their bitmap instead of have
+            MappedFile::Ptr sink;
+            MappedFile::Ptr record;
+            uint16_t protocol;
+            FileTransferStats stats;
+            SCTimePoint started;
+        };
+
+        // read fragment header, false if fragment is malformed
+        static bool parse(const Packet& fragment, FragmentHeader& header);
+
+        // transfer has fragment to take now, next is moved past skipped ones
+        static bool hasFragmentToSend(Outgoing& transfer);
+
+        PacketPtr makeOffer(uint32_t id, const Outgoing& transfer) const;
+
+        // receiver: open sink and its record, answer with fragments we have
+        PacketPtr receiveOffer(const Packet& offer);
+
+        // sender: skip what receiver has, or give up if it refused
+        void receiveResume(const Packet& resume);
+
+        void answerOffer(uint32_t id, bool accepted, size_t fragmentPayload, const uint8_t* bitmap, size_t bitmapBytes);
+
+        void completeFile(std::map<uint32_t, Outgoing>::iterator it, bool delivered);
+
+        // receiver: close sink and drop its record, return report for listener
+        PacketPtr finishFile(std::map<uint32_t, Incoming>::iterator it);
+
+        void rememberCompleted(uint32_t id);
+
+        // sending side
+        std::map<uint32_t, Outgoing> m_outgoing;
+        uint32_t m_nextId;
+        uint32_t m_lastServed;
+        size_t m_inFlight;
+        uint64_t m_unsentBytes;
+        size_t m_fragmentPayload;
+
+        // receiving side
+        std::map<uint32_t, Incoming> m_incoming;
+        std::deque<uint32_t> m_completed;
+        size_t m_budget;
+        size_t m_reserved;
+        std::string m_fileDirectory;
+        uint64_t m_maxFileSize;
+
+        TransferStats m_stats;
+    };
+
+}
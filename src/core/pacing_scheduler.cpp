@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "core/pacing_scheduler.h"
+#include "core/connection.h"
+#include <boost/bind.hpp>
+#include <algorithm>
+
+
+namespace core {
+
+    using namespace std::chrono;
+
+    // socket as a whole may send this much back-to-back
+    static const size_t cSocketBurstBytes = 16 * cBaseDatagramSize;
+
+    // at most this many datagrams per run, then io thread gets to receives
+    static const size_t cMaxRunDatagrams = 256;
+
+
+    Pacer::Pacer(size_t burstBytes)
+      : m_rate(0),
+        m_tokens(double(burstBytes)),
+        m_burst(double(burstBytes)),
+        m_lastRefill(system_clock::now())
+    {
+    }
+
+    void Pacer::setRate(double rate)
+    {
+        m_rate = rate;
+    }
+
+    void Pacer::refill(const SCTimePoint& now)
+    {
+        if (now > m_lastRefill)
+        {
+            const double elapsed = duration<double>(now - m_lastRefill).count();
+            m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+        }
+        m_lastRefill = now;
+    }
+
+    SCTimePoint Pacer::readyTime(size_t bytes, const SCTimePoint& now) const
+    {
+        const double missing = std::min(double(bytes), m_burst) - m_tokens;
+        if (missing <= 0)
+            return now;
+        if (m_rate <= 0)
+            return SCTimePoint::max();
+        return now + duration_cast<SCTimePoint::duration>(duration<double>(missing / m_rate));
+    }
+
+
+    PacingScheduler::PacingScheduler(boost::asio::io_service& ioservice, const HandlerArenaPtr& arena)
+      : m_ioservice(ioservice),
+        m_arena(arena),
+        m_timer(ioservice),
+        m_pacer(cSocketBurstBytes),
+        m_runPosted(false),
+        m_timerArmed(false),
+        m_maxRunBurst(0)
+    {
+    }
+
+
+    // run is posted rather than called, so that connections flushed by the same batch of
+    // handlers (sendEveryone) are all active by then and get interleaved
+    void PacingScheduler::activate(const ConnectionPtr& conn)
+    {
+        if (conn->m_paceActive)
+            return;
+
+        conn->m_paceActive = true;
+        m_active.push_back(conn);
+
+        if (!m_runPosted)
+        {
+            m_runPosted = true;
+            m_ioservice.post(makeArenaHandler(m_arena, boost::bind(&PacingScheduler::run, this)));
+        }
+    }
+
+
+    void PacingScheduler::run()
+    {
+        m_runPosted = false;
+        const auto now = system_clock::now();
+
+        double rate = 0;
+        for (const ConnectionPtr& conn : m_active)
+            rate += conn->m_pacer.rate();
+        m_pacer.setRate(rate);
+        m_pacer.refill(now);
+
+        // connections that wait for their own pacer sit out the rest of the run
+        std::deque<ConnectionPtr> waiting;
+        SCTimePoint wakeTime = SCTimePoint::max();
+        size_t sent = 0;
+
+        while (!m_active.empty())
+        {
+            ConnectionPtr conn = std::move(m_active.front());
+            m_active.pop_front();
+
+            const size_t bytes = conn->pacedPacketSize(now);
+            if (bytes == 0 || conn->isDead())
+            {
+                // drained, or window is full and acks will activate it again
+                conn->m_paceActive = false;
+                continue;
+            }
+
+            conn->m_pacer.refill(now);
+            if (!conn->m_pacer.canSend(bytes))
+            {
+                wakeTime = std::min(wakeTime, conn->m_pacer.readyTime(bytes, now));
+                waiting.push_back(std::move(conn));
+                continue;
+            }
+
+            if (!m_pacer.canSend(bytes) || sent == cMaxRunDatagrams)
+            {
+                wakeTime = std::min(wakeTime, m_pacer.readyTime(bytes, now));
+                m_active.push_front(std::move(conn));
+                break;
+            }
+
+            m_pacer.consume(bytes);
+            conn->sendPacedPacket();
+            ++sent;
+
+            // one packet per turn, then to the back of the line
+            m_active.push_back(std::move(conn));
+        }
+
+        m_maxRunBurst = std::max(m_maxRunBurst, sent);
+
+        for (ConnectionPtr& conn : waiting)
+            m_active.push_back(std::move(conn));
+
+        if (!m_active.empty())
+            schedule(wakeTime, now);
+    }
+
+
+    void PacingScheduler::schedule(const SCTimePoint& wakeTime, const SCTimePoint& now)
+    {
+        if (m_timerArmed && m_wakeTime <= wakeTime)
+            return;
+
+        // wait time is taken relative to now, timer's clock needn't match system_clock
+        m_timerArmed = true;
+        m_wakeTime = wakeTime;
+        m_timer.expires_from_now(std::max(wakeTime - now, SCTimePoint::duration::zero()));
+        m_timer.async_wait(makeArenaHandler(m_arena,
+            boost::bind(&PacingScheduler::handleTimer, this, boost::asio::placeholders::error)));
+    }
+
+
+    void PacingScheduler::handleTimer(const boost::system::error_code& error)
+    {
+        // re-armed for an earlier moment, the new wait will run
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        m_timerArmed = false;
+        if (!m_runPosted)
+            run();
+    }
+
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "core/handler_arena.h"
+#include "core/logger.h"
+#include <boost/asio/high_resolution_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <algorithm>
+#include <deque>
+#include <memory>
+
+
+namespace core {
+
+    class Connection;
+    typedef std::shared_ptr<Connection> ConnectionPtr;
+
+
+    // Token bucket: bytes may go at given rate, with a small burst allowance
+    class Pacer
+    {
+    public:
+
+        explicit Pacer(size_t burstBytes);
+
+        // bytes per second
+        void setRate(double rate);
+        double rate() const { return m_rate; }
+
+        // tokens accumulated since last call, up to burst allowance
+        void refill(const SCTimePoint& now);
+
+        // packet bigger than burst allowance goes once bucket is full, leaving it in debt
+        bool canSend(size_t bytes) const { return m_tokens >= std::min(double(bytes), m_burst); }
+
+        // moment when enough tokens for bytes will be there
+        SCTimePoint readyTime(size_t bytes, const SCTimePoint& now) const;
+
+        void consume(size_t bytes) { m_tokens -= double(bytes); }
+
+    private:
+
+        double m_rate;
+        double m_tokens;
+        double m_burst;
+        SCTimePoint m_lastRefill;
+    };
+
+
+    // Socket-wide sender of paced packets. Connections with packets waiting are served
+    // round robin, one packet per turn, each within its own pacing rate and all together
+    // within the sum of their rates, so that many peers updated at once don't leave
+    // as one burst. Runs on io thread, from a posted handler or its timer.
+    class PacingScheduler : private boost::noncopyable
+    {
+    public:
+
+        PacingScheduler(boost::asio::io_service& ioservice, const HandlerArenaPtr& arena);
+
+        // [io-thread] connection has packets to pace, serve it until queue drains or window closes
+        void activate(const ConnectionPtr& conn);
+
+        // biggest number of datagrams sent back-to-back in one run
+        size_t maxRunBurst() const { return m_maxRunBurst; }
+
+    private:
+
+        // send whatever pacers allow, then sleep until next packet is due
+        void run();
+
+        void schedule(const SCTimePoint& wakeTime, const SCTimePoint& now);
+
+        void handleTimer(const boost::system::error_code& error);
+
+        boost::asio::io_service& m_ioservice;
+        HandlerArenaPtr m_arena;
+        boost::asio::high_resolution_timer m_timer;
+
+        // connections with packets waiting, in serving order
+        std::deque<ConnectionPtr> m_active;
+
+        // aggregate rate of all active connections
+        Pacer m_pacer;
+
+        bool m_runPosted;
+        bool m_timerArmed;
+        SCTimePoint m_wakeTime;
+        size_t m_maxRunBurst;
+    };
+
+}
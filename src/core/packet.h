@@ -1,7 +1,12 @@
 #pragma once
 #include "core/ack_utils.h"
+#include "core/packet_pool.h"
 #include <boost/asio/ip/udp.hpp>
+#include <boost/asio/buffer.hpp>
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
 
 using boost::asio::ip::udp;
 using std::chrono::system_clock;
@@ -9,10 +14,21 @@ using std::chrono::system_clock;
 
 namespace core {
 
-    static const size_t cMaxUdpPacketSize = 1024;
+    // every path is taken to carry datagrams of this size: connections start with it and
+    // fall back to it, bigger ones are used once path MTU discovery confirms them
+    static const size_t cBaseDatagramSize = 1024;
 
-    // 
-    typedef ack17_t ack_type;
+    // no datagram is ever bigger: jumbo frame less IP and UDP headers
+    static const size_t cMaxDatagramSize = 9000 - 28;
+
+    // every header acks the latest seqNum and 128 before it: at high packet rates a narrower
+    // window drops packets that were acked only in lost headers, and they get resent for nothing
+    typedef ack129_t ack_type;
+
+
+    // connection id is given by the side that accepted connection and tags its packets
+    // with this bit; the other side echoes id back without it, 0 means no id yet
+    static const uint32_t cConnIdAssigned = 0x80000000;
 
 
 #pragma pack (push, 1)
@@ -21,21 +37,44 @@ namespace core {
         uint16_t protocol;
         uint16_t seqNum;
         ack_type ack;
+
+        // see cConnIdAssigned; on the wire even when SocketOptions::connectionIds is off
+        // (then it's 0): header has one fixed layout that packets overlay in place, an
+        // optional field would shift every received payload to make room for it
+        uint32_t connId;
+
+        // delivery channel (see Channel) and message number within it, kept by resends
+        uint8_t channel;
+        uint16_t messageId;
     };
 #pragma pack (pop)
 
 
+    // wire bytes live in pooled memory
+    typedef std::vector<uint8_t, PoolAllocator<uint8_t>> PacketBytes;
+
+
     class Packet
     {
     public:
 
         explicit Packet(uint16_t protocol)
         {
-            m_buffer.reserve(cMaxUdpPacketSize);
-            m_buffer.resize(sizeof(PacketHeader));
+            m_buffer.reserve(cBaseDatagramSize);
+            m_buffer.resize(sizeof(PacketHeader), 0);
             header().protocol = protocol;
         }
 
+        // tag for packets that the socket receives into
+        struct ReceiveTag {};
+
+        // uninitialized room for datagram of up to given size, socket receives straight
+        // into it and shrinks buffer to received size afterwards, so no copy is ever made
+        Packet(ReceiveTag, size_t size)
+        {
+            m_buffer.resize(size);
+        }
+
         Packet(uint8_t* data, size_t len)
         {
             if (len < sizeof(PacketHeader))
@@ -43,12 +82,61 @@ namespace core {
             m_buffer.assign(data, data + len);
         }
 
+        // packet whose payload is a slice of memory kept alive by bodyOwner, it's sent after
+        // own bytes (header and whatever is appended to it) and never copied
+        Packet(uint16_t protocol, const std::shared_ptr<const void>& bodyOwner, const boost::asio::const_buffer& body)
+          : Packet(protocol)
+        {
+            m_bodyOwner = bodyOwner;
+            m_body = body;
+        }
+
+        // tag for packets that share payload of another packet
+        struct ShareTag {};
+
+        // copy of source packet, that has its own header but refers to the payload of
+        // source instead of copying it; source must not be modified afterwards
+        Packet(const std::shared_ptr<Packet>& source, ShareTag)
+        {
+            if (source->m_bodyOwner)
+            {
+                // own part of such packet is only headers, body is shared again
+                m_buffer = source->m_buffer;
+                m_bodyOwner = source->m_bodyOwner;
+                m_body = source->m_body;
+            }
+            else
+            {
+                const PacketBytes& src = source->m_buffer;
+                m_buffer.assign(src.begin(), src.begin() + sizeof(PacketHeader));
+                m_bodyOwner = source;
+                m_body = boost::asio::buffer(src.data() + sizeof(PacketHeader), src.size() - sizeof(PacketHeader));
+            }
+        }
+
+        // tag for datagrams that kernel delivered as parts of one coalesced message
+        struct SegmentTag {};
+
+        // datagram at offset of message packet: own bytes are only its header, payload
+        // refers to message's buffer, which must not be modified afterwards
+        Packet(SegmentTag, const std::shared_ptr<Packet>& message, size_t offset, size_t size)
+        {
+            const uint8_t* data = message->m_buffer.data() + offset;
+            const size_t own = std::min(size, sizeof(PacketHeader));
+            m_buffer.assign(data, data + own);
+            if (size > own)
+            {
+                m_bodyOwner = message;
+                m_body = boost::asio::buffer(data + own, size - own);
+            }
+        }
+
         const PacketHeader& header() const
         {
             return *reinterpret_cast<const PacketHeader*>(m_buffer.data());
         }
 
-        const std::vector<uint8_t>& buffer() const
+        const PacketBytes& buffer() const
         {
             return m_buffer;
         }
@@ -58,18 +146,72 @@ namespace core {
             return *reinterpret_cast<PacketHeader*>(m_buffer.data());
         }
 
-        std::vector<uint8_t>& buffer()
+        PacketBytes& buffer()
         {
             return m_buffer;
         }
 
+        // wire image as scatter/gather sequence: own bytes, then shared body (may be empty)
+        typedef std::array<boost::asio::const_buffer, 2> ConstBuffers;
+
+        ConstBuffers constBuffers() const
+        {
+            ConstBuffers rv = {{ boost::asio::buffer(m_buffer), m_body }};
+            return rv;
+        }
+
+        // size on the wire
+        size_t size() const
+        {
+            return m_buffer.size() + boost::asio::buffer_size(m_body);
+        }
+
+        size_t payloadSize() const
+        {
+            return size() > sizeof(PacketHeader) ? size() - sizeof(PacketHeader) : 0;
+        }
+
+        // copy payload bytes (those after header) starting at offset, wherever they are: own
+        // buffer, shared body, or both (see SegmentTag); returns number of copied bytes
+        size_t copyPayload(size_t offset, void* out, size_t size) const
+        {
+            size_t skip = sizeof(PacketHeader) + offset;
+            size_t copied = 0;
+            for (const auto& buf : constBuffers())
+            {
+                const size_t available = boost::asio::buffer_size(buf);
+                if (skip >= available)
+                {
+                    skip -= available;
+                    continue;
+                }
+                const size_t bytes = std::min(available - skip, size - copied);
+                std::memcpy(static_cast<uint8_t*>(out) + copied, boost::asio::buffer_cast<const uint8_t*>(buf) + skip, bytes);
+                copied += bytes;
+                skip = 0;
+            }
+            return copied;
+        }
+
     protected:
 
-        // everything that goes across the wire is stored here
-        std::vector<uint8_t> m_buffer;
+        // everything that goes across the wire is stored here, except shared body
+        PacketBytes m_buffer;
+
+        // payload that is shared with other packets (broadcasts), sent after m_buffer
+        std::shared_ptr<const void> m_bodyOwner;
+        boost::asio::const_buffer m_body;
     };
 
 
     typedef std::shared_ptr<Packet> PacketPtr;
 
+
+    // make packet with its control block in pooled memory, use it instead of std::make_shared
+    template <class... Args>
+    inline PacketPtr makePacket(Args&&... args)
+    {
+        return std::allocate_shared<Packet>(PoolAllocator<Packet>(), std::forward<Args>(args)...);
+    }
+
 }
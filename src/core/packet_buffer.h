@@ -68,6 +68,12 @@ namespace core {
             return get(seqNum).packet != nullptr;
         }
 
+        // packet stored under seqNum, meaningful only if buffer contains it
+        const PacketExt& at(uint16_t seqNum) const
+        {
+            return get(seqNum);
+        }
+
         bool empty() const
         {
             return m_tail == m_head;
@@ -104,47 +110,4 @@ namespace core {
         PacketExt m_buffer[N];
     };
 
-
-    template <size_t N>
-    class RecvPacketBuffer
-    {
-    public:
-        
-        RecvPacketBuffer() : m_head(0), m_tail(1) {}
-            
-        PacketPtr insert(uint16_t seqNum, const PacketPtr& value)
-        {
-            if (empty())
-                m_head = m_tail = seqNum;
-            else if (moreRecentSeqNum(seqNum, m_head))
-                m_head = seqNum;
-            else if (moreRecentSeqNum(m_tail, seqNum))
-                m_tail = seqNum;
-
-            return get(seqNum).exchange(value);
-        }
-
-        bool empty() const
-        {
-            return moreRecentSeqNum(m_tail, m_head);
-        }
-
-        PacketPtr removeLast()
-        {
-            uint16_t seqNum = m_tail.fetch_add(1);
-            return get(seqNum).exchange(nullptr);
-        }
-
-    private:
-
-        std::atomic<PacketPtr>& get(uint16_t seqNum)
-        {
-            return m_buffer[seqNum % N];
-        }
-
-        std::atomic<uint16_t> m_head; // most recent seqNum
-        std::atomic<uint16_t> m_tail; // oldest seqNum
-        std::atomic<PacketPtr> m_buffer[N];
-    };
-
 }
@@ -14,6 +14,9 @@ namespace core {
     {
     public:
         virtual ~IProtocolListener() {}
+
+        // packet's payload may be shared with other packets and not follow its header in
+        // buffer(), read it with Packet::copyPayload() or Packet::constBuffers()
         virtual void receive(const IConnection& conn, const PacketPtr& packet) = 0;
     };
 
@@ -0,0 +1,300 @@
+#include "stdafx.h"
+#include "core/packet_pool.h"
+#include "core/fast_spinlock.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+
+namespace core {
+
+    namespace {
+
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+
+        // chain of free blocks of one size class
+        struct FreeList
+        {
+            FreeList() : head(nullptr), count(0) {}
+
+            void push(FreeBlock* block)
+            {
+                block->next = head;
+                head = block;
+                ++count;
+            }
+
+            FreeBlock* pop()
+            {
+                FreeBlock* block = head;
+                head = block->next;
+                --count;
+                return block;
+            }
+
+            FreeBlock* head;
+            size_t count;
+        };
+
+
+        // counters of one thread: only that thread writes them, so increments are plain
+        // load and store; stats() reads them from any thread
+        struct ThreadCounters
+        {
+            ThreadCounters() : hits(0), misses(0), oversized(0) {}
+
+            static void increment(std::atomic<uint64_t>& counter)
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> oversized;
+        };
+
+
+        // counters of live threads, and totals of threads that are gone
+        class CounterRegistry
+        {
+        public:
+
+            static CounterRegistry& instance()
+            {
+                // never destroyed, for the same reason as depot
+                static CounterRegistry* registry = new CounterRegistry;
+                return *registry;
+            }
+
+            void add(const ThreadCounters* counters)
+            {
+                FastSpinLock::Guard guard(m_lock);
+                m_live.push_back(counters);
+            }
+
+            void remove(const ThreadCounters* counters)
+            {
+                FastSpinLock::Guard guard(m_lock);
+                m_live.erase(std::find(m_live.begin(), m_live.end(), counters));
+                m_finished.hits += counters->hits.load(std::memory_order_relaxed);
+                m_finished.misses += counters->misses.load(std::memory_order_relaxed);
+                m_finished.oversized += counters->oversized.load(std::memory_order_relaxed);
+            }
+
+            PacketPool::Stats sum()
+            {
+                FastSpinLock::Guard guard(m_lock);
+                PacketPool::Stats result = m_finished;
+                for (const ThreadCounters* counters : m_live)
+                {
+                    result.hits += counters->hits.load(std::memory_order_relaxed);
+                    result.misses += counters->misses.load(std::memory_order_relaxed);
+                    result.oversized += counters->oversized.load(std::memory_order_relaxed);
+                }
+                return result;
+            }
+
+        private:
+
+            CounterRegistry()
+            {
+                m_finished.hits = m_finished.misses = m_finished.oversized = 0;
+            }
+
+            FastSpinLock m_lock;
+            std::vector<const ThreadCounters*> m_live;
+            PacketPool::Stats m_finished;
+        };
+
+
+        // blocks cached by one thread
+        static const size_t cMaxThreadCache = 2 * PacketPool::cBatchSize;
+
+        // batches kept in depot per size class, surplus goes back to the heap
+        static const size_t cMaxDepotBatches = 256;
+
+
+        size_t classIndex(size_t size)
+        {
+            size_t index = 0;
+            size_t block = PacketPool::cMinBlockSize;
+            while (block < size)
+            {
+                block <<= 1;
+                ++index;
+            }
+            return index;
+        }
+
+        size_t classBlockSize(size_t index)
+        {
+            return PacketPool::cMinBlockSize << index;
+        }
+
+
+        // shared exchange point for batches of free blocks
+        class Depot
+        {
+        public:
+
+            static Depot& instance()
+            {
+                // never destroyed: thread caches may flush into it after static destruction started
+                static Depot* depot = new Depot;
+                return *depot;
+            }
+
+            bool take(size_t index, FreeList& result)
+            {
+                FastSpinLock::Guard guard(m_locks[index]);
+                auto& batches = m_batches[index];
+                if (batches.empty())
+                    return false;
+
+                result = batches.back();
+                batches.pop_back();
+                return true;
+            }
+
+            // returns false if depot is full, caller must free the blocks
+            bool give(size_t index, const FreeList& batch)
+            {
+                FastSpinLock::Guard guard(m_locks[index]);
+                auto& batches = m_batches[index];
+                if (batches.size() >= cMaxDepotBatches)
+                    return false;
+
+                batches.push_back(batch);
+                return true;
+            }
+
+        private:
+
+            Depot()
+            {
+                for (auto& batches : m_batches)
+                    batches.reserve(cMaxDepotBatches);
+            }
+
+            FastSpinLock m_locks[PacketPool::cClassCount];
+            std::vector<FreeList> m_batches[PacketPool::cClassCount];
+        };
+
+
+        void freeChain(FreeList& list)
+        {
+            while (list.head)
+                ::operator delete(list.pop());
+        }
+
+
+        class ThreadCache
+        {
+        public:
+
+            ThreadCache()
+            {
+                CounterRegistry::instance().add(&m_counters);
+            }
+
+            ~ThreadCache()
+            {
+                CounterRegistry::instance().remove(&m_counters);
+
+                for (size_t index = 0; index < PacketPool::cClassCount; ++index)
+                {
+                    if (m_lists[index].count > 0 && !Depot::instance().give(index, m_lists[index]))
+                        freeChain(m_lists[index]);
+                }
+            }
+
+            void* allocate(size_t index)
+            {
+                FreeList& list = m_lists[index];
+                if (list.count == 0 && !Depot::instance().take(index, list))
+                {
+                    ThreadCounters::increment(m_counters.misses);
+                    return ::operator new(classBlockSize(index));
+                }
+
+                ThreadCounters::increment(m_counters.hits);
+                return list.pop();
+            }
+
+            void* allocateOversized(size_t size)
+            {
+                ThreadCounters::increment(m_counters.oversized);
+                return ::operator new(size);
+            }
+
+            void deallocate(void* ptr, size_t index)
+            {
+                FreeList& list = m_lists[index];
+                list.push(static_cast<FreeBlock*>(ptr));
+
+                // hand over a batch to other threads when we have too much
+                if (list.count >= cMaxThreadCache)
+                {
+                    FreeList batch;
+                    while (batch.count < PacketPool::cBatchSize)
+                        batch.push(list.pop());
+
+                    if (!Depot::instance().give(index, batch))
+                        freeChain(batch);
+                }
+            }
+
+        private:
+
+            FreeList m_lists[PacketPool::cClassCount];
+            ThreadCounters m_counters;
+        };
+
+
+        ThreadCache& threadCache()
+        {
+            static thread_local ThreadCache cache;
+            return cache;
+        }
+    }
+
+
+    //static
+    void* PacketPool::allocate(size_t size)
+    {
+        size_t index = classIndex(size);
+        if (index >= cClassCount)
+            return threadCache().allocateOversized(size);
+        return threadCache().allocate(index);
+    }
+
+    //static
+    void PacketPool::deallocate(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+
+        size_t index = classIndex(size);
+        if (index >= cClassCount)
+            ::operator delete(ptr);
+        else
+            threadCache().deallocate(ptr, index);
+    }
+
+    //static
+    PacketPool::Stats PacketPool::stats()
+    {
+        return CounterRegistry::instance().sum();
+    }
+
+    //static
+    size_t PacketPool::blockSize(size_t size)
+    {
+        size_t index = classIndex(size);
+        return index < cClassCount ? classBlockSize(index) : 0;
+    }
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+
+namespace core {
+
+    // Size-classed block pool for packets, their buffers and shared_ptr control blocks.
+    // Every thread keeps its own free lists; surplus blocks travel between threads
+    // in batches through a shared depot, so packets allocated on a game thread and
+    // released on io thread are recycled without touching the heap.
+    class PacketPool
+    {
+    public:
+
+        struct Stats
+        {
+            uint64_t hits;      // served from thread cache or depot
+            uint64_t misses;    // had to go to the heap
+            uint64_t oversized; // larger than the biggest size class, never pooled
+        };
+
+        static void* allocate(size_t size);
+        static void deallocate(void* ptr, size_t size);
+
+        // snapshot of pool counters, summed over per-thread ones (threads that are gone included)
+        static Stats stats();
+
+        // size of the block that would serve the request, 0 for oversized requests
+        static size_t blockSize(size_t size);
+
+        static const size_t cMinBlockSize = 32;
+        static const size_t cClassCount = 12; // 32 bytes .. 64 kilobytes
+        static const size_t cBatchSize = 64;  // blocks per thread <-> depot transfer
+    };
+
+
+    // std-compatible allocator on top of PacketPool
+    template <class T>
+    class PoolAllocator
+    {
+    public:
+
+        typedef T value_type;
+
+        template <class U>
+        struct rebind { typedef PoolAllocator<U> other; };
+
+        PoolAllocator() {}
+
+        template <class U>
+        PoolAllocator(const PoolAllocator<U>&) {}
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(PacketPool::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n)
+        {
+            PacketPool::deallocate(ptr, n * sizeof(T));
+        }
+
+        // default-initialize: resize() of byte buffers must not zero memory
+        // that is going to be overwritten by the socket anyway
+        template <class U>
+        void construct(U* ptr)
+        {
+            ::new(static_cast<void*>(ptr)) U;
+        }
+
+        template <class U, class... Args>
+        void construct(U* ptr, Args&&... args)
+        {
+            ::new(static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+        }
+
+        template <class U>
+        void destroy(U* ptr)
+        {
+            ptr->~U();
+        }
+    };
+
+    template <class T, class U>
+    inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+
+    template <class T, class U>
+    inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+}
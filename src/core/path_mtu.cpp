@@ -0,0 +1,207 @@
+#include "stdafx.h"
+#include "core/path_mtu.h"
+#include "core/logger.h"
+#include <algorithm>
+#include <cstring>
+
+
+namespace core {
+
+    using namespace std::chrono;
+
+    const seconds PathMtu::cRaiseInterval(600);
+    const seconds PathMtu::cResearchDelay(5);
+
+    // ids of assembled packets remembered, so late slices don't start them again
+    static const size_t cCompletedMemory = 64;
+
+
+    PathMtu::PathMtu(size_t maxSize)
+      : m_max(std::max(cBaseDatagramSize, std::min(maxSize, cMaxDatagramSize))),
+        m_current(cBaseDatagramSize),
+        m_tooBig(m_max + 1),
+        m_inFlight(0),
+        m_failures(0),
+        m_bigLosses(0),
+        m_nextProbe(SCTimePoint::min())
+    {
+    }
+
+
+    size_t PathMtu::probeSize(const SCTimePoint& now) const
+    {
+        return nextProbeTime() <= now ? candidate() : 0;
+    }
+
+
+    SCTimePoint PathMtu::nextProbeTime() const
+    {
+        return m_inFlight || m_max == m_current ? SCTimePoint::max() : m_nextProbe;
+    }
+
+
+    // the largest size is tried first, it's what the path carries most of the time
+    size_t PathMtu::candidate() const
+    {
+        return m_tooBig > m_max ? m_max : (m_current + m_tooBig) / 2;
+    }
+
+
+    void PathMtu::onProbeSent(size_t size)
+    {
+        m_inFlight = size;
+    }
+
+
+    bool PathMtu::onProbeAcked(size_t size, const SCTimePoint& now)
+    {
+        m_inFlight = 0;
+        if (size <= m_current)
+            return false;
+
+        m_current = size;
+        m_failures = 0;
+        m_tooBig = std::max(m_tooBig, m_current + 1);
+        if (m_tooBig - m_current <= cSearchGranularity || m_current == m_max)
+            searchDone(now);
+        return true;
+    }
+
+
+    void PathMtu::onProbeLost(size_t size, const SCTimePoint& now)
+    {
+        m_inFlight = 0;
+        if (size <= m_current || ++m_failures < cProbeAttempts)
+            return;
+
+        m_failures = 0;
+        m_tooBig = std::min(m_tooBig, size);
+        if (m_tooBig - m_current <= cSearchGranularity)
+            searchDone(now);
+    }
+
+
+    void PathMtu::onPacketAcked(size_t size)
+    {
+        if (size > cBaseDatagramSize)
+            m_bigLosses = 0;
+    }
+
+
+    bool PathMtu::onPacketLost(size_t size, const SCTimePoint& now)
+    {
+        if (size <= cBaseDatagramSize || m_current == cBaseDatagramSize || ++m_bigLosses < cBlackHoleLosses)
+            return false;
+
+        LogWarning() << "datagrams of" << m_current << "bytes stopped getting through, falling back to" << cBaseDatagramSize;
+        m_current = cBaseDatagramSize;
+        m_tooBig = m_max + 1;
+        m_failures = 0;
+        m_bigLosses = 0;
+        m_nextProbe = now + cResearchDelay;
+        return true;
+    }
+
+
+    // path might carry more later, start from the top again after a while
+    void PathMtu::searchDone(const SCTimePoint& now)
+    {
+        LogDebug() << "path MTU search done at" << m_current << "bytes";
+        m_tooBig = m_max + 1;
+        m_nextProbe = now + cRaiseInterval;
+    }
+
+
+    uint32_t sliceIdOf(const Packet& slice)
+    {
+        SliceHeader header;
+        if (slice.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+            return 0;
+        return header.sliceId;
+    }
+
+
+    bool slicePacket(const Packet& packet, uint32_t sliceId, size_t datagramSize, std::vector<PacketPtr>& out)
+    {
+        const size_t room = datagramSize - sizeof(PacketHeader) - sizeof(SliceHeader);
+        const size_t count = (packet.size() + room - 1) / room;
+        if (count > 255)
+        {
+            LogError() << "packet of" << packet.size() << "bytes is too big to be sliced";
+            return false;
+        }
+
+        // wire image of whole packet, its header included: receiver gets it as if it came in one piece
+        std::vector<uint8_t> image(packet.size());
+        boost::asio::buffer_copy(boost::asio::buffer(image), packet.constBuffers());
+
+        for (size_t index = 0; index < count; ++index)
+        {
+            const size_t offset = index * room;
+            const size_t bytes = std::min(room, image.size() - offset);
+            const SliceHeader header = { sliceId, uint8_t(index), uint8_t(count) };
+
+            PacketPtr slice = makePacket(cProtoSlice);
+            PacketBytes& buffer = slice->buffer();
+            buffer.resize(sizeof(PacketHeader) + sizeof(header) + bytes);
+            std::memcpy(buffer.data() + sizeof(PacketHeader), &header, sizeof(header));
+            std::memcpy(buffer.data() + sizeof(PacketHeader) + sizeof(header), image.data() + offset, bytes);
+            out.push_back(slice);
+        }
+        return true;
+    }
+
+
+    PacketPtr SliceAssembler::receive(const Packet& slice)
+    {
+        SliceHeader header;
+        if (slice.copyPayload(0, &header, sizeof(header)) < sizeof(header))
+            return nullptr;
+        if (header.index >= header.count)
+            return nullptr;
+        if (std::find(m_completed.begin(), m_completed.end(), header.sliceId) != m_completed.end())
+            return nullptr;
+
+        auto it = m_partial.find(header.sliceId);
+        if (it == m_partial.end())
+        {
+            if (m_partial.size() >= cMaxPartial)
+                m_partial.erase(m_partial.begin());
+
+            Partial partial;
+            partial.slices.resize(header.count);
+            partial.received = 0;
+            it = m_partial.insert(std::make_pair(header.sliceId, std::move(partial))).first;
+        }
+
+        Partial& partial = it->second;
+        if (partial.slices.size() != header.count || partial.slices[header.index])
+            return nullptr;
+
+        partial.slices[header.index] = makePacket(slice);
+        if (++partial.received < header.count)
+            return nullptr;
+
+        size_t size = 0;
+        for (const PacketPtr& part : partial.slices)
+            size += part->payloadSize() - sizeof(SliceHeader);
+
+        PacketPtr whole;
+        if (size >= sizeof(PacketHeader))
+        {
+            whole = makePacket(Packet::ReceiveTag(), size);
+            uint8_t* out = whole->buffer().data();
+            for (const PacketPtr& part : partial.slices)
+            {
+                out += part->copyPayload(sizeof(SliceHeader), out, part->payloadSize() - sizeof(SliceHeader));
+            }
+        }
+
+        m_partial.erase(it);
+        m_completed.push_back(header.sliceId);
+        if (m_completed.size() > cCompletedMemory)
+            m_completed.pop_front();
+        return whole;
+    }
+
+}
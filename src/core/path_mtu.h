@@ -0,0 +1,124 @@
+#pragma once
+#include "core/packet.h"
+#include "core/handshake.h"
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vector>
+
+
+namespace core {
+
+    // padded packet that only asks whether the path carries datagrams of its size
+    static const uint16_t cProtoProbe = cSystemProtocolBase - 5;
+
+    // part of a packet that no longer fits the path, receiver puts packet together again
+    static const uint16_t cProtoSlice = cSystemProtocolBase - 6;
+
+#pragma pack (push, 1)
+    struct SliceHeader
+    {
+        uint32_t sliceId;
+        uint8_t index;
+        uint8_t count;      // followed by part of whole packet's wire image
+    };
+#pragma pack (pop)
+
+
+    // Path MTU discovery of a connection, done by the connection itself (in the spirit of
+    // RFC 8899) instead of relying on ICMP. Padded probes are sent one at a time; acked
+    // probe raises datagram size, probe lost cProbeAttempts times marks its size as too
+    // big, and the search goes on between the two until they are close. Probes aren't data,
+    // so their loss says nothing about congestion. When several datagrams bigger than base
+    // are lost in a row and none gets through, path has turned into a black hole for them:
+    // size falls back to base and the search starts again a bit later.
+    class PathMtu
+    {
+    public:
+
+        static const size_t cProbeAttempts = 3;
+
+        // search stops when the size known to pass and the size known to fail are this close
+        static const size_t cSearchGranularity = 16;
+
+        // losses of big datagrams in a row that mean they don't get through
+        static const size_t cBlackHoleLosses = 4;
+
+        // search is repeated this long after it finished, in case path got better
+        static const std::chrono::seconds cRaiseInterval;
+
+        // and this long after black hole, not at once, in case losses were congestion
+        static const std::chrono::seconds cResearchDelay;
+
+        // sizes are of whole datagram less IP and UDP headers, maxSize not above base disables probing
+        explicit PathMtu(size_t maxSize);
+
+        // biggest datagram known to get through
+        size_t current() const { return m_current; }
+
+        // size of probe that is due now, 0 if none is
+        size_t probeSize(const SCTimePoint& now) const;
+
+        // when the next probe is due, max() if one is in flight or probing is disabled
+        SCTimePoint nextProbeTime() const;
+
+        void onProbeSent(size_t size);
+
+        // return whether size has grown
+        bool onProbeAcked(size_t size, const SCTimePoint& now);
+
+        void onProbeLost(size_t size, const SCTimePoint& now);
+
+        // data datagrams: one of size above base getting through clears black hole suspicion
+        void onPacketAcked(size_t size);
+
+        // return whether size has fallen back to base
+        bool onPacketLost(size_t size, const SCTimePoint& now);
+
+    private:
+
+        size_t candidate() const;
+
+        void searchDone(const SCTimePoint& now);
+
+        size_t m_max;
+        size_t m_current;
+        size_t m_tooBig;            // smallest size known not to get through, m_max + 1 if none
+        size_t m_inFlight;          // size of probe in flight, 0 if none
+        size_t m_failures;          // lost probes of candidate size
+        size_t m_bigLosses;
+        SCTimePoint m_nextProbe;
+    };
+
+
+    // sliceId of slice, 0 if it's malformed (ids given by connections start at 1)
+    uint32_t sliceIdOf(const Packet& slice);
+
+    // cut packet into slices of at most datagramSize bytes each, false if it takes more than 255
+    bool slicePacket(const Packet& packet, uint32_t sliceId, size_t datagramSize, std::vector<PacketPtr>& out);
+
+
+    // puts sliced packets together, at most cMaxPartial of them at once; older ones are
+    // dropped when more come, which only happens if the peer gave up resending them
+    class SliceAssembler
+    {
+    public:
+
+        static const size_t cMaxPartial = 64;
+
+        // whole packet once its last slice arrives, nullptr before that or if slice is malformed
+        PacketPtr receive(const Packet& slice);
+
+    private:
+
+        struct Partial
+        {
+            std::vector<PacketPtr> slices;
+            size_t received;
+        };
+
+        std::map<uint32_t, Partial> m_partial;
+        std::deque<uint32_t> m_completed;
+    };
+
+}
@@ -0,0 +1,60 @@
+#include "stdafx.h"
+#include "core/rtt_estimator.h"
+#include <algorithm>
+
+
+namespace core {
+
+    using namespace std::chrono;
+
+    // guess until the first sample, it's what connections assumed before measuring
+    static const microseconds cInitialRtt = milliseconds(50);
+    static const microseconds cInitialRto = milliseconds(500);
+
+    // variance term never drops below clock granularity, so a steady link doesn't get
+    // a timeout equal to its round trip
+    static const microseconds cGranularity = milliseconds(1);
+    static const microseconds cMinRto = milliseconds(5);
+    static const microseconds cMaxRto = seconds(2);
+
+
+    RttEstimator::RttEstimator(Duration maxAckDelay)
+      : m_maxAckDelay(maxAckDelay),
+        m_srtt(cInitialRtt),
+        m_rttvar(cInitialRtt / 2),
+        m_rto(cInitialRto),
+        m_hasSamples(false)
+    {
+    }
+
+
+    void RttEstimator::addSample(Duration rtt)
+    {
+        if (rtt < Duration::zero())
+            rtt = Duration::zero();
+
+        if (!m_hasSamples)
+        {
+            m_srtt = rtt;
+            m_rttvar = rtt / 2;
+            m_hasSamples = true;
+        }
+        else
+        {
+            // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+            const Duration delta = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+            m_rttvar = (3 * m_rttvar + delta) / 4;
+            m_srtt = (7 * m_srtt + rtt) / 8;
+        }
+
+        const Duration rto = m_srtt + std::max(cGranularity, 4 * m_rttvar) + m_maxAckDelay;
+        m_rto = std::min(cMaxRto, std::max(cMinRto, rto));
+    }
+
+
+    void RttEstimator::backoff()
+    {
+        m_rto = std::min(cMaxRto, 2 * m_rto);
+    }
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <chrono>
+
+
+namespace core {
+
+    // Smoothed round-trip time and its variance (Jacobson/Karels, as in RFC 6298), and
+    // retransmission timeout derived from them. Kept in microseconds, so LAN round trips
+    // are not rounded away.
+    class RttEstimator
+    {
+    public:
+
+        typedef std::chrono::microseconds Duration;
+
+        // peer may hold its ack this long, timeout allows for it
+        explicit RttEstimator(Duration maxAckDelay);
+
+        // round trip of a packet that was sent once and acknowledged
+        void addSample(Duration rtt);
+
+        // retransmission timed out: double timeout until next sample
+        void backoff();
+
+        bool hasSamples() const { return m_hasSamples; }
+
+        Duration srtt() const { return m_srtt; }
+        Duration rttvar() const { return m_rttvar; }
+        Duration rto() const { return m_rto; }
+
+    private:
+
+        Duration m_maxAckDelay;
+        Duration m_srtt;
+        Duration m_rttvar;
+        Duration m_rto;
+        bool m_hasSamples;
+    };
+
+}
@@ -5,6 +5,11 @@
 #include <boost/bind.hpp>
 #include <chrono>
 
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <linux/sock_diag.h>
+#endif
+
 
 namespace core {
 
@@ -15,37 +20,183 @@ namespace core {
     static const auto cHouseKeepingPeriod = boost::chrono::seconds(1);
     static const auto cConnectionTimeout = std::chrono::seconds(5);
 
+#ifdef SO_REUSEPORT
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePort;
+#endif
+
+#ifdef SO_RXQ_OVFL
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_RXQ_OVFL> ReceiveQueueOverflow;
+#endif
+
+#if defined(IP_MTU_DISCOVER)
+    typedef boost::asio::detail::socket_option::integer<IPPROTO_IP, IP_MTU_DISCOVER> MtuDiscover;
+#elif defined(IP_DONTFRAGMENT)
+    typedef boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_DONTFRAGMENT> DontFragment;
+#endif
+
 
-    SmartSocket::SmartSocket(const IOServicePtr& ioservice, size_t port)
-      : m_ioservice(ioservice),
+    SmartSocket::SmartSocket(const IOServicePtr& ioservice, size_t port, const SocketOptions& options)
+      : m_options(options),
+        m_reportedDrops(0),
+        m_ioservice(ioservice),
+        m_handlerArena(std::make_shared<HandlerArena>()),
+        m_scheduler(*ioservice, m_handlerArena),
         m_localhost(udp::v4(), port),
-        m_socket(*ioservice, m_localhost),
+        m_socket(*ioservice),
         m_housekeepTimer(*m_ioservice)
     {
         LogTrace() << "SmartSocket::SmartSocket";
-        startReceive();
+
+        m_socket.open(m_localhost.protocol());
+        if (m_options.reusePort)
+        {
+#ifdef SO_REUSEPORT
+            m_socket.set_option(ReusePort(true));
+#else
+            LogWarning() << "SO_REUSEPORT is not supported on this platform";
+#endif
+        }
+        m_socket.bind(m_localhost);
+
+        if (m_options.recvBufferSize > 0)
+            m_socket.set_option(socket_base::receive_buffer_size(static_cast<int>(m_options.recvBufferSize)));
+
+#ifdef SO_RXQ_OVFL
+        // kernel attaches its drop counter to received messages
+        m_socket.set_option(ReceiveQueueOverflow(true));
+#endif
+
+        m_options.maxDatagramSize = std::max(cBaseDatagramSize, std::min(m_options.maxDatagramSize, cMaxDatagramSize));
+        if (m_options.pathMtuDiscovery && m_options.maxDatagramSize > cBaseDatagramSize)
+        {
+            // probes must be dropped rather than fragmented on the way, or they prove nothing;
+            // linux probe mode also ignores cached path MTU, connections find it themselves
+#if defined(IP_MTU_DISCOVER)
+            m_socket.set_option(MtuDiscover(IP_PMTUDISC_PROBE));
+#elif defined(IP_DONTFRAGMENT)
+            m_socket.set_option(DontFragment(true));
+#else
+            LogWarning() << "don't fragment bit can't be set on this platform, disabling path MTU discovery";
+            m_options.pathMtuDiscovery = false;
+#endif
+        }
+
+        if (m_options.backend == SocketOptions::IoUringBackend)
+        {
+#ifdef NETBASE_HAS_IO_URING
+            try
+            {
+                m_uring.reset(new UringTransport(*this, m_options.ringDepth));
+            }
+            catch (const std::exception& ex)
+            {
+                LogWarning() << ex.what() << ", using asio backend";
+                m_options.backend = SocketOptions::AsioBackend;
+            }
+#else
+            LogWarning() << "io_uring is not supported on this platform, using asio backend";
+            m_options.backend = SocketOptions::AsioBackend;
+#endif
+            if (m_options.backend == SocketOptions::IoUringBackend && m_options.batchedIO)
+            {
+                LogWarning() << "io_uring backend batches on its own, disabling batched i/o";
+                m_options.batchedIO = false;
+            }
+        }
+
+        if (m_options.segmentationOffload && !m_options.batchedIO)
+        {
+            LogWarning() << "segmentation offload requires batched i/o, disabling it";
+            m_options.segmentationOffload = false;
+        }
+
+        if (m_options.batchedIO)
+        {
+#ifdef __linux__
+            if (m_options.segmentationOffload)
+            {
+                int enable = 1;
+                if (::setsockopt(m_socket.native_handle(), SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+                {
+                    LogWarning() << "UDP_GRO is not supported by kernel, disabling segmentation offload";
+                    m_options.segmentationOffload = false;
+                }
+            }
+
+            m_batchReceiver.reset(new MMsgReceiver(m_options.batchSize, m_options.segmentationOffload, m_options.maxDatagramSize));
+            m_batchSender.reset(new MMsgSender(m_options.batchSize, m_options.segmentationOffload));
+            m_flushPending = false;
+#else
+            LogWarning() << "batched i/o is not supported on this platform, using regular one";
+            m_options.batchedIO = false;
+            m_options.segmentationOffload = false;
+#endif
+        }
+
+        if (m_options.backend == SocketOptions::AsioBackend && !m_options.batchedIO)
+            m_recvSlots.resize(std::max<size_t>(1, m_options.recvDepth));
+
+#ifdef NETBASE_HAS_IO_URING
+        if (m_uring)
+            m_uring->start();
+        else
+#endif
+            startReceive();
 
         m_housekeepTimer.expires_from_now(cHouseKeepingPeriod);
-        m_housekeepTimer.async_wait(boost::bind(&SmartSocket::handleHouseKeep, this, placeholders::error));
+        m_housekeepTimer.async_wait(makeArenaHandler(m_handlerArena,
+            boost::bind(&SmartSocket::handleHouseKeep, this, placeholders::error)));
     }
 
     SmartSocket::~SmartSocket()
     {
         notifyObservers(&ISocketStateObserver::onSocketShutdown);
+
+        LogInfo() << "socket stats: received" << m_stats.recvDatagrams << "datagrams in" << m_stats.recvCalls << "calls,"
+                  << "sent" << m_stats.sentDatagrams << "datagrams in" << m_stats.sendCalls << "calls, syscalls per packet:"
+                  << set_fixed(3) << double(m_stats.recvCalls + m_stats.sendCalls) / std::max<uint64_t>(1, m_stats.recvDatagrams + m_stats.sentDatagrams);
+        LogInfo() << "socket stats: kernel dropped" << m_stats.kernelDrops << "datagrams, rejected" << m_stats.rejectedDatagrams
+                  << "datagrams, handler arena took" << m_handlerArena->heapAllocations() << "blocks from heap,"
+                  << "largest paced burst" << m_scheduler.maxRunBurst() << "datagrams, emulated loss dropped" << m_stats.emulatedDrops;
         LogTrace() << "SmartSocket::~SmartSocket";
     }
 
     ConnectionPtr SmartSocket::getOrCreateConnection(const udp::endpoint& remote)
     {
-        ConnectionPtr conn;
-        if (!m_connections.find(remote, conn))
+        bool created = false;
+        ConnectionPtr conn = m_connections.find_or_insert(remote, [&]
         {
-            conn.reset(new Connection(*this, remote));
-            m_connections.insert(remote, conn);
+            created = true;
+            return std::make_shared<Connection>(*this, remote, !m_options.handshake);
+        });
+
+        // housekeeping repeats connect until peer answers or connection times out
+        if (created)
+        {
+            const bool handshake = m_options.handshake;
+            m_ioservice->post(makeArenaHandler(m_handlerArena, [conn, handshake]
+            {
+                if (handshake)
+                    conn->sendControl(cProtoConnect);
+                else
+                    conn->establish(0);
+            }));
         }
         return conn;
     }
 
+    void SmartSocket::disconnect(const ConnectionPtr& conn)
+    {
+        // single notice, if it's lost peer times out as usual
+        m_ioservice->post(makeArenaHandler(m_handlerArena, [this, conn]
+        {
+            if (conn->isDead())
+                return;
+            conn->sendControl(cProtoDisconnect);
+            closeConnection(conn);
+        }));
+    }
+
     ConnectionPtr SmartSocket::getExistingConnection(const udp::endpoint& remote)
     {
         ConnectionPtr conn;
@@ -54,45 +205,420 @@ namespace core {
     }
 
 
+    void SmartSocket::sendDatagram(const PacketPtr& packet, const udp::endpoint& peer)
+    {
+        if (m_options.emulatedLoss > 0 && std::uniform_real_distribution<double>(0, 1)(m_lossRandom) < m_options.emulatedLoss)
+        {
+            ++m_stats.emulatedDrops;
+            return;
+        }
+
+#ifdef NETBASE_HAS_IO_URING
+        if (m_uring)
+        {
+            m_uring->send(packet, peer);
+            return;
+        }
+#endif
+#ifdef __linux__
+        if (m_options.batchedIO)
+        {
+            // everything queued until posted flush runs goes out in one sendmmsg
+            m_sendQueue.push_back(Datagram(packet, peer));
+            if (!m_flushPending)
+            {
+                m_flushPending = true;
+                m_ioservice->post(makeArenaHandler(m_handlerArena, boost::bind(&SmartSocket::flushSends, this)));
+            }
+            return;
+        }
+#endif
+        ++m_stats.sendCalls;
+        ++m_stats.sentDatagrams;
+        m_socket.async_send_to(packet->constBuffers(), peer, makeArenaHandler(m_handlerArena,
+            boost::bind(&SmartSocket::handleSend, this, packet, peer, placeholders::error)));
+    }
+
+
+    void SmartSocket::handleSend(const PacketPtr& packet, const udp::endpoint& peer, const boost::system::error_code& error)
+    {
+        // system packets are not in send buffer, nothing to resend or release
+        if (error && !isSystemProtocol(packet->header().protocol))
+        {
+            auto conn = getExistingConnection(peer);
+            if (conn)
+                conn->handleSend(packet, error);
+        }
+    }
+
+
     void SmartSocket::startReceive()
     {
-        m_socket.async_receive_from(buffer(m_recvBuf), m_recvPeer,
-            boost::bind(&SmartSocket::handleReceive, this, placeholders::error, placeholders::bytes_transferred));
+#ifdef __linux__
+        if (m_options.batchedIO)
+        {
+            m_socket.async_receive(null_buffers(), makeArenaHandler(m_handlerArena,
+                boost::bind(&SmartSocket::handleReadable, this, placeholders::error)));
+            return;
+        }
+#endif
+        for (size_t slot = 0; slot < m_recvSlots.size(); ++slot)
+            receiveInto(slot);
     }
 
 
-    void SmartSocket::handleReceive(const boost::system::error_code& error, size_t recvBytes)
+    void SmartSocket::receiveInto(size_t slot)
     {
+        // a byte more than datagram may have: posix truncates silently, datagram that
+        // fills the extra byte too is known to be too big
+        ReceiveSlot& recv = m_recvSlots[slot];
+        if (!recv.packet)
+            recv.packet = makePacket(Packet::ReceiveTag(), m_options.maxDatagramSize + 1);
+        else
+            recv.packet->buffer().resize(m_options.maxDatagramSize + 1);
+
+        m_socket.async_receive_from(buffer(recv.packet->buffer()), recv.peer, makeArenaHandler(m_handlerArena,
+            boost::bind(&SmartSocket::handleReceive, this, slot, placeholders::error, placeholders::bytes_transferred)));
+    }
+
+
+    void SmartSocket::handleReceive(size_t slot, const boost::system::error_code& error, size_t recvBytes)
+    {
+        ++m_stats.recvCalls;
+
+        ReceiveSlot& recv = m_recvSlots[slot];
+        const udp::endpoint peer = recv.peer;
+
+        PacketPtr packet;
+        bool wellFormed = !error && recvBytes >= sizeof(PacketHeader) && recvBytes <= m_options.maxDatagramSize;
+        if (wellFormed)
+            packet = std::move(recv.packet);
+
+        // slot goes back to kernel before datagram is processed, so the rest of
+        // outstanding receives keep draining socket queue meanwhile
+        receiveInto(slot);
+
         try
         {
-            if (error == error::message_size || (!error && recvBytes < sizeof(PacketHeader)))
+            if (error == error::message_size || (!error && !wellFormed))
             {
-                notifyObservers(&ISocketStateObserver::onBadPacketSize, m_recvPeer, recvBytes);
+                notifyObservers(&ISocketStateObserver::onBadPacketSize, peer, recvBytes);
             }
             else if (error)
             {
-                auto conn = getExistingConnection(m_recvPeer);
-                if (conn && !conn->isDead())
-                    switch (error.value())
+                handleReceiveError(peer, error);
+            }
+            else
+            {
+                packet->buffer().resize(recvBytes);
+                handleDatagram(packet, peer);
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            LogError() << ex.what();
+        }
+        catch (...)
+        {
+            LogFatal() << "unknown exception" << cSourceLocation;
+        }
+    }
+
+
+    void SmartSocket::handleDatagram(const PacketPtr& packet, const udp::endpoint& peer)
+    {
+        ++m_stats.recvDatagrams;
+
+        if (isSystemProtocol(packet->header().protocol))
+        {
+            handleControl(packet, peer);
+            return;
+        }
+
+        // id echoed by peer indexes our slab; stale ids fall back to lookup by address
+        ConnectionPtr conn = connectionById(packet->header().connId);
+        if (conn && conn->peer() != peer)
+        {
+            // ids are easy to guess, so data never moves connection: peer has to prove
+            // it's the one who moved, its packets are dropped until then
+            if (m_options.handshake)
+            {
+                challengeRebind(*conn, *packet, peer);
+                ++m_stats.rejectedDatagrams;
+                return;
+            }
+            conn.reset();
+        }
+
+        if (!conn)
+        {
+            if (m_options.handshake)
+                m_connections.find(peer, conn);
+            else
+                conn = acceptConnection(peer);
+        }
+
+        // nothing is allocated for peers that haven't completed handshake
+        if (!conn || !conn->isEstablished())
+        {
+            ++m_stats.rejectedDatagrams;
+            return;
+        }
+
+        conn->handleReceive(packet);
+        conn->markDead(false);
+    }
+
+
+    ConnectionPtr SmartSocket::acceptConnection(const udp::endpoint& peer)
+    {
+        bool created = false;
+        ConnectionPtr conn = m_connections.find_or_insert(peer, [&]
+        {
+            created = true;
+            return std::make_shared<Connection>(*this, peer);
+        });
+
+        if (created && !m_options.handshake)
+            conn->establish(0);
+
+        if (created && m_options.connectionIds)
+        {
+            uint32_t id = m_connectionSlab.add(conn);
+            if (id == 0)
+                LogWarning() << "connection slab is full, connection with" << peer << "gets no id";
+            conn->assignId(id);
+        }
+        return conn;
+    }
+
+
+    ConnectionPtr SmartSocket::connectionById(uint32_t connId) const
+    {
+        if (connId == 0 || (connId & cConnIdAssigned))
+            return nullptr;
+
+        const ConnectionPtr* found = m_connectionSlab.find(connId);
+        return found ? *found : nullptr;
+    }
+
+
+    // Connect is answered with a cookie derived from peer's address, costing the server
+    // one hash and one datagram no bigger than the connect (shorter connects are dropped);
+    // only a peer that receives at its address can echo the cookie back, and only then
+    // the connection is allocated
+    void SmartSocket::handleControl(const PacketPtr& packet, const udp::endpoint& peer)
+    {
+        const PacketHeader& header = packet->header();
+        const uint64_t token = controlToken(*packet);
+        const auto now = system_clock::now();
+
+        ConnectionPtr conn = getExistingConnection(peer);
+        switch (header.protocol)
+        {
+            case cProtoConnect:
+                if (packet->size() < cControlPacketSize)
+                {
+                    ++m_stats.rejectedDatagrams;
+                    break;
+                }
+                sendDatagram(makeControlPacket(cProtoChallenge, m_cookies.make(peer, now)), peer);
+                break;
+
+            case cProtoChallenge:
+                if (conn && !conn->isEstablished())
+                    conn->handleChallenge(token);
+                break;
+
+            case cProtoConnectResponse:
+                if (conn && conn->isEstablished() && conn->token() == token)
+                {
+                    // our accept was lost
+                    conn->sendControl(cProtoAccept);
+                }
+                else if (m_cookies.check(peer, token, now))
+                {
+                    // established one means peer has started over with the same address,
+                    // connecting one means both sides are connecting to each other
+                    if (conn && (conn->isEstablished() || conn->isDead()))
+                    {
+                        closeConnection(conn);
+                        conn.reset();
+                    }
+                    if (!conn)
+                        conn = acceptConnection(peer);
+
+                    conn->establish(token);
+                    conn->sendControl(cProtoAccept);
+                    notifyObservers(&ISocketStateObserver::onConnect, conn);
+                }
+                else
+                {
+                    ++m_stats.rejectedDatagrams;
+                }
+                break;
+
+            case cProtoAccept:
+                if (conn && !conn->isEstablished() && conn->token() == token)
+                {
+                    conn->establish(token, header.connId);
+                    notifyObservers(&ISocketStateObserver::onConnect, conn);
+                }
+                break;
+
+            case cProtoHeartbeat:
+            {
+                // one-way receiver sends nothing else, so heartbeat finds connection by id
+                // like data does and gets moved connection challenged in the same way
+                ConnectionPtr owner = connectionById(header.connId);
+                if (!owner)
+                    owner = conn;
+
+                if (owner && owner->isEstablished() && owner->token() == token)
+                {
+                    if (owner->peer() != peer)
                     {
-                        case error::connection_aborted:
-                        case error::connection_refused:
-                        case error::connection_reset:
-                            notifyObservers(&ISocketStateObserver::onPeerDisconnect, conn);
-                            conn->markDead(true);
-                            break;
-                
-                        default:
-                            notifyObservers(&ISocketStateObserver::onError, conn, error);
-                            break;
+                        challengeRebind(*owner, *packet, peer);
+                        break;
                     }
+                    owner->handleHeartbeat(header);
+                    owner->markDead(false);
+                }
+                else
+                {
+                    ++m_stats.rejectedDatagrams;
+                }
+                break;
             }
-            else
+
+            case cProtoRebindChallenge:
+                if (conn && conn->isEstablished() && conn->isPeerId(header.connId))
+                    conn->answerRebind(token);
+                break;
+
+            case cProtoRebind:
             {
-                ConnectionPtr conn = getOrCreateConnection(m_recvPeer);
-                conn->handleReceive(std::make_shared<Packet>(m_recvBuf.data(), recvBytes));
-                conn->markDead(false);
+                // token proves it's our peer, echoed cookie proves it receives at new address
+                ConnectionPtr moved = connectionById(header.connId);
+                if (moved && moved->isEstablished() && moved->token() == token
+                    && m_cookies.check(peer, rebindCookie(*packet), now))
+                {
+                    if (moved->peer() != peer)
+                        migrateConnection(moved, peer);
+                }
+                else
+                {
+                    ++m_stats.rejectedDatagrams;
+                }
+                break;
             }
+
+            case cProtoDisconnect:
+                if (conn && conn->isEstablished() && conn->token() == token)
+                {
+                    notifyObservers(&ISocketStateObserver::onPeerDisconnect, conn);
+                    closeConnection(conn);
+                }
+                else
+                {
+                    ++m_stats.rejectedDatagrams;
+                }
+                break;
+
+            default:
+                ++m_stats.rejectedDatagrams;
+                break;
+        }
+    }
+
+
+    void SmartSocket::closeConnection(const ConnectionPtr& conn)
+    {
+        conn->markDead(true);
+        m_connections.remove(conn->peer());
+        m_connectionSlab.remove(conn->localId());
+    }
+
+
+    // challenge is no bigger than datagram that caused it, so spoofing the source gains nothing
+    void SmartSocket::challengeRebind(const Connection& conn, const Packet& packet, const udp::endpoint& peer)
+    {
+        if (packet.size() < cControlPacketSize)
+            return;
+
+        LogDebug() << "connection with" << conn.peer() << "seen at" << peer << ", challenging";
+        sendDatagram(makeControlPacket(cProtoRebindChallenge, m_cookies.make(peer, system_clock::now()), conn.localId() | cConnIdAssigned), peer);
+    }
+
+
+    void SmartSocket::migrateConnection(const ConnectionPtr& conn, const udp::endpoint& peer)
+    {
+        LogInfo() << "connection with" << conn->peer() << "moved to" << peer;
+
+        // whatever was known at the new address is superseded
+        ConnectionPtr stale;
+        if (m_connections.find(peer, stale))
+            closeConnection(stale);
+
+        m_connections.remove(conn->peer());
+        conn->rebind(peer);
+        m_connections.find_or_insert(peer, [&]{ return conn; });
+    }
+
+
+    void SmartSocket::handleReceiveError(const udp::endpoint& peer, const boost::system::error_code& error)
+    {
+        auto conn = getExistingConnection(peer);
+        if (conn && !conn->isDead())
+            switch (error.value())
+            {
+                case error::connection_aborted:
+                case error::connection_refused:
+                case error::connection_reset:
+                    notifyObservers(&ISocketStateObserver::onPeerDisconnect, conn);
+                    conn->markDead(true);
+                    break;
+                
+                default:
+                    notifyObservers(&ISocketStateObserver::onError, conn, error);
+                    break;
+            }
+    }
+
+
+#ifdef __linux__
+
+    void SmartSocket::handleReadable(const boost::system::error_code& error)
+    {
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        try
+        {
+            boost::system::error_code recvError;
+            size_t count = m_batchReceiver->receive(m_socket.native_handle(), recvError);
+            ++m_stats.recvCalls;
+            m_stats.kernelDrops = m_batchReceiver->kernelDrops();
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                Datagram& dgram = m_batchReceiver->datagram(i);
+                size_t size = dgram.packet->size();
+
+                if (m_batchReceiver->truncated(i) || size < sizeof(PacketHeader))
+                    notifyObservers(&ISocketStateObserver::onBadPacketSize, dgram.peer, size);
+                else
+                {
+                    // packet is taken away, so the next receive doesn't write into it while
+                    // connection still holds it
+                    PacketPtr packet = std::move(dgram.packet);
+                    handleDatagram(packet, dgram.peer);
+                }
+            }
+
+            // errors of connected peers (icmp unreachable) are reported without peer address
+            if (recvError && recvError != boost::asio::error::would_block)
+                LogError() << "batched receive failed:" << recvError.message();
         }
         catch (const std::exception& ex)
         {
@@ -106,6 +632,48 @@ namespace core {
     }
 
 
+    void SmartSocket::flushSends()
+    {
+        m_flushPending = false;
+
+        while (!m_sendQueue.empty())
+        {
+            boost::system::error_code error;
+            size_t sent = m_batchSender->send(m_socket.native_handle(), m_sendQueue, error);
+            ++m_stats.sendCalls;
+            m_stats.sentDatagrams += sent;
+
+            m_sendQueue.erase(m_sendQueue.begin(), m_sendQueue.begin() + sent);
+
+            if (error == boost::asio::error::would_block)
+            {
+                // socket buffer is full, continue when kernel drains it
+                m_flushPending = true;
+                m_socket.async_send(null_buffers(), makeArenaHandler(m_handlerArena,
+                    boost::bind(&SmartSocket::handleWritable, this, placeholders::error)));
+                return;
+            }
+            else if (error)
+            {
+                // first datagram in queue has failed, drop it and go on with the rest
+                Datagram failed = m_sendQueue.front();
+                m_sendQueue.pop_front();
+                handleSend(failed.packet, failed.peer, error);
+            }
+        }
+    }
+
+
+    void SmartSocket::handleWritable(const boost::system::error_code& error)
+    {
+        if (error == boost::asio::error::operation_aborted)
+            return;
+        flushSends();
+    }
+
+#endif
+
+
     void SmartSocket::registerProtocolListener(uint16_t protocol, const ProtocolListenerPtr& listener)
     {
         m_dispatcher.registerListener(protocol, listener);
@@ -120,12 +688,43 @@ namespace core {
     }
 
 
+    // payload is encoded once and shared by all peers, every peer gets only its own header
     void SmartSocket::sendEveryone(const PacketPtr& packet, size_t resendLimit)
     {
+        if (isReservedProtocol(packet->header().protocol))
+        {
+            LogWarning() << "packet with reserved protocol" << packet->header().protocol << "not sent to anyone";
+            return;
+        }
+        m_connections.for_each_value([&](const ConnectionPtr& conn)
+        {
+            if (!conn->isDead())
+                conn->asyncSend(makePacket(packet, Packet::ShareTag()), resendLimit);
+        });
+    }
+
+
+    void SmartSocket::sendEveryone(const PacketPtr& packet, Channel channel)
+    {
+        if (isReservedProtocol(packet->header().protocol))
+        {
+            LogWarning() << "packet with reserved protocol" << packet->header().protocol << "not sent to anyone";
+            return;
+        }
         m_connections.for_each_value([&](const ConnectionPtr& conn)
         {
             if (!conn->isDead())
-                conn->asyncSend(std::make_shared<Packet>(*packet), resendLimit);
+                conn->asyncSend(makePacket(packet, Packet::ShareTag()), channel);
+        });
+    }
+
+
+    void SmartSocket::flushEveryone()
+    {
+        m_connections.for_each_value([](const ConnectionPtr& conn)
+        {
+            if (!conn->isDead())
+                conn->flush();
         });
     }
 
@@ -139,7 +738,8 @@ namespace core {
         }
 
         m_housekeepTimer.expires_at(m_housekeepTimer.expires_at() + cHouseKeepingPeriod);
-        m_housekeepTimer.async_wait(boost::bind(&SmartSocket::handleHouseKeep, this, placeholders::error));
+        m_housekeepTimer.async_wait(makeArenaHandler(m_handlerArena,
+            boost::bind(&SmartSocket::handleHouseKeep, this, placeholders::error)));
 
         // find timed out connections and mark them dead, and count dead connections
         // to determine if we need to remove anything (slow path that we want to avoid)
@@ -148,6 +748,10 @@ namespace core {
 
         m_connections.for_each_value([&](const ConnectionPtr& conn)
         {
+            // handshake packets may be lost, repeat whichever step we're at
+            if (!conn->isEstablished() && !conn->isDead())
+                conn->sendControl(conn->token() ? cProtoConnectResponse : cProtoConnect);
+
             if (conn->lastActivityTime() < timeoutStart)
             {
                 LogDebug() << "connection with" << conn->peer() << "timed out";
@@ -161,7 +765,37 @@ namespace core {
         // remove dead connections -- slow path, but rare (write lock)
         if (deadCount > 0)
         {
-            m_connections.remove_if([](const ConnectionPtr& conn){ return conn->isDead(); });
+            m_connections.remove_if([&](const ConnectionPtr& conn)
+            {
+                if (!conn->isDead())
+                    return false;
+                m_connectionSlab.remove(conn->localId());
+                return true;
+            });
         }
+        m_connections.collect_garbage();
+
+        updateKernelDrops();
+        if (m_stats.kernelDrops > m_reportedDrops)
+        {
+            LogWarning() << "receive queue overflowed, kernel dropped" << m_stats.kernelDrops - m_reportedDrops << "datagrams";
+            m_reportedDrops = m_stats.kernelDrops;
+        }
+    }
+
+
+    void SmartSocket::updateKernelDrops()
+    {
+#if defined(__linux__) && defined(SO_MEMINFO)
+        // batched and io_uring receives get SO_RXQ_OVFL counter with data, asio
+        // receives don't see ancillary data, so ask socket for the same counter
+        if (m_recvSlots.empty())
+            return;
+
+        uint32_t meminfo[SK_MEMINFO_VARS] = {};
+        socklen_t len = sizeof(meminfo);
+        if (::getsockopt(m_socket.native_handle(), SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+            m_stats.kernelDrops = meminfo[SK_MEMINFO_DROPS];
+#endif
     }
 }
\ No newline at end of file
@@ -3,18 +3,177 @@
 #include "core/packet_dispatcher.h"
 #include "core/observable.h"
 #include "core/socket_state_observer.h"
-#include "core/concurrent_map.h"
+#include "core/concurrent_hash_map.h"
+#include "core/id_slab.h"
 #include "core/ioservice_resource.h"
+#include "core/mmsg_io.h"
+#include "core/uring_transport.h"
+#include "core/handler_arena.h"
+#include "core/handshake.h"
+#include "core/pacing_scheduler.h"
 #include <boost/signal.hpp>
 #include <boost/asio/system_timer.hpp>
 #include <map>
+#include <random>
 
 
 namespace core {
 
     typedef std::shared_ptr<boost::asio::io_service> IOServicePtr;
     typedef boost::asio::system_timer HouseKeepTimer;
-    typedef ConcurrentMap<udp::endpoint, ConnectionPtr> ConnectionsMap;
+
+
+    // cheap well-mixed hash of peer address, ipv4 address and port fit into one multiply
+    struct EndpointHash
+    {
+        size_t operator()(const udp::endpoint& ep) const
+        {
+            uint64_t key = ep.port();
+            if (ep.address().is_v4())
+            {
+                key |= uint64_t(ep.address().to_v4().to_ulong()) << 16;
+            }
+            else
+            {
+                auto bytes = ep.address().to_v6().to_bytes();
+                for (size_t i = 0; i < bytes.size(); ++i)
+                    key = (key ^ bytes[i]) * 0x100000001b3ULL;
+            }
+            key *= 0x9e3779b97f4a7c15ULL;
+            return static_cast<size_t>(key ^ (key >> 32));
+        }
+    };
+
+    typedef ConcurrentHashMap<udp::endpoint, ConnectionPtr, EndpointHash> ConnectionsMap;
+    typedef IdSlab<ConnectionPtr> ConnectionSlab;
+
+
+    // construction-time socket settings
+    struct SocketOptions
+    {
+        enum Backend
+        {
+            AsioBackend,        // boost::asio reactor
+            IoUringBackend      // linux only, io_uring with multishot receive
+        };
+
+        enum CongestionControl
+        {
+            NoCongestion,       // send as fast as application does
+            AimdCongestion,     // loss-based, see AimdCongestionControl
+            DelayCongestion     // delay-based, see DelayCongestionControl
+        };
+
+        SocketOptions()
+          : backend(AsioBackend), ringDepth(256), recvDepth(4), recvBufferSize(0),
+            batchedIO(false), batchSize(32), reusePort(false), segmentationOffload(false),
+            connectionIds(false), handshake(true), congestionControl(AimdCongestion),
+            pacing(true), pacingInterval(50), maxUnreliableDelay(250),
+            reassemblyBudget(64 * 1024 * 1024), maxIncomingFileSize(uint64_t(4) << 30),
+            coalescing(false), coalescingDelay(2),
+            maxDatagramSize(1472), pathMtuDiscovery(true), emulatedLoss(0) {}
+
+        // transport that moves datagrams, falls back to asio where io_uring is unavailable
+        Backend backend;
+
+        // io_uring submission queue size
+        size_t ringDepth;
+
+        // asio backend: receives kept outstanding, each with its own packet buffer
+        size_t recvDepth;
+
+        // kernel receive queue size in bytes (SO_RCVBUF), 0 keeps system default
+        size_t recvBufferSize;
+
+        // linux only: drain receive queue with recvmmsg and flush sends with sendmmsg
+        bool batchedIO;
+
+        // max datagrams per recvmmsg/sendmmsg call
+        size_t batchSize;
+
+        // allow several sockets on the same port (SO_REUSEPORT), kernel spreads peers among them
+        bool reusePort;
+
+        // linux only, with batchedIO: send runs of same-sized datagrams to a peer as one
+        // UDP_SEGMENT message, accept UDP_GRO coalesced receives and split them
+        bool segmentationOffload;
+
+        // give accepted connections ids, peers put them into headers: their packets are
+        // found by slab index instead of address; with handshake connection follows peer
+        // to a new address once peer proves it has connection's token and receives there.
+        // Its 4 bytes are in every header either way, see PacketHeader::connId
+        bool connectionIds;
+
+        // connections are created only by cookie handshake, datagrams of unknown peers
+        // are dropped; without it any datagram creates a connection for its sender
+        bool handshake;
+
+        // how connections find their sending window, packets beyond it wait in queue
+        CongestionControl congestionControl;
+
+        // packets leave evenly spaced instead of in bursts: each connection within its
+        // pacing rate, all of them interleaved by socket's scheduler
+        bool pacing;
+
+        // packets handed over at once are spread over this time (application's tick),
+        // unless congestion window allows only a slower rate
+        std::chrono::milliseconds pacingInterval;
+
+        // unreliable and sequenced messages that wait for window longer than this are
+        // dropped: latest-only state is worth nothing late, newer one is queued behind it
+        std::chrono::milliseconds maxUnreliableDelay;
+
+        // traffic class of protocols that aren't NormalTraffic, classes share each
+        // connection's budget by weights set with Connection::configureTrafficClass
+        std::map<uint16_t, TrafficClass> trafficClasses;
+
+        // bytes each connection may hold for objects being reassembled, see ObjectTransfer
+        size_t reassemblyBudget;
+
+        // directory where files sent by peers are stored, see Connection::sendFile;
+        // empty refuses them
+        std::string fileDirectory;
+
+        // bigger files offered by peers are refused, as are those too big to map at once
+        uint64_t maxIncomingFileSize;
+
+        // small messages sent to a peer close together travel several to a datagram, see
+        // Coalescer; bundle waits at most coalescingDelay for more, or until Connection::flush
+        bool coalescing;
+        std::chrono::milliseconds coalescingDelay;
+
+        // biggest datagram (less IP and UDP headers) socket receives and connections may
+        // send, kept within [cBaseDatagramSize, cMaxDatagramSize]; default fits ethernet
+        size_t maxDatagramSize;
+
+        // connections start at cBaseDatagramSize and probe for bigger datagrams up to
+        // maxDatagramSize, see PathMtu; socket sends with don't fragment bit set
+        bool pathMtuDiscovery;
+
+        // testing: share of outgoing datagrams dropped at random, as a lossy network would
+        double emulatedLoss;
+    };
+
+
+    // i/o counters, updated only from io thread
+    struct SocketStats
+    {
+        SocketStats() : recvCalls(0), recvDatagrams(0), sendCalls(0), sentDatagrams(0), kernelDrops(0), rejectedDatagrams(0), emulatedDrops(0) {}
+
+        uint64_t recvCalls;
+        uint64_t recvDatagrams;
+        uint64_t sendCalls;
+        uint64_t sentDatagrams;
+
+        // datagrams dropped by kernel because receive queue was full
+        uint64_t kernelDrops;
+
+        // datagrams of unknown peers and handshakes with bad cookies, dropped with no state allocated
+        uint64_t rejectedDatagrams;
+
+        // outgoing datagrams dropped by SocketOptions::emulatedLoss
+        uint64_t emulatedDrops;
+    };
 
 
     class SmartSocket:
@@ -23,18 +182,26 @@ namespace core {
     {
     public:
 
-        SmartSocket(const IOServicePtr& ioservice, size_t port);
+        SmartSocket(const IOServicePtr& ioservice, size_t port, const SocketOptions& options = SocketOptions());
 
         ~SmartSocket();
 
-        // find existing connection or create new
+        // find existing connection or create new, new one connects to peer with handshake
+        // (if enabled), packets sent meanwhile are held until it's established
         ConnectionPtr getOrCreateConnection(const udp::endpoint& remote);
 
+        // tell peer we're leaving and drop connection at once
+        void disconnect(const ConnectionPtr& conn);
+
         // return connection if exists or nullptr
         ConnectionPtr getExistingConnection(const udp::endpoint& remote);
 
-        // send packet to all connected peers
+        // send packet to all connected peers, packet must not be modified afterwards
         void sendEveryone(const PacketPtr& packet, size_t resendLimit = 0);
+        void sendEveryone(const PacketPtr& packet, Channel channel);
+
+        // end of application's tick for all peers, see Connection::flush
+        void flushEveryone();
 
 
         void registerProtocolListener(uint16_t protocol, const ProtocolListenerPtr& listener);
@@ -46,22 +213,110 @@ namespace core {
 
         const IOServicePtr& getIOService() const { return m_ioservice; }
 
+        const SocketOptions& options() const { return m_options; }
+
+        const SocketStats& stats() const { return m_stats; }
+
     private:
 
+        friend class Connection;
+        friend class UringTransport;
+
+        // [io-thread] spaces out packets of all connections
+        PacingScheduler& scheduler() { return m_scheduler; }
+
+        // [io-thread] send datagram now, or queue it for batched flush
+        void sendDatagram(const PacketPtr& packet, const udp::endpoint& peer);
+
+        // [io-thread] completion of single send, reports errors to connection
+        void handleSend(const PacketPtr& packet, const udp::endpoint& peer, const boost::system::error_code& error);
+
+        // arm all receives: every slot for asio, readiness wait for batched i/o
         void startReceive();
 
-        void handleReceive(const boost::system::error_code& error, size_t recvBytes);
+        // [io-thread] arm asynchronous receive into given slot
+        void receiveInto(size_t slot);
+
+        void handleReceive(size_t slot, const boost::system::error_code& error, size_t recvBytes);
+
+        // [io-thread] pass well-formed datagram to its connection
+        void handleDatagram(const PacketPtr& packet, const udp::endpoint& peer);
+
+        // [io-thread] handshake and disconnect packets, all state changes of connection set
+        void handleControl(const PacketPtr& packet, const udp::endpoint& peer);
+
+        // [io-thread] find connection for incoming packet, create and give it an id if needed
+        ConnectionPtr acceptConnection(const udp::endpoint& peer);
+
+        // [io-thread] accepted connection that id echoed by peer points to, nullptr if none
+        ConnectionPtr connectionById(uint32_t connId) const;
+
+        // [io-thread] forget connection right away, without waiting for housekeeping
+        void closeConnection(const ConnectionPtr& conn);
+
+        // [io-thread] packet with connection's id came from a new address: ask that address
+        // to prove it has connection's token (see cProtoRebind)
+        void challengeRebind(const Connection& conn, const Packet& packet, const udp::endpoint& peer);
+
+        // [io-thread] known connection came from a new address, move it there
+        void migrateConnection(const ConnectionPtr& conn, const udp::endpoint& peer);
+
+        // [io-thread] notify observers about receive error on peer's connection
+        void handleReceiveError(const udp::endpoint& peer, const boost::system::error_code& error);
+
+#ifdef __linux__
+        // [io-thread] socket became readable: take a batch of datagrams with recvmmsg
+        void handleReadable(const boost::system::error_code& error);
+
+        // [io-thread] send all queued datagrams with sendmmsg, wait for socket if it's full
+        void flushSends();
+
+        void handleWritable(const boost::system::error_code& error);
+
+        std::unique_ptr<MMsgReceiver> m_batchReceiver;
+        std::unique_ptr<MMsgSender> m_batchSender;
+        DatagramQueue m_sendQueue;
+        bool m_flushPending;
+#endif
+
+#ifdef NETBASE_HAS_IO_URING
+        std::unique_ptr<UringTransport> m_uring;
+#endif
 
         void handleHouseKeep(const boost::system::error_code& error);
 
+        // [io-thread] refresh kernel drop counter where it doesn't come with received data
+        void updateKernelDrops();
+
+        SocketOptions m_options;
+        SocketStats m_stats;
+        CookieJar m_cookies;
+        std::minstd_rand m_lossRandom;
+        uint64_t m_reportedDrops;
+
         IOServicePtr m_ioservice;
+
+        // storage for completion handlers of socket operations, recycled
+        HandlerArenaPtr m_handlerArena;
+
+        // [io-thread] connections with paced packets waiting
+        PacingScheduler m_scheduler;
+
         udp::endpoint m_localhost;
         udp::socket m_socket;
 
-        std::array<uint8_t, cMaxUdpPacketSize> m_recvBuf;
-        udp::endpoint m_recvPeer;
+        // outstanding asio receives, a packet is kept in its slot if it was not handed to any connection
+        struct ReceiveSlot
+        {
+            PacketPtr packet;
+            udp::endpoint peer;
+        };
+        std::vector<ReceiveSlot> m_recvSlots;
 
         ConnectionsMap m_connections;
+
+        // [io-thread] accepted connections by id
+        ConnectionSlab m_connectionSlab;
         PacketDispatcher m_dispatcher;
         HouseKeepTimer m_housekeepTimer;
     };
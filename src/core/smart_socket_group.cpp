@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "core/smart_socket_group.h"
+#include "core/logger.h"
+
+
+namespace core {
+
+    SmartSocketGroup::SmartSocketGroup(size_t port, size_t shardCount, const SocketOptions& options)
+    {
+        if (shardCount == 0)
+            throw std::invalid_argument("SmartSocketGroup: at least one shard is required");
+
+        SocketOptions shardOptions = options;
+        shardOptions.reusePort = true;
+
+        for (size_t i = 0; i < shardCount; ++i)
+        {
+            auto thread = std::make_shared<IOServiceThread>();
+            auto socket = std::make_shared<SmartSocket>(thread->getService(), port, shardOptions);
+            thread->addResource(socket);
+
+            // if port was chosen by system, the rest of shards must join it
+            port = socket->rawSocket().local_endpoint().port();
+
+            m_threads.push_back(thread);
+            m_sockets.push_back(socket);
+        }
+
+        LogInfo() << "socket group with" << shardCount << "shards listens on port" << port;
+    }
+
+    SmartSocketGroup::~SmartSocketGroup()
+    {
+        // stop all io threads before any socket goes away
+        m_threads.clear();
+    }
+
+    unsigned short SmartSocketGroup::port() const
+    {
+        return m_sockets.front()->rawSocket().local_endpoint().port();
+    }
+
+    ConnectionPtr SmartSocketGroup::getExistingConnection(const udp::endpoint& remote)
+    {
+        for (auto& socket : m_sockets)
+        {
+            if (ConnectionPtr conn = socket->getExistingConnection(remote))
+                return conn;
+        }
+        return nullptr;
+    }
+
+    void SmartSocketGroup::sendEveryone(const PacketPtr& packet, size_t resendLimit)
+    {
+        for (auto& socket : m_sockets)
+            socket->sendEveryone(packet, resendLimit);
+    }
+
+    void SmartSocketGroup::sendEveryone(const PacketPtr& packet, Channel channel)
+    {
+        for (auto& socket : m_sockets)
+            socket->sendEveryone(packet, channel);
+    }
+
+    void SmartSocketGroup::flushEveryone()
+    {
+        for (auto& socket : m_sockets)
+            socket->flushEveryone();
+    }
+
+    void SmartSocketGroup::registerProtocolListener(uint16_t protocol, const ProtocolListenerPtr& listener)
+    {
+        for (auto& socket : m_sockets)
+            socket->registerProtocolListener(protocol, listener);
+    }
+
+    void SmartSocketGroup::dispatchReceivedPackets()
+    {
+        for (auto& socket : m_sockets)
+            socket->dispatchReceivedPackets();
+    }
+
+    void SmartSocketGroup::addObserver(const std::shared_ptr<ISocketStateObserver>& observer)
+    {
+        for (auto& socket : m_sockets)
+            socket->addObserver(observer);
+    }
+
+    void SmartSocketGroup::removeObserver(const std::shared_ptr<ISocketStateObserver>& observer)
+    {
+        for (auto& socket : m_sockets)
+            socket->removeObserver(observer);
+    }
+
+}
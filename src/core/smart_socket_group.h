@@ -0,0 +1,58 @@
+#pragma once
+#include "core/smart_socket.h"
+#include "core/ioservice_thread.h"
+#include <vector>
+
+
+namespace core {
+
+    // Several sockets bound to the same port with SO_REUSEPORT, each one served by its
+    // own io thread and owning its own connections. Kernel spreads peers among shards
+    // (one peer always lands on the same shard), so receive, ack processing and resends
+    // scale with cores. Group is meant for accepting side: connections are created for
+    // peers connecting to it (each shard checks its own handshake cookies, peer always gets
+    // back to the shard that challenged it), observers are invoked from all io threads.
+    // Each shard gives connection ids of its own; peer whose new address lands it on
+    // another shard can't prove it owns a connection there (tokens differ) and isn't followed.
+    class SmartSocketGroup : private boost::noncopyable
+    {
+    public:
+
+        SmartSocketGroup(size_t port, size_t shardCount, const SocketOptions& options = SocketOptions());
+
+        ~SmartSocketGroup();
+
+        size_t size() const { return m_sockets.size(); }
+
+        const SmartSocketPtr& shard(size_t index) const { return m_sockets[index]; }
+
+        // actual port shared by all shards (useful if group was created on port 0)
+        unsigned short port() const;
+
+        // return connection from any shard or nullptr
+        ConnectionPtr getExistingConnection(const udp::endpoint& remote);
+
+        // send packet to all connected peers of all shards
+        void sendEveryone(const PacketPtr& packet, size_t resendLimit = 0);
+        void sendEveryone(const PacketPtr& packet, Channel channel);
+
+        // end of application's tick for all peers of all shards
+        void flushEveryone();
+
+        void registerProtocolListener(uint16_t protocol, const ProtocolListenerPtr& listener);
+
+        void dispatchReceivedPackets();
+
+        // observer must be thread-safe, it is notified from io threads of all shards
+        void addObserver(const std::shared_ptr<ISocketStateObserver>& observer);
+
+        void removeObserver(const std::shared_ptr<ISocketStateObserver>& observer);
+
+    private:
+
+        // destroyed after io threads are stopped
+        std::vector<SmartSocketPtr> m_sockets;
+        std::vector<IOServiceThreadPtr> m_threads;
+    };
+
+}
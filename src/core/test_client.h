@@ -13,9 +13,9 @@ namespace core
     {
     public:
 
-        TestClient(IOServiceThread& ioThread, size_t port, size_t maxTicks)
+        TestClient(IOServiceThread& ioThread, size_t port, size_t maxTicks, const SocketOptions& options = SocketOptions())
         {
-            m_socket = std::make_shared<SmartSocket>(ioThread.getService(), port);
+            m_socket = std::make_shared<SmartSocket>(ioThread.getService(), port, options);
             ioThread.addResource(m_socket);
 
             m_socket->addObserver(std::make_shared<SocketStateLogger>());
@@ -51,7 +51,7 @@ namespace core
                     m_socket->dispatchReceivedPackets();
 
                     {
-                        auto packet = std::make_shared<Packet>(1);
+                        auto packet = makePacket(1);
                         m_conn->asyncSend(packet);
                     }
 
@@ -35,9 +35,9 @@ namespace core
     {
     public:
 
-        TestServer(IOServiceThread& ioThread, size_t port, size_t maxTicks)
+        TestServer(IOServiceThread& ioThread, size_t port, size_t maxTicks, const SocketOptions& options = SocketOptions())
         {
-            m_socket = std::make_shared<SmartSocket>(ioThread.getService(), port);
+            m_socket = std::make_shared<SmartSocket>(ioThread.getService(), port, options);
             ioThread.addResource(m_socket);
 
             m_socket->addObserver(std::make_shared<SocketStateLogger>());
@@ -69,16 +69,10 @@ namespace core
 
                     if (m_modP1->receivedCount > 0)
                     {
-                        auto packet = std::make_shared<Packet>(2);
+                        auto packet = makePacket(2);
                         m_socket->sendEveryone(packet);
                     }
 
-                    if (tick > 0 && tick % 10 == 0)
-                    {
-                        static const uint16_t cHeartBitProtocol = 3;
-                        m_socket->sendEveryone(std::make_shared<Packet>(cHeartBitProtocol));
-                    }
-
                     auto ts2 = system_clock::now();
                     auto work_duration = duration_cast<milliseconds>(ts2 - ts1);
 
@@ -87,6 +81,10 @@ namespace core
                     projectedTickStart += milliseconds(50);
                     std::this_thread::sleep_until(projectedTickStart);
                 }
+
+                auto poolStats = PacketPool::stats();
+                LogInfo() << "packet pool: hits" << poolStats.hits << "misses" << poolStats.misses
+                          << "oversized" << poolStats.oversized;
             }
             catch (const std::exception& ex)
             {
@@ -0,0 +1,86 @@
+#pragma once
+#include "core/smart_socket.h"
+#include "core/ioservice_thread.h"
+#include <boost/asio/buffers_iterator.hpp>
+
+
+namespace core
+{
+
+    using namespace std::chrono;
+
+
+    // Loopback benchmark of object transfer: one socket sends objects to another, with
+    // outgoing datagrams of both dropped at given rate, and throughput is logged.
+    class TestTransfer :
+        public IProtocolListener
+    {
+    public:
+
+        static const uint16_t cObjectProtocol = 10;
+
+        TestTransfer(IOServiceThread& ioThread, size_t port, size_t objectSize, size_t objectCount, double loss)
+          : m_received(0),
+            m_valid(true)
+        {
+            SocketOptions options;
+            options.emulatedLoss = loss;
+
+            m_receiver = std::make_shared<SmartSocket>(ioThread.getService(), port, options);
+            m_sender = std::make_shared<SmartSocket>(ioThread.getService(), port + 1, options);
+            ioThread.addResource(m_receiver);
+            ioThread.addResource(m_sender);
+            m_receiver->registerProtocolListener(cObjectProtocol, std::shared_ptr<IProtocolListener>(this, [](IProtocolListener*){}));
+
+            m_object = std::make_shared<std::vector<uint8_t>>(objectSize);
+            for (size_t i = 0; i < objectSize; ++i)
+                (*m_object)[i] = uint8_t(i * 31 + i / 977);
+
+            ConnectionPtr conn = m_sender->getOrCreateConnection(udp::endpoint(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(port)));
+
+            auto start = system_clock::now();
+            for (size_t i = 0; i < objectCount; ++i)
+                conn->sendObject(cObjectProtocol, m_object);
+
+            // listener runs on this thread, from dispatch
+            while (m_received < objectCount && !conn->isDead())
+            {
+                m_receiver->dispatchReceivedPackets();
+                std::this_thread::sleep_for(milliseconds(1));
+            }
+
+            const double seconds = duration<double>(system_clock::now() - start).count();
+            const double megabytes = double(objectSize) * m_received / (1024 * 1024);
+            m_throughput = megabytes / seconds;
+
+            LogInfo() << "transferred" << m_received << "objects of" << objectSize << "bytes with" << loss * 100 << "% loss in" << seconds << "s:"
+                      << m_throughput << "MB/s, intact" << m_valid << "resent" << conn->stats().resentPackets << "packets, final window"
+                      << conn->congestion().window();
+        }
+
+        // megabytes per second of delivered objects
+        double throughput() const { return m_throughput; }
+
+        bool intact() const { return m_valid; }
+
+    protected:
+
+        void receive(const IConnection&, const PacketPtr& packet) override
+        {
+            const Packet::ConstBuffers bytes = packet->constBuffers();
+            m_valid = m_valid && packet->payloadSize() == m_object->size()
+                && std::equal(m_object->begin(), m_object->end(), boost::asio::buffers_begin(bytes) + sizeof(PacketHeader));
+            ++m_received;
+        }
+
+    private:
+
+        SmartSocketPtr m_receiver;
+        SmartSocketPtr m_sender;
+        std::shared_ptr<std::vector<uint8_t>> m_object;
+        size_t m_received;
+        bool m_valid;
+        double m_throughput;
+    };
+
+}
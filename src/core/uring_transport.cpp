@@ -0,0 +1,427 @@
+#include "stdafx.h"
+#include "core/uring_transport.h"
+#include "core/smart_socket.h"
+#include "core/logger.h"
+#include <boost/asio/placeholders.hpp>
+#include <boost/bind.hpp>
+
+#ifdef NETBASE_HAS_IO_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+
+namespace core {
+
+    // receive buffers handed to kernel (power of two)
+    static const unsigned cRecvBufferCount = 512;
+
+    // receive buffer: recvmsg header, peer address, ancillary data, then datagram
+    static const size_t cRecvBufferHeadroom = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + sizeof(ControlBuffer);
+
+    static const uint16_t cBufferGroup = 0;
+
+    // user_data of completions
+    static const uint64_t cRecvUserData = ~uint64_t(0);
+
+
+    static std::runtime_error systemError(const char* what, int code)
+    {
+        return std::runtime_error(std::string(what) + ": " + std::strerror(code));
+    }
+
+    static int ringSetup(unsigned entries, io_uring_params* params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    static int ringEnter(int fd, unsigned toSubmit)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, nullptr, 0));
+    }
+
+    static int ringRegister(int fd, unsigned opcode, void* arg, unsigned args)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, args));
+    }
+
+
+    UringTransport::UringTransport(SmartSocket& owner, size_t depth)
+      : m_owner(owner),
+        m_socketFd(owner.rawSocket().native_handle()),
+        m_ringFd(-1),
+        m_sqRing(MAP_FAILED), m_sqRingSize(0),
+        m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+        m_sqLocalTail(0),
+        m_submitPending(false),
+        m_cqRing(MAP_FAILED), m_cqRingSize(0),
+        m_bufRing(static_cast<io_uring_buf_ring*>(MAP_FAILED)), m_bufRingSize(0),
+        m_datagramSize(owner.options().maxDatagramSize),
+        m_recvBufferSize(cRecvBufferHeadroom + m_datagramSize),
+        m_eventFd(-1),
+        m_eventDesc(*owner.getIOService())
+    {
+        setupRings(depth);
+        setupBufferRing();
+
+        m_eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventFd < 0 || ringRegister(m_ringFd, IORING_REGISTER_EVENTFD, &m_eventFd, 1) < 0)
+            throw systemError("io_uring eventfd", errno);
+        m_eventDesc.assign(m_eventFd);
+
+        LogInfo() << "io_uring transport with" << m_sqEntries << "entries is ready";
+    }
+
+    UringTransport::~UringTransport()
+    {
+        // closing ring cancels whatever is still in flight
+        if (m_ringFd >= 0)
+            ::close(m_ringFd);
+
+        if (m_bufRing != MAP_FAILED)
+            ::munmap(m_bufRing, m_bufRingSize);
+        if (m_sqes != MAP_FAILED)
+            ::munmap(m_sqes, m_sqEntries * sizeof(io_uring_sqe));
+        if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+            ::munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing != MAP_FAILED)
+            ::munmap(m_sqRing, m_sqRingSize);
+    }
+
+
+    void UringTransport::setupRings(size_t depth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        m_ringFd = ringSetup(static_cast<unsigned>(depth), &params);
+        if (m_ringFd < 0)
+            throw systemError("io_uring_setup", errno);
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+        m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED)
+            throw systemError("io_uring sq ring mmap", errno);
+
+        m_cqRing = singleMap ? m_sqRing :
+            ::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED)
+            throw systemError("io_uring cq ring mmap", errno);
+
+        m_sqEntries = params.sq_entries;
+        m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqEntries * sizeof(io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED)
+            throw systemError("io_uring sqes mmap", errno);
+
+        uint8_t* sq = static_cast<uint8_t*>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sqLocalTail = *m_sqTail;
+
+        uint8_t* cq = static_cast<uint8_t*>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+
+    void UringTransport::setupBufferRing()
+    {
+        m_bufRingSize = cRecvBufferCount * sizeof(io_uring_buf);
+        m_bufRing = static_cast<io_uring_buf_ring*>(::mmap(nullptr, m_bufRingSize,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (m_bufRing == MAP_FAILED)
+            throw systemError("io_uring buffer ring mmap", errno);
+
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(m_bufRing);
+        reg.ring_entries = cRecvBufferCount;
+        reg.bgid = cBufferGroup;
+        if (ringRegister(m_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            throw systemError("io_uring provided buffers", errno);
+
+        m_buffers.resize(cRecvBufferCount * m_recvBufferSize);
+        m_bufRing->tail = 0;
+        for (unsigned i = 0; i < cRecvBufferCount; ++i)
+            recycleBuffer(static_cast<uint16_t>(i));
+
+        // only sizes matter: kernel lays out address, ancillary data and datagram after recvmsg header
+        std::memset(&m_recvMsg, 0, sizeof(m_recvMsg));
+        m_recvMsg.msg_namelen = sizeof(sockaddr_storage);
+        m_recvMsg.msg_controllen = sizeof(ControlBuffer);
+    }
+
+
+    void UringTransport::recycleBuffer(uint16_t bufferId)
+    {
+        // ring entries are indexed by hand: in C++ an empty struct before flexible
+        // array in kernel header shifts 'bufs' off the layout kernel uses
+        uint16_t tail = m_bufRing->tail;
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(m_bufRing)[tail & (cRecvBufferCount - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(&m_buffers[bufferId * m_recvBufferSize]);
+        buf.len = static_cast<uint32_t>(m_recvBufferSize);
+        buf.bid = bufferId;
+        __atomic_store_n(&m_bufRing->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+    }
+
+
+    io_uring_sqe* UringTransport::nextSqe()
+    {
+        // submission queue is full: push what we have to kernel first
+        if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+            submit();
+
+        unsigned index = m_sqLocalTail & m_sqMask;
+        m_sqArray[index] = index;
+        ++m_sqLocalTail;
+
+        io_uring_sqe* sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+
+    void UringTransport::submit()
+    {
+        m_submitPending = false;
+
+        unsigned toSubmit = m_sqLocalTail - *m_sqTail;
+        if (toSubmit == 0)
+            return;
+
+        __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+        int rv = ringEnter(m_ringFd, toSubmit);
+        if (rv < 0)
+            LogError() << "io_uring_enter failed:" << std::strerror(errno);
+        ++m_owner.m_stats.sendCalls;
+    }
+
+
+    void UringTransport::scheduleSubmit()
+    {
+        // everything queued until posted handler runs goes to kernel in one syscall
+        if (!m_submitPending)
+        {
+            m_submitPending = true;
+            m_owner.getIOService()->post(makeArenaHandler(m_owner.m_handlerArena, boost::bind(&UringTransport::submit, this)));
+        }
+    }
+
+
+    void UringTransport::start()
+    {
+        armReceive();
+        submit();
+        waitCompletions();
+    }
+
+
+    void UringTransport::armReceive()
+    {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = m_socketFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_recvMsg);
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = cBufferGroup;
+        sqe->user_data = cRecvUserData;
+    }
+
+
+    void UringTransport::send(const PacketPtr& packet, const udp::endpoint& peer)
+    {
+        size_t slotIndex;
+        if (m_freeSlots.empty())
+        {
+            slotIndex = m_sendSlots.size();
+            m_sendSlots.push_back(SendSlot());
+        }
+        else
+        {
+            slotIndex = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+
+        // slot keeps packet and peer address alive until completion
+        SendSlot& slot = m_sendSlots[slotIndex];
+        slot.dgram = Datagram(packet, peer);
+
+        std::memset(&slot.msg, 0, sizeof(slot.msg));
+        slot.msg.msg_name = const_cast<void*>(static_cast<const void*>(slot.dgram.peer.data()));
+        slot.msg.msg_namelen = static_cast<socklen_t>(slot.dgram.peer.size());
+        slot.msg.msg_iov = slot.iov;
+
+        for (auto& buf : packet->constBuffers())
+        {
+            if (boost::asio::buffer_size(buf) == 0)
+                continue;
+            iovec& iov = slot.iov[slot.msg.msg_iovlen++];
+            iov.iov_base = const_cast<void*>(boost::asio::buffer_cast<const void*>(buf));
+            iov.iov_len = boost::asio::buffer_size(buf);
+        }
+
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = m_socketFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+        sqe->len = 1;
+        sqe->user_data = slotIndex;
+
+        ++m_owner.m_stats.sentDatagrams;
+        scheduleSubmit();
+    }
+
+
+    void UringTransport::waitCompletions()
+    {
+        m_eventDesc.async_read_some(boost::asio::null_buffers(), makeArenaHandler(m_owner.m_handlerArena,
+            boost::bind(&UringTransport::handleCompletions, this, boost::asio::placeholders::error)));
+    }
+
+
+    void UringTransport::handleCompletions(const boost::system::error_code& error)
+    {
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        uint64_t signalled = 0;
+        if (::read(m_eventFd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN)
+            LogError() << "io_uring eventfd read failed:" << std::strerror(errno);
+
+        ++m_owner.m_stats.recvCalls;
+
+        bool rearm = false;
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+            try
+            {
+                if (cqe.user_data == cRecvUserData)
+                {
+                    completeReceive(cqe);
+
+                    // multishot receive ends on errors and when buffers run out
+                    if (!(cqe.flags & IORING_CQE_F_MORE))
+                        rearm = true;
+                }
+                else
+                {
+                    completeSend(cqe);
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                LogError() << ex.what();
+            }
+            catch (...)
+            {
+                LogFatal() << "unknown exception" << cSourceLocation;
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+        if (rearm)
+        {
+            armReceive();
+            scheduleSubmit();
+        }
+        waitCompletions();
+    }
+
+
+    void UringTransport::completeReceive(const io_uring_cqe& cqe)
+    {
+        if (cqe.res < 0)
+        {
+            if (cqe.res != -ENOBUFS)
+                LogError() << "io_uring receive failed:" << std::strerror(-cqe.res);
+            return;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_BUFFER))
+            return;
+
+        uint16_t bufferId = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        const uint8_t* buffer = &m_buffers[bufferId * m_recvBufferSize];
+
+        io_uring_recvmsg_out out;
+        std::memcpy(&out, buffer, sizeof(out));
+
+        const uint8_t* name = buffer + sizeof(io_uring_recvmsg_out);
+        const uint8_t* control = name + m_recvMsg.msg_namelen;
+        const uint8_t* payload = control + m_recvMsg.msg_controllen;
+
+        // SO_RXQ_OVFL drop counter
+        msghdr controlMsg;
+        std::memset(&controlMsg, 0, sizeof(controlMsg));
+        controlMsg.msg_control = const_cast<uint8_t*>(control);
+        controlMsg.msg_controllen = out.controllen;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&controlMsg); cmsg; cmsg = CMSG_NXTHDR(&controlMsg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            {
+                uint32_t drops = 0;
+                std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                m_owner.m_stats.kernelDrops = drops;
+            }
+        }
+
+        udp::endpoint peer;
+        std::memcpy(peer.data(), name, std::min<size_t>(out.namelen, sizeof(sockaddr_storage)));
+        peer.resize(out.namelen);
+
+        size_t size = std::min<size_t>(out.payloadlen, m_datagramSize);
+        bool truncated = (out.flags & MSG_TRUNC) != 0;
+
+        // buffer ring memory is kernel's, datagram is copied out and buffer is returned at once
+        PacketPtr packet;
+        if (!truncated && size >= sizeof(PacketHeader))
+        {
+            packet = makePacket(Packet::ReceiveTag(), size);
+            std::memcpy(packet->buffer().data(), payload, size);
+            packet->buffer().resize(size);
+        }
+        recycleBuffer(bufferId);
+
+        if (packet)
+            m_owner.handleDatagram(packet, peer);
+        else
+            m_owner.notifyObservers(&ISocketStateObserver::onBadPacketSize, peer, size_t(out.payloadlen));
+    }
+
+
+    void UringTransport::completeSend(const io_uring_cqe& cqe)
+    {
+        size_t slotIndex = static_cast<size_t>(cqe.user_data);
+        Datagram dgram = std::move(m_sendSlots[slotIndex].dgram);
+        m_freeSlots.push_back(slotIndex);
+
+        if (cqe.res < 0)
+        {
+            boost::system::error_code error(-cqe.res, boost::asio::error::get_system_category());
+            m_owner.handleSend(dgram.packet, dgram.peer, error);
+        }
+    }
+
+}
+
+#endif
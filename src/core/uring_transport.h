@@ -0,0 +1,110 @@
+#pragma once
+#include "core/mmsg_io.h"
+#include <boost/asio/io_service.hpp>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+// multishot receive with provided buffer rings needs kernel headers 6.0+
+#ifdef IORING_RECV_MULTISHOT
+#define NETBASE_HAS_IO_URING
+#endif
+#endif
+
+
+#ifdef NETBASE_HAS_IO_URING
+
+namespace core {
+
+    class SmartSocket;
+
+
+    // Datagram transport on io_uring, driven from socket's io_service. One multishot
+    // recvmsg keeps receiving into a kernel-provided buffer ring, sends are queued as
+    // sendmsg entries and submitted in one io_uring_enter per handler batch. Completions
+    // are reaped when ring's eventfd fires, so io thread wakes up once per batch of
+    // completions instead of once per operation. Talks raw syscalls, no liburing needed.
+    class UringTransport : private boost::noncopyable
+    {
+    public:
+
+        UringTransport(SmartSocket& owner, size_t depth);
+
+        ~UringTransport();
+
+        // arm multishot receive and start waiting for completions
+        void start();
+
+        // [io-thread] queue sendmsg for datagram, submitted with the rest of the batch
+        void send(const PacketPtr& packet, const udp::endpoint& peer);
+
+    private:
+
+        struct SendSlot
+        {
+            Datagram dgram;
+            msghdr msg;
+            iovec iov[2];
+        };
+
+        void setupRings(size_t depth);
+        void setupBufferRing();
+
+        io_uring_sqe* nextSqe();
+        void submit();
+        void scheduleSubmit();
+
+        void armReceive();
+        void waitCompletions();
+        void handleCompletions(const boost::system::error_code& error);
+
+        void completeReceive(const io_uring_cqe& cqe);
+        void completeSend(const io_uring_cqe& cqe);
+
+        // give receive buffer back to kernel
+        void recycleBuffer(uint16_t bufferId);
+
+        SmartSocket& m_owner;
+        int m_socketFd;
+        int m_ringFd;
+
+        // submission queue
+        void* m_sqRing;
+        size_t m_sqRingSize;
+        unsigned* m_sqHead;
+        unsigned* m_sqTail;
+        unsigned* m_sqArray;
+        unsigned m_sqMask;
+        unsigned m_sqEntries;
+        io_uring_sqe* m_sqes;
+        unsigned m_sqLocalTail;
+        bool m_submitPending;
+
+        // completion queue
+        void* m_cqRing;
+        size_t m_cqRingSize;
+        unsigned* m_cqHead;
+        unsigned* m_cqTail;
+        unsigned m_cqMask;
+        io_uring_cqe* m_cqes;
+
+        // provided receive buffers
+        io_uring_buf_ring* m_bufRing;
+        size_t m_bufRingSize;
+        size_t m_datagramSize;
+        size_t m_recvBufferSize;
+        std::vector<uint8_t> m_buffers;
+        msghdr m_recvMsg;
+
+        // in-flight sends, slots are reused and never move
+        std::deque<SendSlot> m_sendSlots;
+        std::vector<size_t> m_freeSlots;
+
+        int m_eventFd;
+        boost::asio::posix::stream_descriptor m_eventDesc;
+    };
+
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// replaces global operator new/delete of test executable, include in one file only
+
+
+static std::atomic<size_t> g_heapAllocations(0);
+
+
+inline size_t heapAllocationCount()
+{
+    return g_heapAllocations.load();
+}
+
+
+void* operator new(size_t size)
+{
+    ++g_heapAllocations;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include "core/smart_socket.h"
+#include <boost/asio/io_service.hpp>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+// loopback address of socket bound to any address
+inline udp::endpoint loopbackAddress(core::SmartSocket& socket)
+{
+    return udp::endpoint(boost::asio::ip::address_v4::loopback(), socket.rawSocket().local_endpoint().port());
+}
+
+
+// Sits between client and server sockets of a test like a NAT: server sees client at
+// relay's outer address. Filter may drop datagrams either way, rebind() makes relay go
+// out from a new port. Test pumps relay itself, see runUntil.
+class TestRelay
+{
+public:
+
+    // datagram is dropped if filter returns true
+    typedef std::function<bool(const core::PacketHeader& header, bool toServer)> Filter;
+
+    TestRelay(boost::asio::io_service& io, const udp::endpoint& server)
+      : m_io(io),
+        m_server(server),
+        m_inner(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+        m_buffer(core::cMaxDatagramSize),
+        m_dropped(0)
+    {
+        m_inner.non_blocking(true);
+        rebind();
+    }
+
+    // address clients connect to
+    udp::endpoint address() const { return m_inner.local_endpoint(); }
+
+    // address server sees clients at
+    udp::endpoint outerAddress() const { return m_outer.back()->local_endpoint(); }
+
+    // go out from a new port, datagrams to the old one are lost silently
+    void rebind()
+    {
+        m_outer.emplace_back(new udp::socket(m_io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)));
+        m_outer.back()->non_blocking(true);
+    }
+
+    void setFilter(const Filter& filter) { m_filter = filter; }
+
+    size_t dropped() const { return m_dropped; }
+
+    // forward everything that is waiting, both ways
+    void pump()
+    {
+        udp::endpoint from;
+        boost::system::error_code error;
+        for (;;)
+        {
+            const size_t size = m_inner.receive_from(boost::asio::buffer(m_buffer), from, 0, error);
+            if (error)
+                break;
+            m_client = from;
+            forward(*m_outer.back(), m_server, size, true);
+        }
+        for (auto& outer : m_outer)
+        {
+            for (;;)
+            {
+                const size_t size = outer->receive_from(boost::asio::buffer(m_buffer), from, 0, error);
+                if (error)
+                    break;
+                if (outer == m_outer.back())
+                    forward(m_inner, m_client, size, false);
+            }
+        }
+    }
+
+private:
+
+    void forward(udp::socket& socket, const udp::endpoint& to, size_t size, bool toServer)
+    {
+        core::PacketHeader header;
+        if (size >= sizeof(header) && m_filter)
+        {
+            std::memcpy(&header, m_buffer.data(), sizeof(header));
+            if (m_filter(header, toServer))
+            {
+                ++m_dropped;
+                return;
+            }
+        }
+        boost::system::error_code error;
+        socket.send_to(boost::asio::buffer(m_buffer.data(), size), to, 0, error);
+    }
+
+    boost::asio::io_service& m_io;
+    udp::endpoint m_server;
+    udp::endpoint m_client;
+    udp::socket m_inner;
+    std::vector<std::unique_ptr<udp::socket>> m_outer;
+    std::vector<uint8_t> m_buffer;
+    Filter m_filter;
+    size_t m_dropped;
+};
+
+
+// run ready handlers of io_service and pump relay until done() holds, false on timeout
+template <class Pred>
+inline bool runUntil(boost::asio::io_service& io, TestRelay& relay, Pred done,
+                     std::chrono::milliseconds timeout = std::chrono::milliseconds(3000))
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+
+        io.reset();
+        io.poll();
+        relay.pump();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+}
+
+
+// run ready handlers of io_service until done() holds, false on timeout (sockets talk directly)
+template <class Pred>
+inline bool pollUntil(boost::asio::io_service& io, Pred done,
+                      std::chrono::milliseconds timeout = std::chrono::milliseconds(3000))
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+
+        io.reset();
+        io.poll();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+}
@@ -3,6 +3,7 @@
 #include "core/iconnection.h"
 #include "core/packet.h"
 #include <boost/optional.hpp>
+#include <vector>
 
 
 class TestConnection : public core::IConnection
@@ -12,7 +13,7 @@ public:
     TestConnection(const udp::endpoint& peer) : m_peer(peer)
     {}
     
-    const udp::endpoint& peer() const override
+    udp::endpoint peer() const override
     {
         return m_peer;
     }
@@ -45,4 +46,23 @@ public:
 private:
 
     boost::optional<core::PacketPtr> m_packet;
-};
\ No newline at end of file
+};
+
+class TestCollectingListener : public core::IProtocolListener
+{
+public:
+
+    void receive(const core::IConnection& conn, const core::PacketPtr& packet) override
+    {
+        m_packets.push_back(packet);
+    }
+
+    const std::vector<core::PacketPtr>& packets() const
+    {
+        return m_packets;
+    }
+
+private:
+
+    std::vector<core::PacketPtr> m_packets;
+};
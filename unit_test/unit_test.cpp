@@ -1,14 +1,39 @@
 #include "stdafx.h"
 #include "core/ack_utils.h"
 #include "core/concurrent_queue.h"
+#include "core/concurrent_hash_map.h"
+#include "core/id_slab.h"
+#include "core/handler_arena.h"
+#include "core/handshake.h"
+#include "core/rtt_estimator.h"
+#include "core/congestion_controller.h"
+#include "core/pacing_scheduler.h"
+#include "core/channel.h"
+#include "core/fair_queue.h"
+#include "core/object_transfer.h"
+#include "core/coalescer.h"
+#include "core/path_mtu.h"
+#include "core/mmsg_io.h"
+#include "core/smart_socket_group.h"
 
+#include "test_allocation_counter.h"
 #include "test_logger.h"
 #include "test_packet_dispatcher.h"
 #include "test_observable.h"
+#include "test_loopback.h"
 
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
 
 
 using namespace core;
@@ -28,6 +53,12 @@ BOOST_AUTO_TEST_CASE(ack_util_test)
     ack33.updateForSeqNum(2); BOOST_CHECK(ack33.ackBits() == 0x0007 && ack33.latestSeqNum() == 3); // bits = 00000111, ack = 3
     ack33.updateForSeqNum(7); BOOST_CHECK(ack33.ackBits() == 0x0078 && ack33.latestSeqNum() == 7); // bits = 01111000, ack = 7
     ack33.updateForSeqNum(6); BOOST_CHECK(ack33.ackBits() == 0x0079 && ack33.latestSeqNum() == 7); // bits = 01111001, ack = 7
+
+    // acked are 7, 6, 3, 2, 1, 0: holes at 5 and 4 are skipped by two later acks, 2 by three
+    BOOST_CHECK(ack33.countAckedAfter(7) == 0 && ack33.countAckedAfter(8) == 0);
+    BOOST_CHECK(ack33.countAckedAfter(5) == 2 && ack33.countAckedAfter(4) == 2);
+    BOOST_CHECK(ack33.countAckedAfter(2) == 3 && ack33.countAckedAfter(0) == 5);
+    BOOST_CHECK(ack33.countAckedAfter(65000) == 6);
     
     ack49_t ack49; // special case
     ack49.updateForSeqNum(1); BOOST_CHECK(ack49 == 0x00010001); // bits = 00000001, ack = 1
@@ -44,6 +75,33 @@ BOOST_AUTO_TEST_CASE(ack_util_test)
     const uint16_t expected[] = { 7, 6, 3, 2, 1, 0 };
     BOOST_CHECK(packets.size() == sizeof(expected) / sizeof(uint16_t));
     BOOST_CHECK(std::equal(packets.begin(), packets.end(), expected));
+
+    // wide ack: bits cross word boundaries, shift of more than a word keeps what's in window
+    ack257_t ack257;
+    for (uint16_t seqNum : { 0, 1, 63, 64, 65, 130, 200, 300 })
+        ack257.updateForSeqNum(seqNum);
+    ack257.updateForSeqNum(199);
+    BOOST_CHECK(ack257.latestSeqNum() == 300);
+
+    packets.clear();
+    ack257.forEachAckedSeqNum([&](uint16_t seqNum){
+        packets.push_back(seqNum);
+    });
+    const uint16_t expected257[] = { 300, 200, 199, 130, 65, 64, 63 };  // 1 is 299 behind, out of window
+    BOOST_CHECK(packets.size() == sizeof(expected257) / sizeof(uint16_t));
+    BOOST_CHECK(std::equal(packets.begin(), packets.end(), expected257));
+
+    BOOST_CHECK(ack257.countAckedAfter(201) == 1 && ack257.countAckedAfter(131) == 3);
+    BOOST_CHECK(ack257.countAckedAfter(66) == 4 && ack257.countAckedAfter(0) == 7);
+
+    ack129_t ack129;
+    ack129.updateForSeqNum(10);
+    ack129.updateForSeqNum(138);
+    BOOST_CHECK(ack129.countAckedAfter(9) == 2);
+    ack129.updateForSeqNum(139);   // 10 falls out of window
+    BOOST_CHECK(ack129.countAckedAfter(9) == 2 && ack129.ackBits().words[0] == 1);
+    ack129.updateForSeqNum(1000);
+    BOOST_CHECK(ack129.countAckedAfter(999) == 1);
 }
 
 
@@ -62,6 +120,34 @@ BOOST_AUTO_TEST_CASE(mpsc_queue_test)
 }
 
 
+BOOST_AUTO_TEST_CASE(mpsc_queue_pooled_nodes)
+{
+    mpsc_queue<PacketPtr, PoolAllocator<PacketPtr>> queue;
+    PacketPtr tmp;
+
+    auto pushAndPopAll = [&]
+    {
+        for (uint16_t i = 0; i < 100; ++i)
+            queue.push(makePacket(i));
+        for (uint16_t i = 0; i < 100; ++i)
+            BOOST_CHECK(queue.pop(tmp) && tmp->header().protocol == i);
+        BOOST_CHECK(!queue.pop(tmp));
+        tmp.reset();
+    };
+
+    // warm up thread cache, after that nodes must be recycled without going to the heap
+    pushAndPopAll();
+
+    auto before = PacketPool::stats();
+    pushAndPopAll();
+    auto after = PacketPool::stats();
+
+    // node, control block and byte buffer per packet
+    BOOST_CHECK(after.misses == before.misses);
+    BOOST_CHECK(after.hits - before.hits == 300);
+}
+
+
 BOOST_AUTO_TEST_CASE(mpmc_queue_test)
 {
     mpmc_queue<int> queue;
@@ -77,6 +163,1606 @@ BOOST_AUTO_TEST_CASE(mpmc_queue_test)
 }
 
 
+BOOST_AUTO_TEST_CASE(concurrent_hash_map)
+{
+    // identity hash on purpose: neighbour keys collide in neighbour slots
+    struct IdentityHash { size_t operator()(int key) const { return static_cast<size_t>(key); } };
+    ConcurrentHashMap<int, std::shared_ptr<int>, IdentityHash> map;
+    std::shared_ptr<int> tmp;
+
+    const int cCount = 100000;
+    for (int i = 0; i < cCount; ++i)
+        BOOST_CHECK(*map.find_or_insert(i, [&]{ return std::make_shared<int>(i); }) == i);
+    BOOST_CHECK(map.size() == cCount);
+
+    // existing value is returned, factory isn't called
+    BOOST_CHECK(*map.find_or_insert(7, []{ return std::make_shared<int>(-1); }) == 7);
+
+    size_t mismatches = 0;
+    for (int i = 0; i < cCount; ++i)
+        mismatches += !(map.find(i, tmp) && *tmp == i);
+    BOOST_CHECK(mismatches == 0);
+    BOOST_CHECK(!map.find(cCount, tmp));
+
+    // readers keep going while entries are removed and table is rebuilt
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> wrongValues(0);
+    std::thread reader([&]
+    {
+        std::shared_ptr<int> value;
+        while (!stop)
+        {
+            for (int i = 1; i < cCount; i += 97)
+                if (map.find(i, value) && *value != i)
+                    ++wrongValues;
+        }
+    });
+
+    map.remove_if([](const std::shared_ptr<int>& value){ return *value % 2 == 0; });
+    for (int i = cCount; i < 2 * cCount; ++i)
+        map.find_or_insert(i, [&]{ return std::make_shared<int>(i); });
+    map.remove_if([&](const std::shared_ptr<int>& value){ return *value >= cCount; });
+    stop = true;
+    reader.join();
+
+    BOOST_CHECK(wrongValues == 0);
+    BOOST_CHECK(map.size() == cCount / 2);
+    BOOST_CHECK(!map.find(2, tmp) && map.find(3, tmp) && *tmp == 3);
+
+    size_t visited = 0;
+    map.for_each_value([&](const std::shared_ptr<int>& value){ visited += *value % 2; });
+    BOOST_CHECK(visited == cCount / 2);
+
+    map.collect_garbage();
+
+    // retired memory is freed epoch by epoch: reader inside when it was unlinked holds it,
+    // reader that came after doesn't
+    std::atomic<int> parked(0);
+    auto park = [&](std::atomic<bool>& release)
+    {
+        return std::thread([&]
+        {
+            bool first = true;
+            map.for_each_value([&](const std::shared_ptr<int>&)
+            {
+                if (!first)
+                    return;
+                first = false;
+                ++parked;
+                while (!release)
+                    std::this_thread::yield();
+            });
+        });
+    };
+
+    BOOST_REQUIRE(map.find(3, tmp));
+    std::weak_ptr<int> removed = tmp;
+    tmp.reset();
+
+    std::atomic<bool> releaseEarlier(false), releaseLater(false);
+    std::thread earlier = park(releaseEarlier);
+    while (parked != 1)
+        std::this_thread::yield();
+    map.remove(3);
+    BOOST_CHECK(!removed.expired());
+
+    std::thread later = park(releaseLater);
+    while (parked != 2)
+        std::this_thread::yield();
+    releaseEarlier = true;
+    earlier.join();
+    map.collect_garbage();
+    BOOST_CHECK(removed.expired());
+
+    releaseLater = true;
+    later.join();
+}
+
+
+BOOST_AUTO_TEST_CASE(id_slab)
+{
+    IdSlab<int> slab;
+
+    const uint32_t id1 = slab.add(10);
+    const uint32_t id2 = slab.add(20);
+    BOOST_CHECK(id1 != 0 && id2 != 0 && id1 != id2);
+    BOOST_CHECK(!(id1 & cConnIdAssigned) && !(id2 & cConnIdAssigned));
+    BOOST_CHECK(slab.find(id1) && *slab.find(id1) == 10);
+    BOOST_CHECK(slab.find(id2) && *slab.find(id2) == 20);
+    BOOST_CHECK(!slab.find(0) && !slab.find(12345));
+
+    // freed slot is reused under a new generation, old id must not find new value
+    slab.remove(id1);
+    const uint32_t id3 = slab.add(30);
+    BOOST_CHECK(id3 != id1);
+    BOOST_CHECK((id3 & (IdSlab<int>::cMaxSize - 1)) == (id1 & (IdSlab<int>::cMaxSize - 1)));
+    BOOST_CHECK(!slab.find(id1));
+    BOOST_CHECK(slab.find(id3) && *slab.find(id3) == 30);
+    BOOST_CHECK(slab.size() == 2);
+
+    // removing stale id changes nothing
+    slab.remove(id1);
+    BOOST_CHECK(slab.find(id3) && slab.size() == 2);
+}
+
+
+BOOST_AUTO_TEST_CASE(handshake_cookie)
+{
+    // reference vector of SipHash-2-4: key 00..0f, message 00..0e
+    const uint64_t key[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+    uint8_t message[15];
+    for (uint8_t i = 0; i < sizeof(message); ++i)
+        message[i] = i;
+    BOOST_CHECK(sipHash24(key, message, sizeof(message)) == 0xa129ca6149be45e5ULL);
+
+    CookieJar jar(key[0], key[1]);
+    const auto address = boost::asio::ip::address_v4::loopback();
+    const udp::endpoint peer(address, 5000);
+    const auto now = system_clock::now();
+
+    const uint64_t cookie = jar.make(peer, now);
+    BOOST_CHECK(jar.check(peer, cookie, now));
+    BOOST_CHECK(!jar.check(udp::endpoint(address, 5001), cookie, now));
+    BOOST_CHECK(!CookieJar().check(peer, cookie, now));
+
+    // valid through the next lifetime, stale after that
+    const auto lifetime = std::chrono::seconds(CookieJar::cLifetimeSeconds);
+    BOOST_CHECK(jar.check(peer, cookie, now + lifetime));
+    BOOST_CHECK(!jar.check(peer, cookie, now + 2 * lifetime));
+
+    PacketPtr packet = makeControlPacket(cProtoChallenge, cookie);
+    BOOST_CHECK(isSystemProtocol(packet->header().protocol));
+    BOOST_CHECK(controlToken(*packet) == cookie);
+    BOOST_CHECK(controlToken(*makePacket(cProtoChallenge)) == 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(rtt_estimator)
+{
+    using std::chrono::microseconds;
+    using std::chrono::milliseconds;
+
+    RttEstimator rtt(milliseconds(20));
+    BOOST_CHECK(!rtt.hasSamples());
+
+    // first sample: srtt = R, rttvar = R / 2
+    rtt.addSample(milliseconds(20));
+    BOOST_CHECK(rtt.srtt() == milliseconds(20));
+    BOOST_CHECK(rtt.rttvar() == milliseconds(10));
+    BOOST_CHECK(rtt.rto() == milliseconds(20 + 40 + 20));
+
+    // steady link: variance decays, timeout approaches srtt + ack delay
+    for (int i = 0; i < 100; ++i)
+        rtt.addSample(milliseconds(20));
+    BOOST_CHECK(rtt.srtt() == milliseconds(20));
+    BOOST_CHECK(rtt.rttvar() < microseconds(10));
+    BOOST_CHECK(rtt.rto() >= milliseconds(41) && rtt.rto() < milliseconds(45));
+
+    // jitter raises variance and timeout
+    const auto steadyRto = rtt.rto();
+    rtt.addSample(milliseconds(60));
+    BOOST_CHECK(rtt.srtt() == milliseconds(25));
+    BOOST_CHECK(rtt.rto() > steadyRto);
+
+    // backoff doubles until capped, next sample restores it
+    const auto rto = rtt.rto();
+    rtt.backoff();
+    BOOST_CHECK(rtt.rto() == 2 * rto);
+    for (int i = 0; i < 20; ++i)
+        rtt.backoff();
+    BOOST_CHECK(rtt.rto() == std::chrono::seconds(2));
+    rtt.addSample(milliseconds(20));
+    BOOST_CHECK(rtt.rto() < milliseconds(100));
+}
+
+
+BOOST_AUTO_TEST_CASE(congestion_control)
+{
+    using std::chrono::microseconds;
+    using std::chrono::milliseconds;
+
+    const size_t mss = cBaseDatagramSize;
+    auto t = std::chrono::system_clock::now();
+
+    // slow start doubles window per window of acks
+    AimdCongestionControl aimd;
+    const size_t initial = aimd.window();
+    for (size_t acked = 0; acked < initial; acked += mss)
+        aimd.onPacketAcked(mss, milliseconds(20), t, t + milliseconds(20));
+    BOOST_CHECK(aimd.window() == 2 * initial);
+
+    // losses of one round trip halve window once
+    t += milliseconds(40);
+    aimd.onPacketLost(mss, t, t + milliseconds(20));
+    aimd.onPacketLost(mss, t, t + milliseconds(20));
+    BOOST_CHECK(aimd.window() == initial);
+    BOOST_CHECK(aimd.slowStartThreshold() == initial);
+
+    // congestion avoidance: about one datagram per window of acks
+    t += milliseconds(40);
+    for (size_t acked = 0; acked < initial; acked += mss)
+        aimd.onPacketAcked(mss, milliseconds(20), t, t + milliseconds(20));
+    BOOST_CHECK(aimd.window() > initial && aimd.window() <= initial + 2 * mss);
+
+    // timeout collapses window, acks of packets sent before it don't grow it back
+    aimd.onTimeout(t + milliseconds(30));
+    BOOST_CHECK(aimd.window() == 2 * mss);
+    aimd.onPacketAcked(mss, milliseconds(20), t, t + milliseconds(40));
+    BOOST_CHECK(aimd.window() == 2 * mss);
+
+    // delay-based: judges queue once per round by its best RTT
+    DelayCongestionControl delay;
+    t += milliseconds(100);
+    delay.onPacketAcked(mss, milliseconds(20), t, t);
+    BOOST_CHECK(delay.baseRtt() == milliseconds(20));
+
+    // queueing doubled RTT: slow start ends, window gives back what has queued
+    const size_t before = delay.window();
+    t += milliseconds(40);
+    delay.onPacketAcked(mss, milliseconds(40), t, t);
+    BOOST_CHECK(delay.window() < before);
+
+    // window shrinks a datagram per round while queue stays long
+    size_t window = delay.window();
+    for (int round = 0; round < 2; ++round)
+    {
+        t += milliseconds(250);
+        delay.onPacketAcked(mss, milliseconds(200), t, t);
+        BOOST_CHECK(delay.window() == window - mss);
+        window = delay.window();
+    }
+
+    // and grows a datagram per round when queue drains; slow ack inside the round
+    // (held by peer's delayed ack) doesn't count, its round is judged by the best one
+    t += milliseconds(250);
+    delay.onPacketAcked(mss, milliseconds(20), t, t);
+    delay.onPacketAcked(mss, milliseconds(35), t, t + milliseconds(1));
+    delay.onPacketAcked(mss, milliseconds(20), t, t + milliseconds(21));
+    BOOST_CHECK(delay.window() == window + 2 * mss);
+}
+
+
+BOOST_AUTO_TEST_CASE(pacer)
+{
+    using std::chrono::milliseconds;
+
+    const size_t mss = cBaseDatagramSize;
+    auto t = std::chrono::system_clock::now();
+
+    // idle pacer lets its burst allowance go at once, then nothing
+    Pacer pacer(2 * mss);
+    pacer.setRate(100 * mss);
+    pacer.refill(t);
+    BOOST_CHECK(pacer.canSend(mss));
+    pacer.consume(mss);
+    pacer.consume(mss);
+    BOOST_CHECK(!pacer.canSend(mss));
+
+    // next datagram is due after its size at given rate
+    BOOST_CHECK(pacer.readyTime(mss, t) == t + milliseconds(10));
+    pacer.refill(t + milliseconds(5));
+    BOOST_CHECK(!pacer.canSend(mss));
+    pacer.refill(t + milliseconds(10));
+    BOOST_CHECK(pacer.canSend(mss));
+
+    // long silence doesn't save up more than the allowance
+    pacer.refill(t + milliseconds(1000));
+    pacer.consume(2 * mss);
+    BOOST_CHECK(!pacer.canSend(1));
+
+    // datagram bigger than the allowance goes once it's full, and pacer owes the rest
+    BOOST_CHECK(pacer.readyTime(cMaxDatagramSize, t + milliseconds(1000)) == t + milliseconds(1020));
+    pacer.refill(t + milliseconds(1020));
+    BOOST_CHECK(pacer.canSend(cMaxDatagramSize));
+    pacer.consume(cMaxDatagramSize);
+    BOOST_CHECK(!pacer.canSend(1));
+
+    // without rate nothing is ever due
+    pacer.setRate(0);
+    BOOST_CHECK(pacer.readyTime(mss, t) == std::chrono::system_clock::time_point::max());
+}
+
+
+static PacketPtr makeMessage(uint16_t messageId)
+{
+    PacketPtr packet = makePacket(1);
+    packet->header().messageId = messageId;
+    return packet;
+}
+
+BOOST_AUTO_TEST_CASE(channels)
+{
+    // unordered: each message once, as it comes
+    InboundChannel unordered(ReliableUnorderedChannel);
+    BOOST_CHECK(unordered.receive(makeMessage(5)) == InboundChannel::Accepted);
+    BOOST_CHECK(unordered.next()->header().messageId == 5);
+    BOOST_CHECK(!unordered.next());
+    BOOST_CHECK(unordered.receive(makeMessage(3)) == InboundChannel::Accepted);
+    BOOST_CHECK(unordered.next());
+    BOOST_CHECK(unordered.receive(makeMessage(5)) == InboundChannel::Discarded);
+    BOOST_CHECK(unordered.receive(makeMessage(3)) == InboundChannel::Discarded);
+    BOOST_CHECK(unordered.receive(makeMessage(4)) == InboundChannel::Accepted);
+    BOOST_CHECK(unordered.receive(makeMessage(uint16_t(5 - InboundChannel::cWindow))) == InboundChannel::Discarded);
+
+    // window slides across wrap of messageId
+    BOOST_CHECK(unordered.receive(makeMessage(65535)) == InboundChannel::Accepted);
+    BOOST_CHECK(unordered.receive(makeMessage(2)) == InboundChannel::Accepted);
+    BOOST_CHECK(unordered.receive(makeMessage(65535)) == InboundChannel::Discarded);
+    BOOST_CHECK(unordered.receive(makeMessage(1)) == InboundChannel::Accepted);
+
+    // sequenced: only newer than the last one
+    InboundChannel sequenced(SequencedChannel);
+    BOOST_CHECK(sequenced.receive(makeMessage(10)) == InboundChannel::Accepted);
+    BOOST_CHECK(sequenced.receive(makeMessage(9)) == InboundChannel::Discarded);
+    BOOST_CHECK(sequenced.receive(makeMessage(10)) == InboundChannel::Discarded);
+    BOOST_CHECK(sequenced.receive(makeMessage(12)) == InboundChannel::Accepted);
+    BOOST_CHECK(sequenced.next()->header().messageId == 12);
+
+    // ordered: early messages wait for the gap, then go all together
+    InboundChannel ordered(ReliableOrderedChannel);
+    BOOST_CHECK(ordered.receive(makeMessage(1)) == InboundChannel::Accepted);
+    BOOST_CHECK(ordered.receive(makeMessage(2)) == InboundChannel::Accepted);
+    BOOST_CHECK(!ordered.next());
+    BOOST_CHECK(ordered.receive(makeMessage(2)) == InboundChannel::Discarded);
+    BOOST_CHECK(ordered.receive(makeMessage(InboundChannel::cWindow)) == InboundChannel::Refused);
+    BOOST_CHECK(ordered.receive(makeMessage(0)) == InboundChannel::Accepted);
+    for (uint16_t id = 0; id < 3; ++id)
+        BOOST_CHECK(ordered.next()->header().messageId == id);
+    BOOST_CHECK(!ordered.next());
+    BOOST_CHECK(ordered.receive(makeMessage(1)) == InboundChannel::Discarded);
+    BOOST_CHECK(ordered.receive(makeMessage(InboundChannel::cWindow)) == InboundChannel::Accepted);
+
+    // sending end: unacked ids span less than receiver's window
+    OutboundChannel outbound;
+    BOOST_CHECK(outbound.fits(InboundChannel::cWindow - 1) && !outbound.fits(InboundChannel::cWindow));
+    outbound.onAcked(1);
+    BOOST_CHECK(!outbound.fits(InboundChannel::cWindow));
+    outbound.onAcked(0);
+    BOOST_CHECK(outbound.fits(InboundChannel::cWindow + 1) && !outbound.fits(InboundChannel::cWindow + 2));
+    outbound.onAcked(0);
+    BOOST_CHECK(!outbound.fits(InboundChannel::cWindow + 2));
+}
+
+BOOST_AUTO_TEST_CASE(fair_queue)
+{
+    using std::chrono::milliseconds;
+
+    const size_t mss = cBaseDatagramSize;
+    auto t = std::chrono::system_clock::now();
+    auto packet = [&](size_t size) { PacketPtr p = makePacket(1); p->buffer().resize(size); return p; };
+
+    // backlogged classes share by weight: 4 normal packets per bulk one
+    FairQueue queue;
+    for (int i = 0; i < 50; ++i)
+    {
+        queue.push(OutboundPacket(packet(mss), 0, NormalTraffic));
+        queue.push(OutboundPacket(packet(mss), 0, BulkTraffic));
+    }
+    BOOST_CHECK(queue.bytes() == 100 * mss);
+    for (int i = 0; i < 50; ++i)
+    {
+        BOOST_REQUIRE(queue.next(t));
+        queue.pop();
+    }
+    BOOST_CHECK(queue.sentBytes(NormalTraffic) == 40 * mss);
+    BOOST_CHECK(queue.sentBytes(BulkTraffic) == 10 * mss);
+
+    // urgent packet doesn't wait behind bulk backlog
+    queue.push(OutboundPacket(packet(100), 0, UrgentTraffic));
+    const OutboundPacket* next = queue.next(t);
+    for (int i = 0; i < 5 && next->trafficClass != UrgentTraffic; ++i)
+    {
+        queue.pop();
+        next = queue.next(t);
+    }
+    BOOST_CHECK(next->trafficClass == UrgentTraffic);
+    BOOST_CHECK(queue.next(t) == next);
+    queue.pop();
+
+    // capped class goes at its rate, others aren't held by it
+    FairQueue capped;
+    capped.configure(BulkTraffic, 1, 10 * mss);
+    for (int i = 0; i < 10; ++i)
+        capped.push(OutboundPacket(packet(mss), 0, BulkTraffic));
+    size_t sent = 0;
+    while (capped.next(t))
+    {
+        capped.pop();
+        ++sent;
+    }
+    BOOST_CHECK(sent == 4);
+    BOOST_CHECK(capped.capReadyTime(t) == t + milliseconds(100));
+
+    capped.push(OutboundPacket(packet(mss), 0, NormalTraffic));
+    BOOST_REQUIRE(capped.next(t));
+    BOOST_CHECK(capped.pop().trafficClass == NormalTraffic);
+    BOOST_CHECK(capped.next(t + milliseconds(100)));
+
+    // latest-only packet that waited too long is dropped at its turn, even once selected
+    FairQueue expiring;
+    OutboundPacket stale(packet(100), 0, NormalTraffic);
+    stale.expiry = t + milliseconds(10);
+    expiring.push(stale);
+    expiring.push(OutboundPacket(packet(200), 0, NormalTraffic));
+    BOOST_CHECK(expiring.next(t)->packet->size() == 100);
+    BOOST_CHECK(expiring.next(t + milliseconds(10))->packet->size() == 200);
+    BOOST_CHECK(expiring.expiredPackets() == 1 && expiring.bytes() == 200);
+    expiring.pop();
+    BOOST_CHECK(expiring.empty());
+}
+
+// datagram as receiver gets it: own bytes and shared body in one buffer
+static PacketPtr flatten(const PacketPtr& packet)
+{
+    std::vector<uint8_t> bytes(packet->size());
+    boost::asio::buffer_copy(boost::asio::buffer(bytes), packet->constBuffers());
+    return makePacket(bytes.data(), bytes.size());
+}
+
+BOOST_AUTO_TEST_CASE(object_transfer)
+{
+    auto data = std::make_shared<std::vector<uint8_t>>(5 * cFragmentPayload + 10);
+    for (size_t i = 0; i < data->size(); ++i)
+        (*data)[i] = uint8_t(i * 7);
+
+    ObjectTransfer sender(0), receiver(1 << 20);
+    bool completed = false;
+    sender.start(42, ObjectSource(data, data->data(), data->size()), [&]{ completed = true; });
+
+    std::vector<PacketPtr> fragments;
+    BOOST_CHECK(sender.takeFragments(fragments) == 6);
+    BOOST_CHECK(sender.unsentBytes() == 0);
+    BOOST_CHECK(fragments[0]->size() == cBaseDatagramSize);
+
+    // any order, duplicates ignored, object comes with the last missing fragment
+    PacketPtr object;
+    for (size_t i = fragments.size(); i-- > 0; )
+    {
+        PacketPtr fragment = flatten(fragments[i]);
+        BOOST_CHECK(receiver.canAccept(*fragment));
+        BOOST_CHECK(!receiver.receive(*flatten(fragments[5])));
+        object = receiver.receive(*fragment);
+        BOOST_CHECK(!object == (i > 0));
+    }
+    BOOST_REQUIRE(object);
+    BOOST_CHECK(object->header().protocol == 42);
+    BOOST_CHECK(object->size() == sizeof(PacketHeader) + data->size());
+    BOOST_CHECK(std::equal(data->begin(), data->end(), object->buffer().begin() + sizeof(PacketHeader)));
+    BOOST_CHECK(receiver.reassemblyBytes() == 0);
+    BOOST_CHECK(!receiver.receive(*flatten(fragments[0])));
+
+    // sender completes when every fragment is acked
+    for (auto& fragment : fragments)
+    {
+        BOOST_CHECK(!completed);
+        sender.handleAcked(*fragment);
+    }
+    BOOST_CHECK(completed);
+    BOOST_CHECK(sender.stats().objectsSent == 1);
+
+    // window holds fragments in flight, acks slide it
+    auto big = std::make_shared<std::vector<uint8_t>>(300 * cFragmentPayload);
+    sender.start(1, ObjectSource(big, big->data(), big->size()), nullptr);
+    fragments.clear();
+    BOOST_CHECK(sender.takeFragments(fragments) == ObjectTransfer::cWindow);
+    BOOST_CHECK(sender.takeFragments(fragments) == 0);
+    sender.handleAcked(*fragments[0]);
+    BOOST_CHECK(sender.takeFragments(fragments) == 1);
+
+    // object beyond budget is refused, not started
+    ObjectTransfer small(2 * cFragmentPayload);
+    BOOST_CHECK(!small.canAccept(*flatten(fragments[0])));
+    BOOST_CHECK(small.stats().refusedFragments == 1);
+
+    // transfers started after datagram size grew fill bigger datagrams
+    ObjectTransfer wide(0), wideReceiver(1 << 20);
+    wide.setDatagramSize(1472);
+    wide.start(42, ObjectSource(data, data->data(), data->size()), nullptr);
+    fragments.clear();
+    BOOST_CHECK(wide.takeFragments(fragments) == 4);
+    BOOST_CHECK(fragments[0]->size() == 1472);
+    for (auto& fragment : fragments)
+        object = wideReceiver.receive(*flatten(fragment));
+    BOOST_REQUIRE(object);
+    BOOST_CHECK(std::equal(data->begin(), data->end(), object->buffer().begin() + sizeof(PacketHeader)));
+}
+
+BOOST_AUTO_TEST_CASE(file_transfer)
+{
+    std::vector<uint8_t> data(5 * cFragmentPayload + 10);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = uint8_t(i * 13);
+    std::ofstream("file_transfer.src", std::ios::binary).write(reinterpret_cast<const char*>(data.data()), data.size());
+    std::remove("file_transfer.dst");
+    std::remove("file_transfer.dst.part");
+
+    BOOST_CHECK(!ObjectTransfer::isValidFileName("../file"));
+    BOOST_CHECK(!ObjectTransfer::isValidFileName(""));
+
+    // offer goes first, fragments wait for receiver's answer
+    FileTransferStats sent;
+    std::vector<PacketPtr> fragments;
+    {
+        ObjectTransfer sender(0), receiver(1 << 20, ".");
+        sender.startFile(7, MappedFile::openRead("file_transfer.src"), "file_transfer.dst", [&](const FileTransferStats& s){ sent = s; });
+        BOOST_CHECK(sender.takeFragments(fragments) == 1);
+        BOOST_CHECK(fragments[0]->header().protocol == cProtoFileOffer);
+        BOOST_CHECK(!receiver.receive(*flatten(fragments[0])));
+        BOOST_CHECK(MappedFile::fileSize("file_transfer.dst") == int64_t(data.size()));
+
+        fragments.clear();
+        BOOST_CHECK(receiver.takeFragments(fragments) == 1);
+        BOOST_CHECK(!sender.receive(*flatten(fragments[0])));
+
+        // connection is lost after half of the file
+        fragments.clear();
+        BOOST_CHECK(sender.takeFragments(fragments) == 6);
+        for (size_t i = 0; i < 3; ++i)
+            BOOST_CHECK(!receiver.receive(*flatten(fragments[i])));
+    }
+    BOOST_CHECK(!sent.delivered);
+
+    // same file offered again: receiver answers with what it has, sender skips it; new
+    // connection has bigger datagrams, but fragments keep the size record was made with
+    ObjectTransfer sender(0), receiver(1 << 20, ".");
+    sender.setDatagramSize(1472);
+    sender.startFile(7, MappedFile::openRead("file_transfer.src"), "file_transfer.dst", [&](const FileTransferStats& s){ sent = s; });
+    fragments.clear();
+    sender.takeFragments(fragments);
+    BOOST_CHECK(!receiver.receive(*flatten(fragments[0])));
+    fragments.clear();
+    receiver.takeFragments(fragments);
+    BOOST_CHECK(!sender.receive(*flatten(fragments[0])));
+
+    fragments.clear();
+    BOOST_CHECK(sender.takeFragments(fragments) == 3);
+    PacketPtr report;
+    for (auto& fragment : fragments)
+        report = receiver.receive(*flatten(fragment));
+    BOOST_REQUIRE(report);
+    BOOST_CHECK(report->header().protocol == 7);
+
+    FileTransferStats received;
+    BOOST_REQUIRE(ObjectTransfer::parseFileReport(*report, received));
+    BOOST_CHECK(received.name == "file_transfer.dst");
+    BOOST_CHECK(received.path == "./file_transfer.dst");
+    BOOST_CHECK(received.size == data.size());
+    BOOST_CHECK(received.resumedBytes == 3 * cFragmentPayload);
+    BOOST_CHECK(MappedFile::fileSize("file_transfer.dst.part") == -1);
+
+    std::vector<uint8_t> copy(data.size());
+    std::ifstream("file_transfer.dst", std::ios::binary).read(reinterpret_cast<char*>(copy.data()), copy.size());
+    BOOST_CHECK(copy == data);
+
+    for (auto& fragment : fragments)
+        sender.handleAcked(*fragment);
+    BOOST_CHECK(sent.delivered);
+    BOOST_CHECK(sent.resumedBytes == 3 * cFragmentPayload);
+    BOOST_CHECK(sender.stats().filesSent == 1);
+
+    // receiver without directory refuses, sender learns it
+    ObjectTransfer another(0), refusing(1 << 20);
+    another.startFile(7, MappedFile::openRead("file_transfer.src"), "file_transfer.dst", [&](const FileTransferStats& s){ sent = s; });
+    fragments.clear();
+    another.takeFragments(fragments);
+    refusing.receive(*flatten(fragments[0]));
+    fragments.clear();
+    refusing.takeFragments(fragments);
+    another.receive(*flatten(fragments[0]));
+    BOOST_CHECK(!sent.delivered);
+    BOOST_CHECK(refusing.stats().refusedFiles == 1);
+
+    // and so does one that takes files only smaller than this one
+    ObjectTransfer big(0), limited(1 << 20, ".", data.size() - 1);
+    big.startFile(7, MappedFile::openRead("file_transfer.src"), "file_transfer.big", [&](const FileTransferStats& s){ sent = s; });
+    fragments.clear();
+    big.takeFragments(fragments);
+    limited.receive(*flatten(fragments[0]));
+    fragments.clear();
+    limited.takeFragments(fragments);
+    big.receive(*flatten(fragments[0]));
+    BOOST_CHECK(!sent.delivered);
+    BOOST_CHECK(limited.stats().refusedFiles == 1);
+    BOOST_CHECK(MappedFile::fileSize("file_transfer.big") == -1);
+
+    std::remove("file_transfer.src");
+    std::remove("file_transfer.dst");
+}
+
+static PacketPtr makeMessage(uint16_t protocol, size_t payload, Channel channel)
+{
+    PacketPtr packet = makePacket(protocol);
+    packet->header().channel = channel;
+    for (size_t i = 0; i < payload; ++i)
+        packet->buffer().push_back(uint8_t(protocol + i));
+    return packet;
+}
+
+BOOST_AUTO_TEST_CASE(coalescer)
+{
+    Coalescer coalescer(std::chrono::milliseconds(2));
+    const auto now = std::chrono::system_clock::now();
+    std::vector<OutboundPacket> out;
+
+    // small messages wait in bundle of their channel, big one closes it and goes alone
+    for (uint16_t protocol = 1; protocol <= 3; ++protocol)
+        coalescer.add(OutboundPacket(makeMessage(protocol, protocol * 10, UnreliableChannel), 0), now, out);
+    coalescer.add(OutboundPacket(makeMessage(4, 5, ReliableOrderedChannel), cUnlimitedResends), now, out);
+    BOOST_CHECK(out.empty());
+    BOOST_CHECK(coalescer.deadline() == now + std::chrono::milliseconds(2));
+
+    coalescer.add(OutboundPacket(makeMessage(5, Coalescer::cMaxBundledPayload + 1, UnreliableChannel), 0), now, out);
+    BOOST_REQUIRE(out.size() == 2);
+    BOOST_CHECK(out[0].packet->header().protocol == cProtoBundle);
+    BOOST_CHECK(out[0].packet->size() == sizeof(PacketHeader) + 3 * sizeof(BundledMessageHeader) + 60);
+    BOOST_CHECK(out[1].packet->header().protocol == 5);
+
+    // receiver gets them back as they were sent
+    std::vector<PacketPtr> messages;
+    BOOST_CHECK(coalescer.split(*out[0].packet, messages));
+    BOOST_REQUIRE(messages.size() == 3);
+    for (uint16_t protocol = 1; protocol <= 3; ++protocol)
+    {
+        const PacketPtr& message = messages[protocol - 1];
+        BOOST_CHECK(message->header().protocol == protocol);
+        BOOST_CHECK(message->header().channel == UnreliableChannel);
+        BOOST_CHECK(message->size() == sizeof(PacketHeader) + protocol * 10);
+        BOOST_CHECK(message->buffer().back() == uint8_t(protocol + protocol * 10 - 1));
+    }
+
+    // bundle of one is the message itself, it goes once its delay expires
+    out.clear();
+    coalescer.flushExpired(now + std::chrono::milliseconds(1), out);
+    BOOST_CHECK(out.empty());
+    coalescer.flushExpired(now + std::chrono::milliseconds(2), out);
+    BOOST_REQUIRE(out.size() == 1);
+    BOOST_CHECK(out[0].packet->header().protocol == 4);
+    BOOST_CHECK(out[0].resendLimit == cUnlimitedResends);
+    BOOST_CHECK(coalescer.deadline() == SCTimePoint::max());
+
+    // bundles never exceed datagram, and messages stay in order
+    out.clear();
+    for (uint16_t protocol = 1; protocol <= 20; ++protocol)
+        coalescer.add(OutboundPacket(makeMessage(protocol, 100, SequencedChannel), 0), now, out);
+    coalescer.flush(out);
+    BOOST_CHECK(out.size() == 3);
+
+    messages.clear();
+    for (auto& item : out)
+    {
+        BOOST_CHECK(item.packet->size() <= cBaseDatagramSize);
+        BOOST_CHECK(coalescer.split(*item.packet, messages));
+    }
+    BOOST_REQUIRE(messages.size() == 20);
+    for (uint16_t protocol = 1; protocol <= 20; ++protocol)
+        BOOST_CHECK(messages[protocol - 1]->header().protocol == protocol);
+    BOOST_CHECK(coalescer.stats().sentBundles == 4);
+    BOOST_CHECK(coalescer.stats().bundledMessages == 23);
+
+    // truncated bundle keeps messages before the cut
+    out[0].packet->buffer().resize(out[0].packet->size() - 1);
+    messages.clear();
+    BOOST_CHECK(!coalescer.split(*out[0].packet, messages));
+    BOOST_CHECK(messages.size() == 8);
+
+    // peer can't slip socket's or connection's own packets past their checks in a bundle
+    std::vector<OutboundPacket> forged;
+    for (uint16_t protocol = 6; protocol <= 8; ++protocol)
+        coalescer.add(OutboundPacket(makeMessage(protocol, 8, UnreliableChannel), 0), now, forged);
+    coalescer.flush(forged);
+    BOOST_REQUIRE(forged.size() == 1);
+    uint8_t* bundled = forged[0].packet->buffer().data() + sizeof(PacketHeader);
+    const uint16_t reserved[] = { cProtoHeartbeat, cProtoFragment };
+    for (uint16_t protocol : reserved)
+    {
+        std::memcpy(bundled, &protocol, sizeof(protocol));
+        bundled += sizeof(BundledMessageHeader) + 8;
+    }
+    messages.clear();
+    BOOST_CHECK(coalescer.split(*forged[0].packet, messages));
+    BOOST_REQUIRE(messages.size() == 1);
+    BOOST_CHECK(messages[0]->header().protocol == 8);
+    BOOST_CHECK(coalescer.stats().reservedMessages == 2);
+}
+
+BOOST_AUTO_TEST_CASE(path_mtu)
+{
+    const auto now = std::chrono::system_clock::now();
+
+    // probing is off when there's nothing above base to find
+    BOOST_CHECK(PathMtu(cBaseDatagramSize).nextProbeTime() == SCTimePoint::max());
+
+    // the biggest size goes first, then the search narrows down to what path carries
+    const size_t pathSize = 1400;
+    PathMtu mtu(1472);
+    BOOST_CHECK(mtu.current() == cBaseDatagramSize);
+    BOOST_CHECK(mtu.probeSize(now) == 1472);
+
+    size_t probes = 0;
+    while (const size_t probe = mtu.probeSize(now))
+    {
+        BOOST_REQUIRE(++probes < 100);
+        mtu.onProbeSent(probe);
+        BOOST_CHECK(mtu.probeSize(now) == 0);
+        if (probe <= pathSize)
+            BOOST_CHECK(mtu.onProbeAcked(probe, now));
+        else
+            mtu.onProbeLost(probe, now);
+    }
+    BOOST_CHECK(mtu.current() <= pathSize);
+    BOOST_CHECK(mtu.current() + PathMtu::cSearchGranularity >= pathSize);
+    BOOST_CHECK(mtu.nextProbeTime() == now + PathMtu::cRaiseInterval);
+
+    // big datagrams lost in a row, none acked in between: path became a black hole for them
+    for (size_t i = 1; i < PathMtu::cBlackHoleLosses; ++i)
+        BOOST_CHECK(!mtu.onPacketLost(1300, now));
+    mtu.onPacketAcked(1300);
+    for (size_t i = 1; i < PathMtu::cBlackHoleLosses; ++i)
+        BOOST_CHECK(!mtu.onPacketLost(1300, now));
+    BOOST_CHECK(!mtu.onPacketLost(cBaseDatagramSize, now));
+    BOOST_CHECK(mtu.onPacketLost(1300, now));
+    BOOST_CHECK(mtu.current() == cBaseDatagramSize);
+    BOOST_CHECK(mtu.nextProbeTime() == now + PathMtu::cResearchDelay);
+
+    // packet that doesn't fit goes in slices, put together whatever order they come in
+    PacketPtr big = makeMessage(9, 2500, ReliableOrderedChannel);
+    big->header().messageId = 77;
+    std::vector<PacketPtr> slices;
+    BOOST_REQUIRE(slicePacket(*big, 5, cBaseDatagramSize, slices));
+    BOOST_REQUIRE(slices.size() == 3);
+    for (auto& slice : slices)
+    {
+        BOOST_CHECK(slice->size() <= cBaseDatagramSize);
+        BOOST_CHECK(slice->header().protocol == cProtoSlice);
+        BOOST_CHECK(sliceIdOf(*slice) == 5);
+    }
+
+    SliceAssembler assembler;
+    BOOST_CHECK(!assembler.receive(*slices[2]));
+    BOOST_CHECK(!assembler.receive(*slices[0]));
+    BOOST_CHECK(!assembler.receive(*slices[0]));
+    PacketPtr whole = assembler.receive(*slices[1]);
+    BOOST_REQUIRE(whole);
+    BOOST_CHECK(whole->buffer() == big->buffer());
+    BOOST_CHECK(whole->header().channel == ReliableOrderedChannel);
+    BOOST_CHECK(whole->header().messageId == 77);
+    BOOST_CHECK(!assembler.receive(*slices[1]));
+
+    // shared payload is in the slices too
+    auto body = std::make_shared<std::vector<uint8_t>>(1500, uint8_t(3));
+    PacketPtr shared = makePacket(uint16_t(9), body, boost::asio::buffer(*body));
+    slices.clear();
+    BOOST_REQUIRE(slicePacket(*shared, 6, cBaseDatagramSize, slices));
+    for (auto& slice : slices)
+        whole = assembler.receive(*slice);
+    BOOST_REQUIRE(whole);
+    BOOST_CHECK(whole->size() == shared->size());
+    BOOST_CHECK(whole->buffer().back() == 3);
+
+    // count of slices fits into a byte
+    BOOST_CHECK(!slicePacket(*makeMessage(9, 255 * cBaseDatagramSize, UnreliableChannel), 7, cBaseDatagramSize, slices));
+}
+
+BOOST_AUTO_TEST_CASE(connection_rebind)
+{
+    using namespace boost::asio;
+    auto io = std::make_shared<io_service>();
+    SocketOptions options;
+    options.connectionIds = true;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0);
+    TestRelay relay(*io, loopbackAddress(*server));
+
+    ConnectionPtr conn = client->getOrCreateConnection(relay.address());
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->isEstablished(); }));
+    ConnectionPtr accepted = server->getExistingConnection(relay.outerAddress());
+    BOOST_REQUIRE(accepted && accepted->localId() != 0);
+
+    // stranger who guessed the id is challenged, and can't answer without connection's token
+    ip::udp::socket stranger(*io, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+    stranger.non_blocking(true);
+    PacketPtr forged = makeMessage(1, 8, UnreliableChannel);
+    forged->header().connId = accepted->localId();
+    stranger.send_to(buffer(forged->buffer()), loopbackAddress(*server));
+
+    std::vector<uint8_t> reply(cMaxDatagramSize);
+    size_t replySize = 0;
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{
+        boost::system::error_code error;
+        replySize = stranger.receive(buffer(reply), 0, error);
+        return !error;
+    }));
+    Packet challenge(reply.data(), replySize);
+    BOOST_CHECK(challenge.header().protocol == cProtoRebindChallenge);
+
+    const uint64_t rejected = server->stats().rejectedDatagrams;
+    stranger.send_to(buffer(makeRebindPacket(0x5eed, controlToken(challenge), accepted->localId())->buffer()), loopbackAddress(*server));
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return server->stats().rejectedDatagrams > rejected; }));
+    BOOST_CHECK(accepted->peer() == relay.outerAddress());
+
+    // client's NAT rebinds: server challenges new address, client answers, connection follows
+    relay.rebind();
+    conn->asyncSend(makeMessage(1, 8, UnreliableChannel));
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return accepted->peer() == relay.outerAddress(); }));
+    BOOST_CHECK(server->getExistingConnection(relay.outerAddress()) == accepted);
+
+    const uint64_t received = accepted->stats().receivedPackets;
+    conn->asyncSend(makeMessage(1, 8, UnreliableChannel));
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return accepted->stats().receivedPackets > received; }));
+}
+
+BOOST_AUTO_TEST_CASE(handshake_connect_size)
+{
+    using namespace boost::asio;
+    using namespace std::chrono;
+    auto io = std::make_shared<io_service>();
+    auto server = std::make_shared<SmartSocket>(io, 0);
+    udp::socket raw(*io, udp::endpoint(ip::address_v4::loopback(), 0));
+    raw.non_blocking(true);
+
+    // size of challenge that answers connect of given size, 0 if none comes
+    auto challengeSize = [&](size_t size) -> size_t
+    {
+        PacketPtr connect = makeControlPacket(cProtoConnect, 0);
+        connect->buffer().resize(size);
+        raw.send_to(buffer(connect->buffer()), loopbackAddress(*server));
+
+        std::vector<uint8_t> reply(cMaxDatagramSize);
+        const auto deadline = steady_clock::now() + milliseconds(200);
+        while (steady_clock::now() < deadline)
+        {
+            io->reset();
+            io->poll();
+            boost::system::error_code error;
+            const size_t received = raw.receive(buffer(reply), 0, error);
+            if (!error)
+                return received;
+            std::this_thread::sleep_for(microseconds(200));
+        }
+        return 0;
+    };
+
+    // bare header would get a bigger datagram back to whatever source it claims
+    BOOST_CHECK(challengeSize(sizeof(PacketHeader)) == 0);
+    BOOST_CHECK(server->stats().rejectedDatagrams == 1);
+    BOOST_CHECK(challengeSize(cControlPacketSize) == cControlPacketSize);
+}
+
+BOOST_AUTO_TEST_CASE(connection_timer)
+{
+    using namespace std::chrono;
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.connectionIds = true;
+    options.pathMtuDiscovery = false;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+    TestRelay relay(*io, loopbackAddress(*server));
+
+    // first data packet and the heartbeat that acks it, as relay sees them
+    uint16_t dataSeqNum = 0;
+    steady_clock::time_point dataTime, ackTime;
+    relay.setFilter([&](const PacketHeader& header, bool toServer)
+    {
+        if (toServer && header.protocol == 1 && dataTime == steady_clock::time_point())
+        {
+            dataSeqNum = header.seqNum;
+            dataTime = steady_clock::now();
+        }
+        if (!toServer && header.protocol == cProtoHeartbeat && dataTime != steady_clock::time_point()
+            && ackTime == steady_clock::time_point() && header.ack.latestSeqNum() == dataSeqNum)
+        {
+            ackTime = steady_clock::now();
+        }
+        return false;
+    });
+
+    ConnectionPtr conn = client->getOrCreateConnection(relay.address());
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->isEstablished(); }));
+    ConnectionPtr accepted = server->getExistingConnection(relay.outerAddress());
+    BOOST_REQUIRE(accepted);
+
+    // server has nothing to send: lone packet is acked by heartbeat after ack delay, long
+    // before keepalive would go
+    conn->asyncSend(makeMessage(1, 8, UnreliableChannel));
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->stats().confirmedPackets == 1; }));
+    const auto ackDelay = duration_cast<milliseconds>(ackTime - dataTime);
+    BOOST_CHECK(ackDelay >= milliseconds(15) && ackDelay < milliseconds(90));
+
+    // a pair of packets: bulk is acked as soon as the second one arrives, anything else
+    // still waits for data to ride on
+    auto pairAckDelay = [&](Channel channel)
+    {
+        std::map<uint16_t, steady_clock::time_point> arrivals;
+        milliseconds delay(-1);
+        relay.setFilter([&](const PacketHeader& header, bool toServer)
+        {
+            if (toServer && header.protocol == 1)
+                arrivals[header.seqNum] = steady_clock::now();
+            else if (!toServer && header.protocol == cProtoHeartbeat && arrivals.size() == 2
+                     && delay < milliseconds(0) && header.ack.latestSeqNum() == arrivals.rbegin()->first)
+                delay = duration_cast<milliseconds>(steady_clock::now() - arrivals.rbegin()->second);
+            return false;
+        });
+        std::vector<PacketPtr> messages;
+        messages.push_back(makeMessage(1, 8, channel));
+        messages.push_back(makeMessage(1, 8, channel));
+        conn->asyncSendMany(messages, channel);
+        runUntil(*io, relay, [&]{ return delay >= milliseconds(0); });
+        relay.setFilter(TestRelay::Filter());
+        return delay;
+    };
+    BOOST_CHECK(pairAckDelay(ReliableUnorderedChannel) < milliseconds(10));
+    BOOST_CHECK(pairAckDelay(ReliableOrderedChannel) >= milliseconds(10));
+    BOOST_CHECK(pairAckDelay(UnreliableChannel) >= milliseconds(10));
+
+    // one-way flow: client only sends heartbeats, and they carry it over its NAT rebind
+    relay.rebind();
+    BOOST_CHECK(runUntil(*io, relay, [&]{
+        accepted->asyncSend(makeMessage(1, 8, UnreliableChannel));
+        return accepted->peer() == relay.outerAddress();
+    }));
+
+    // idle connection is kept alive by keepalives alone
+    runUntil(*io, relay, []{ return false; }, milliseconds(1200));
+    BOOST_CHECK(!conn->isDead() && !accepted->isDead());
+    BOOST_CHECK(conn->stats().sentHeartbeats > 0 && accepted->stats().sentHeartbeats > 0);
+
+    // silent peer is dead after a few missed heartbeats, not before
+    relay.setFilter([](const PacketHeader&, bool){ return true; });
+    const auto silence = steady_clock::now();
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return conn->isDead() && accepted->isDead(); }));
+    BOOST_CHECK(steady_clock::now() - silence >= milliseconds(900));
+}
+
+BOOST_AUTO_TEST_CASE(connection_fast_retransmit)
+{
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+    TestRelay relay(*io, loopbackAddress(*server));
+
+    auto listener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, listener);
+    auto delivered = [&](size_t count)
+    {
+        server->dispatchReceivedPackets();
+        return listener->packets().size() == count;
+    };
+
+    // second data packet is lost; its resend gets a new seqNum and goes through
+    bool seen = false;
+    uint16_t lostSeqNum = 0;
+    relay.setFilter([&](const PacketHeader& header, bool toServer)
+    {
+        if (!toServer || header.protocol != 1)
+            return false;
+        if (!seen)
+        {
+            seen = true;
+            lostSeqNum = header.seqNum + 1;
+        }
+        return header.seqNum == lostSeqNum;
+    });
+
+    ConnectionPtr conn = client->getOrCreateConnection(relay.address());
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->isEstablished(); }));
+
+    // application's packets under reserved protocols never leave
+    conn->asyncSend(makeMessage(cInternalProtocolBase, 8, ReliableOrderedChannel), ReliableOrderedChannel);
+    conn->asyncSend(makeMessage(cProtoDisconnect, 8, UnreliableChannel));
+
+    std::vector<PacketPtr> messages;
+    for (uint16_t i = 0; i < 6; ++i)
+        messages.push_back(makeMessage(1, 8, ReliableOrderedChannel));
+    conn->asyncSendMany(messages, ReliableOrderedChannel);
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return delivered(6); }));
+    BOOST_CHECK(!conn->isDead() && conn->stats().sentPackets - conn->stats().resentPackets == 6);
+
+    // acks of later packets resend it once, well before its timeout
+    BOOST_CHECK(relay.dropped() == 1);
+    BOOST_CHECK(conn->stats().lostByFastRetransmit == 1);
+    BOOST_CHECK(conn->stats().resentPackets == 1);
+    BOOST_CHECK(conn->stats().lostByTimeout == 0);
+
+    // resend isn't examined again, however many acks follow
+    messages.clear();
+    for (uint16_t i = 0; i < 20; ++i)
+        messages.push_back(makeMessage(1, 8, ReliableOrderedChannel));
+    conn->asyncSendMany(messages, ReliableOrderedChannel);
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return delivered(26); }));
+    BOOST_CHECK(conn->stats().lostByFastRetransmit == 1);
+    BOOST_CHECK(conn->stats().resentPackets == 1);
+
+    // packet reused after a reliable send goes unreliable when sent with a resend limit
+    conn->asyncSendMany(std::vector<PacketPtr>(1, makeMessage(1, 8, ReliableOrderedChannel)), size_t(0));
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return delivered(27); }));
+    BOOST_CHECK(listener->packets().back()->header().channel == UnreliableChannel);
+}
+
+BOOST_AUTO_TEST_CASE(connection_reliable_window)
+{
+    using namespace std::chrono;
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+    TestRelay relay(*io, loopbackAddress(*server));
+
+    auto listener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, listener);
+    auto delivered = [&](size_t count)
+    {
+        server->dispatchReceivedPackets();
+        return listener->packets().size() == count;
+    };
+
+    // one message is lost for as long as the others keep going through: sender must not
+    // run further ahead of it than receiver remembers, or its resend would be taken for a duplicate
+    const uint16_t cLost = 5;
+    const size_t cCount = InboundChannel::cWindow + 100;
+    std::set<uint16_t> others;
+    auto lastNew = steady_clock::now();
+    relay.setFilter([&](const PacketHeader& header, bool toServer)
+    {
+        if (!toServer || header.protocol != 1)
+            return false;
+        if (header.messageId != cLost)
+        {
+            if (others.insert(header.messageId).second)
+                lastNew = steady_clock::now();
+            return false;
+        }
+        return others.size() < cCount - 1 && steady_clock::now() - lastNew < milliseconds(200);
+    });
+
+    ConnectionPtr conn = client->getOrCreateConnection(relay.address());
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->isEstablished(); }));
+
+    std::vector<PacketPtr> messages;
+    for (size_t i = 0; i < cCount; ++i)
+        messages.push_back(makeMessage(1, 8, ReliableUnorderedChannel));
+    conn->asyncSendMany(messages, ReliableUnorderedChannel);
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return delivered(cCount); }, milliseconds(10000)));
+    BOOST_CHECK(relay.dropped() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(connection_sliced_reliable)
+{
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+    TestRelay relay(*io, loopbackAddress(*server));
+
+    auto listener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, listener);
+    auto delivered = [&](size_t count)
+    {
+        server->dispatchReceivedPackets();
+        return listener->packets().size() == count;
+    };
+
+    ConnectionPtr conn = client->getOrCreateConnection(relay.address());
+    BOOST_REQUIRE(runUntil(*io, relay, [&]{ return conn->isEstablished(); }));
+
+    // messages bigger than datagram go in slices; the last acked slice acks the message,
+    // so the channel's window keeps sliding past the first cWindow of them
+    const size_t cCount = InboundChannel::cWindow + 100;
+    std::vector<PacketPtr> messages;
+    for (size_t i = 0; i < cCount; ++i)
+        messages.push_back(makeMessage(1, 2 * cBaseDatagramSize, ReliableOrderedChannel));
+    conn->asyncSendMany(messages, ReliableOrderedChannel);
+    BOOST_CHECK(runUntil(*io, relay, [&]{ return delivered(cCount); }, std::chrono::milliseconds(20000)));
+    BOOST_CHECK(conn->stats().slicedPackets >= cCount);
+}
+
+BOOST_AUTO_TEST_CASE(packet_pool)
+{
+    BOOST_CHECK(PacketPool::blockSize(1) == PacketPool::cMinBlockSize);
+    BOOST_CHECK(PacketPool::blockSize(1024) == 1024);
+    BOOST_CHECK(PacketPool::blockSize(1025) == 2048);
+    BOOST_CHECK(PacketPool::blockSize(1 << 20) == 0);
+
+    // warm up thread cache, after that packets must be recycled without going to the heap
+    makePacket(1);
+    auto before = PacketPool::stats();
+    for (int i = 0; i < 100; ++i)
+    {
+        PacketPtr packet = makePacket(1);
+        BOOST_CHECK(packet->buffer().capacity() >= cBaseDatagramSize);
+    }
+    auto after = PacketPool::stats();
+
+    // control block and byte buffer per packet
+    BOOST_CHECK(after.misses == before.misses);
+    BOOST_CHECK(after.hits - before.hits == 200);
+
+    // counters are kept per thread, those of a finished thread still count
+    std::thread([]{ PacketPool::deallocate(PacketPool::allocate(1 << 20), 1 << 20); }).join();
+    BOOST_CHECK(PacketPool::stats().oversized == after.oversized + 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(packet_receive_buffer)
+{
+    PacketPtr packet = makePacket(Packet::ReceiveTag(), cBaseDatagramSize);
+    BOOST_CHECK(packet->buffer().size() == cBaseDatagramSize);
+
+    // shrinking to received size must keep the very same memory
+    const uint8_t* data = packet->buffer().data();
+    packet->buffer().resize(sizeof(PacketHeader) + 4);
+    BOOST_CHECK(packet->buffer().data() == data);
+    BOOST_CHECK(packet->buffer().size() == sizeof(PacketHeader) + 4);
+}
+
+
+BOOST_AUTO_TEST_CASE(packet_shared_payload)
+{
+    PacketPtr source = makePacket(7);
+    source->buffer().resize(sizeof(PacketHeader) + 100, 0xab);
+
+    PacketPtr copy1 = makePacket(source, Packet::ShareTag());
+    PacketPtr copy2 = makePacket(copy1, Packet::ShareTag());
+    copy1->header().seqNum = 1;
+    copy2->header().seqNum = 2;
+
+    // every copy owns its header, but payload is the same memory
+    BOOST_CHECK(source->header().seqNum == 0 && copy1->header().protocol == 7);
+    BOOST_CHECK(copy1->buffer().size() == sizeof(PacketHeader));
+    BOOST_CHECK(copy1->size() == source->size() && copy2->size() == source->size());
+
+    auto buffers = copy2->constBuffers();
+    BOOST_CHECK(boost::asio::buffer_cast<const uint8_t*>(buffers[1]) == source->buffer().data() + sizeof(PacketHeader));
+    BOOST_CHECK(boost::asio::buffer_size(buffers[1]) == 100);
+    BOOST_CHECK(boost::asio::buffer_size(source->constBuffers()[1]) == 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(packet_segments)
+{
+    // segments of one received message share its buffer, nothing but headers is copied
+    PacketPtr message = makePacket(Packet::ReceiveTag(), 3 * 100);
+    for (size_t i = 0; i < 3; ++i)
+    {
+        PacketHeader header = {};
+        header.protocol = 1;
+        header.messageId = uint16_t(i);
+        std::memcpy(message->buffer().data() + i * 100, &header, sizeof(header));
+        std::memset(message->buffer().data() + i * 100 + sizeof(header), int(i + 1), 100 - sizeof(header));
+    }
+
+    std::vector<PacketPtr> segments;
+    for (size_t i = 0; i < 3; ++i)
+        segments.push_back(makePacket(Packet::SegmentTag(), message, i * 100, i < 2 ? 100 : 60));
+    const uint8_t* body = message->buffer().data();
+    message.reset();
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        const PacketPtr& segment = segments[i];
+        BOOST_CHECK(segment->header().messageId == i);
+        BOOST_CHECK(segment->buffer().size() == sizeof(PacketHeader));
+        BOOST_CHECK(boost::asio::buffer_cast<const uint8_t*>(segment->constBuffers()[1]) == body + i * 100 + sizeof(PacketHeader));
+        BOOST_CHECK(segment->size() == (i < 2 ? 100 : 60));
+
+        std::vector<uint8_t> payload(segment->payloadSize());
+        BOOST_CHECK(segment->copyPayload(0, payload.data(), payload.size()) == segment->size() - sizeof(PacketHeader));
+        BOOST_CHECK(std::all_of(payload.begin(), payload.end(), [&](uint8_t b){ return b == i + 1; }));
+        BOOST_CHECK(segment->copyPayload(payload.size() - 4, payload.data(), 100) == 4);
+    }
+
+    // shorter than header: nothing to share
+    PacketPtr tiny = makePacket(Packet::ReceiveTag(), 10);
+    PacketPtr piece = makePacket(Packet::SegmentTag(), tiny, 0, 10);
+    BOOST_CHECK(piece->size() == 10);
+    BOOST_CHECK(piece->payloadSize() == 0);
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(mmsg_receive_ownership)
+{
+    using namespace boost::asio;
+    io_service io;
+    udp::socket rx(io, udp::endpoint(ip::address_v4::loopback(), 0));
+    udp::socket tx(io, udp::endpoint(ip::address_v4::loopback(), 0));
+    MMsgReceiver receiver(4, false, cBaseDatagramSize);
+
+    auto receiveOne = [&](uint8_t fill) -> size_t
+    {
+        std::vector<uint8_t> bytes(sizeof(PacketHeader) + 100, fill);
+        tx.send_to(buffer(bytes), rx.local_endpoint());
+
+        boost::system::error_code error;
+        size_t count = 0;
+        for (int i = 0; i < 100 && !count; ++i)
+        {
+            count = receiver.receive(rx.native_handle(), error);
+            if (!count)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return count;
+    };
+
+    // packet taken from a batch, as socket takes it for its connection, stays intact
+    BOOST_REQUIRE(receiveOne(0xaa) == 1);
+    PacketPtr first = std::move(receiver.datagram(0).packet);
+    BOOST_REQUIRE(receiveOne(0xbb) == 1);
+
+    BOOST_CHECK(receiver.datagram(0).packet != first);
+    BOOST_CHECK(first->buffer().size() == sizeof(PacketHeader) + 100);
+    BOOST_CHECK(std::all_of(first->buffer().begin(), first->buffer().end(), [](uint8_t b){ return b == 0xaa; }));
+    BOOST_CHECK(receiver.datagram(0).packet->buffer().back() == 0xbb);
+}
+
+BOOST_AUTO_TEST_CASE(mmsg_coalesced_receive)
+{
+    using namespace boost::asio;
+    io_service io;
+    udp::socket rx(io, udp::endpoint(ip::address_v4::loopback(), 0));
+    udp::socket tx(io, udp::endpoint(ip::address_v4::loopback(), 0));
+
+    int enable = 1;
+    if (::setsockopt(rx.native_handle(), SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+    {
+        BOOST_TEST_MESSAGE("UDP_GRO is not supported by kernel, skipped");
+        return;
+    }
+
+    // same-sized datagrams to one peer go as one offloaded message (or one by one, if
+    // device can't), receiver gets them split back whatever kernel coalesced on its side
+    const size_t cSize = 1000;
+    auto sendBurst = [&](size_t count, uint8_t fill) -> size_t
+    {
+        MMsgSender sender(4, true);
+        DatagramQueue queue;
+        for (size_t i = 0; i < count; ++i)
+        {
+            PacketPtr packet = makePacket(1);
+            packet->header().messageId = uint16_t(i);
+            packet->buffer().resize(cSize, uint8_t(fill + i));
+            queue.push_back(Datagram(packet, rx.local_endpoint()));
+        }
+        boost::system::error_code error;
+        while (!queue.empty())
+        {
+            size_t sent = sender.send(tx.native_handle(), queue, error);
+            if (!sent)
+                break;
+            queue.erase(queue.begin(), queue.begin() + sent);
+        }
+        return count - queue.size();
+    };
+
+    MMsgReceiver receiver(4, true, cBaseDatagramSize);
+    auto receiveAll = [&](size_t count)
+    {
+        std::vector<PacketPtr> packets;
+        boost::system::error_code error;
+        for (int i = 0; i < 100 && packets.size() < count; ++i)
+        {
+            size_t received = receiver.receive(rx.native_handle(), error);
+            for (size_t d = 0; d < received; ++d)
+            {
+                BOOST_CHECK(!receiver.truncated(d));
+                packets.push_back(std::move(receiver.datagram(d).packet));
+            }
+            if (!received)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return packets;
+    };
+
+    auto intact = [&](const std::vector<PacketPtr>& packets, uint8_t fill)
+    {
+        for (size_t i = 0; i < packets.size(); ++i)
+        {
+            const PacketPtr& packet = packets[i];
+            const uint8_t expected = uint8_t(fill + packet->header().messageId);
+            std::vector<uint8_t> payload(packet->payloadSize());
+            packet->copyPayload(0, payload.data(), payload.size());
+            if (packet->size() != cSize || packet->header().messageId != i
+                || !std::all_of(payload.begin(), payload.end(), [&](uint8_t b){ return b == expected; }))
+                return false;
+        }
+        return true;
+    };
+
+    const size_t cCount = 32;
+    BOOST_REQUIRE(sendBurst(cCount, 0x10) == cCount);
+    std::vector<PacketPtr> first = receiveAll(cCount);
+    BOOST_REQUIRE(first.size() == cCount);
+    BOOST_CHECK(intact(first, 0x10));
+
+    // segments taken away keep their message alive, next receive doesn't write into it
+    BOOST_REQUIRE(sendBurst(cCount, 0x80) == cCount);
+    std::vector<PacketPtr> second = receiveAll(cCount);
+    BOOST_REQUIRE(second.size() == cCount);
+    BOOST_CHECK(intact(second, 0x80));
+    BOOST_CHECK(intact(first, 0x10));
+
+    size_t shared = 0;
+    for (const PacketPtr& packet : first)
+        shared += packet->buffer().size() == sizeof(PacketHeader);
+    BOOST_TEST_MESSAGE(shared << " of " << cCount << " datagrams came as segments of coalesced messages");
+}
+
+BOOST_AUTO_TEST_CASE(socket_segmentation_offload)
+{
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    options.batchedIO = true;
+    options.segmentationOffload = true;
+    options.pacing = false;
+    options.congestionControl = SocketOptions::NoCongestion;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+
+    auto listener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, listener);
+
+    ConnectionPtr conn = client->getOrCreateConnection(loopbackAddress(*server));
+    BOOST_REQUIRE(pollUntil(*io, [&]{ return conn->isEstablished(); }));
+
+    // same-sized messages go out in offloaded runs, and whatever kernel coalesces on
+    // receive reaches listener as separate packets that share message buffers
+    const size_t cCount = 200;
+    std::vector<PacketPtr> messages;
+    for (size_t i = 0; i < cCount; ++i)
+        messages.push_back(makeMessage(1, 900, ReliableUnorderedChannel));
+    conn->asyncSendMany(messages, ReliableUnorderedChannel);
+    BOOST_CHECK(pollUntil(*io, [&]
+    {
+        server->dispatchReceivedPackets();
+        return listener->packets().size() == cCount;
+    }, std::chrono::milliseconds(10000)));
+
+    const PacketPtr expected = makeMessage(1, 900, ReliableUnorderedChannel);
+    size_t intact = 0, shared = 0;
+    for (const PacketPtr& packet : listener->packets())
+    {
+        std::vector<uint8_t> payload(packet->payloadSize());
+        packet->copyPayload(0, payload.data(), payload.size());
+        intact += packet->size() == expected->size()
+            && std::equal(payload.begin(), payload.end(), expected->buffer().begin() + sizeof(PacketHeader));
+        shared += packet->buffer().size() == sizeof(PacketHeader);
+    }
+    BOOST_CHECK(intact == cCount);
+    BOOST_TEST_MESSAGE(shared << " of " << cCount << " messages came as segments of coalesced receives");
+}
+
+// received message has the bytes that makeMessage put into the one sent
+static bool intactMessage(const PacketPtr& packet, uint16_t protocol, Channel channel)
+{
+    const PacketPtr expected = makeMessage(protocol, packet->payloadSize(), channel);
+    std::vector<uint8_t> payload(packet->payloadSize());
+    packet->copyPayload(0, payload.data(), payload.size());
+    return packet->header().protocol == protocol
+        && std::equal(payload.begin(), payload.end(), expected->buffer().begin() + sizeof(PacketHeader));
+}
+
+BOOST_AUTO_TEST_CASE(socket_uring_backend)
+{
+    auto io = std::make_shared<boost::asio::io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    options.backend = SocketOptions::IoUringBackend;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+
+    // without io_uring sockets fall back to asio and must work all the same
+    if (server->options().backend != SocketOptions::IoUringBackend)
+        BOOST_TEST_MESSAGE("io_uring is not available, testing asio fallback");
+
+    auto serverListener = std::make_shared<TestCollectingListener>();
+    auto clientListener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, serverListener);
+    client->registerProtocolListener(2, clientListener);
+
+    ConnectionPtr conn = client->getOrCreateConnection(loopbackAddress(*server));
+    BOOST_REQUIRE(pollUntil(*io, [&]{ return conn->isEstablished(); }));
+
+    // messages of different sizes go both ways, each is received into a buffer of its own
+    // that later receives from the ring don't touch
+    const size_t cCount = 100;
+    std::vector<PacketPtr> requests;
+    for (size_t i = 0; i < cCount; ++i)
+        requests.push_back(makeMessage(1, 10 + i, ReliableUnorderedChannel));
+    conn->asyncSendMany(requests, ReliableUnorderedChannel);
+    BOOST_REQUIRE(pollUntil(*io, [&]
+    {
+        server->dispatchReceivedPackets();
+        return serverListener->packets().size() == cCount;
+    }));
+
+    ConnectionPtr back = server->getExistingConnection(loopbackAddress(*client));
+    BOOST_REQUIRE(back);
+    std::vector<PacketPtr> replies;
+    for (size_t i = 0; i < cCount; ++i)
+        replies.push_back(makeMessage(2, 10 + i, ReliableUnorderedChannel));
+    back->asyncSendMany(replies, ReliableUnorderedChannel);
+    BOOST_CHECK(pollUntil(*io, [&]
+    {
+        client->dispatchReceivedPackets();
+        return clientListener->packets().size() == cCount;
+    }));
+
+    std::set<size_t> sizes;
+    std::set<const uint8_t*> buffers;
+    for (const PacketPtr& packet : serverListener->packets())
+    {
+        BOOST_CHECK(intactMessage(packet, 1, ReliableUnorderedChannel));
+        sizes.insert(packet->size());
+        buffers.insert(packet->buffer().data());
+    }
+    BOOST_CHECK(sizes.size() == cCount);
+    BOOST_CHECK(buffers.size() == cCount);
+    for (const PacketPtr& packet : clientListener->packets())
+        BOOST_CHECK(intactMessage(packet, 2, ReliableUnorderedChannel));
+}
+
+BOOST_AUTO_TEST_CASE(socket_receive_depth)
+{
+    using namespace boost::asio;
+    auto io = std::make_shared<io_service>();
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    options.recvDepth = 4;
+    auto server = std::make_shared<SmartSocket>(io, 0, options);
+    auto client = std::make_shared<SmartSocket>(io, 0, options);
+
+    auto listener = std::make_shared<TestCollectingListener>();
+    server->registerProtocolListener(1, listener);
+
+    ConnectionPtr conn = client->getOrCreateConnection(loopbackAddress(*server));
+    BOOST_REQUIRE(pollUntil(*io, [&]{ return conn->isEstablished(); }));
+
+    // every outstanding receive has a buffer of its own, datagram keeps it when it's taken
+    const size_t cCount = 100;
+    std::vector<PacketPtr> messages;
+    for (size_t i = 0; i < cCount; ++i)
+        messages.push_back(makeMessage(1, 10 + i, ReliableUnorderedChannel));
+    conn->asyncSendMany(messages, ReliableUnorderedChannel);
+    BOOST_CHECK(pollUntil(*io, [&]
+    {
+        server->dispatchReceivedPackets();
+        return listener->packets().size() == cCount;
+    }));
+
+    std::set<const uint8_t*> buffers;
+    for (const PacketPtr& packet : listener->packets())
+    {
+        BOOST_CHECK(intactMessage(packet, 1, ReliableUnorderedChannel));
+        buffers.insert(packet->buffer().data());
+    }
+    BOOST_CHECK(buffers.size() == cCount);
+
+#ifdef SO_MEMINFO
+    // datagrams that don't fit into a small receive queue while nobody reads it are
+    // counted by kernel, housekeeping picks the counter up
+    SocketOptions small = options;
+    small.recvBufferSize = 4096;
+    auto flooded = std::make_shared<SmartSocket>(io, 0, small);
+    udp::socket tx(*io, udp::endpoint(ip::address_v4::loopback(), 0));
+    std::vector<uint8_t> bytes(512, 0);
+    for (size_t i = 0; i < 200; ++i)
+        tx.send_to(buffer(bytes), loopbackAddress(*flooded));
+
+    BOOST_CHECK(pollUntil(*io, [&]{ return flooded->stats().kernelDrops > 0; }));
+#else
+    BOOST_TEST_MESSAGE("SO_MEMINFO is not supported, kernel drops not checked");
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(socket_group_sharding)
+{
+    SocketOptions options;
+    options.pathMtuDiscovery = false;
+    SmartSocketGroup group(0, 2, options);
+    auto listener = std::make_shared<TestCollectingListener>();
+    group.registerProtocolListener(1, listener);
+    const udp::endpoint target(boost::asio::ip::address_v4::loopback(), group.port());
+
+    // peers from different ports are spread by kernel, each one lives on a single shard
+    const size_t cClients = 8;
+    auto io = std::make_shared<boost::asio::io_service>();
+    std::vector<SmartSocketPtr> clients;
+    std::vector<ConnectionPtr> conns;
+    for (size_t i = 0; i < cClients; ++i)
+    {
+        clients.push_back(std::make_shared<SmartSocket>(io, 0, options));
+        conns.push_back(clients.back()->getOrCreateConnection(target));
+    }
+    BOOST_REQUIRE(pollUntil(*io, [&]{ return std::all_of(conns.begin(), conns.end(),
+        [](const ConnectionPtr& conn){ return conn->isEstablished(); }); }));
+
+    for (size_t i = 0; i < cClients; ++i)
+        conns[i]->asyncSend(makeMessage(1, 100 + i, ReliableOrderedChannel));
+    BOOST_CHECK(pollUntil(*io, [&]
+    {
+        group.dispatchReceivedPackets();
+        return listener->packets().size() == cClients;
+    }));
+
+    std::set<size_t> shardsUsed;
+    for (size_t i = 0; i < cClients; ++i)
+    {
+        size_t owners = 0;
+        for (size_t s = 0; s < group.size(); ++s)
+        {
+            if (group.shard(s)->getExistingConnection(loopbackAddress(*clients[i])))
+            {
+                ++owners;
+                shardsUsed.insert(s);
+            }
+        }
+        BOOST_CHECK(owners == 1);
+        BOOST_CHECK(group.getExistingConnection(loopbackAddress(*clients[i])));
+    }
+    BOOST_TEST_MESSAGE("peers landed on " << shardsUsed.size() << " of " << group.size() << " shards");
+
+    // every message arrives whole in a buffer of its own
+    std::set<size_t> sizes;
+    std::set<const uint8_t*> buffers;
+    for (const PacketPtr& packet : listener->packets())
+    {
+        const PacketPtr expected = makeMessage(1, packet->buffer().size() - sizeof(PacketHeader), ReliableOrderedChannel);
+        BOOST_CHECK(std::equal(packet->buffer().begin() + sizeof(PacketHeader), packet->buffer().end(),
+                               expected->buffer().begin() + sizeof(PacketHeader)));
+        sizes.insert(packet->buffer().size());
+        buffers.insert(packet->buffer().data());
+    }
+    BOOST_CHECK(sizes.size() == cClients);
+    BOOST_CHECK(buffers.size() == cClients);
+}
+#endif
+
+
+BOOST_AUTO_TEST_CASE(handler_arena_recycling)
+{
+    using namespace boost::asio;
+
+    io_service service;
+    ip::udp::socket receiver(service, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+    ip::udp::socket sender(service, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+    const ip::udp::endpoint target = receiver.local_endpoint();
+
+    auto arena = std::make_shared<core::HandlerArena>();
+    std::array<uint8_t, 64> sendData = {}, recvData;
+    ip::udp::endpoint from;
+    size_t completions = 0;
+
+    auto roundTrip = [&]
+    {
+        sender.async_send_to(buffer(sendData), target, core::makeArenaHandler(arena,
+            [&](const boost::system::error_code&, size_t){ ++completions; }));
+        receiver.async_receive_from(buffer(recvData), from, core::makeArenaHandler(arena,
+            [&](const boost::system::error_code&, size_t){ ++completions; }));
+        service.run();
+        service.reset();
+    };
+
+    // first operations register sockets with reactor and fill the arena
+    for (int i = 0; i < 10; ++i)
+        roundTrip();
+
+    const uint64_t arenaBefore = arena->heapAllocations();
+    const size_t heapBefore = heapAllocationCount();
+    for (int i = 0; i < 100; ++i)
+        roundTrip();
+    const size_t heapAfter = heapAllocationCount();
+
+    BOOST_CHECK(completions == 220);
+    BOOST_CHECK(heapAfter == heapBefore);
+    BOOST_CHECK(arena->heapAllocations() == arenaBefore);
+}
+
+
 BOOST_AUTO_TEST_CASE(logger_streaming)
 {
     TestLogger testLog;
@@ -116,9 +1802,9 @@ BOOST_AUTO_TEST_CASE(packet_dispatcher)
     const udp::endpoint cDummyPeer;
     TestConnection testConn(cDummyPeer);
 
-    auto p1 = std::make_shared<core::Packet>(10);
-    auto p2 = std::make_shared<core::Packet>(20);
-    auto p3 = std::make_shared<core::Packet>(30);
+    auto p1 = core::makePacket(10);
+    auto p2 = core::makePacket(20);
+    auto p3 = core::makePacket(30);
     BOOST_CHECK(p1->buffer().size() == sizeof(core::PacketHeader));
 
     core::PacketPtr tmp;